@@ -47,12 +47,15 @@
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: xxx $")
 
 #include <ctype.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #ifdef HAVE_LINUX_COMPILER_H
 #include <linux/compiler.h>
@@ -69,9 +72,16 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: xxx $")
 #include <asterisk/causes.h>
 #include <asterisk/stringfields.h>
 #include <asterisk/musiconhold.h>
-#include <asterisk/sched.h>
 #include <asterisk/cli.h>
 #include <asterisk/devicestate.h>
+#include <asterisk/cdr.h>
+#include <asterisk/cel.h>
+#include <asterisk/taskprocessor.h>
+#include <asterisk/indications.h>
+#include <asterisk/localtime.h>
+#include <asterisk/manager.h>
+#include <asterisk/md5.h>
+#include <asterisk/paths.h>
 
 /* Lantiq TAPI includes */
 #include <drv_tapi/drv_tapi_io.h>
@@ -84,11 +94,48 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: xxx $")
 #define TAPI_TONE_LOCALE_CONGESTION_CODE        27
 #define TAPI_TONE_LOCALE_DIAL_CODE              25
 #define TAPI_TONE_LOCALE_WAITING_CODE           37
+#define LANTIQ_TONE_INDEX_BASE                  64    /* first user defined tone we load */
+#define LANTIQ_TONE_LEVEL                       -150  /* tone level in 0.1 dB             */
+#define LANTIQ_CADENCE_MAX                      16    /* ring cadences in the library     */
+#define LANTIQ_CADENCE_STEP                     50    /* ms per ring cadence bit          */
+#define LANTIQ_PROFILE_MAX                      16    /* DSP profiles incl. the default   */
+#define LANTIQ_PROFILE_PREFIX                   "profile-"
+#define LANTIQ_FAX_PROFILE                      "fax" /* voiceband data profile, optional */
 
 #define LANTIQ_CONTEXT_PREFIX "lantiq"
 #define DEFAULT_INTERDIGIT_TIMEOUT 2000
+#define DEFAULT_INTERDIGIT_LONG_TIMEOUT 5000
+#define LANTIQ_DIGITMAP_MAX_NODES 4096
+#define LANTIQ_DIGITMAP_MAX_ACTIVE 32
+#define LANTIQ_DIGITMAP_MAX_DEPTH 8
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_MEDIA_TIMEOUT 3000
+#define LANTIQ_MEDIA_READ_FAILS 10     /* read errors in a row that count as a stall */
+#define LANTIQ_MEDIA_RECOVERIES 3      /* coder rebuilds per call before giving up   */
+#define LANTIQ_JB_SAMPLES 64
+#define LANTIQ_TICK_MS 10
+#define LANTIQ_WHEEL_BITS 6
+#define LANTIQ_WHEEL_SIZE (1 << LANTIQ_WHEEL_BITS)
+#define LANTIQ_WHEEL_MASK (LANTIQ_WHEEL_SIZE - 1)
+#define LANTIQ_WHEEL_LEVELS 4
+#define LANTIQ_MONITOR_TIMEOUT 2000
+#define LANTIQ_CW_CID_DELAY 1000
+#define LANTIQ_CW_REPEAT 10000
 #define G723_HIGH_RATE	1
+#define LANTIQ_MEDIA_LOG_INTERVAL 10000 /* ms between media path summaries per port */
+
+/* Build with -DLANTIQ_MEDIA_DEBUG=1 for a debug line per anomalous media packet */
+#ifndef LANTIQ_MEDIA_DEBUG
+#define LANTIQ_MEDIA_DEBUG 0
+#endif
+
+#if LANTIQ_MEDIA_DEBUG
+#define lantiq_media_debug(...) ast_debug(1, __VA_ARGS__)
+#else
+#define lantiq_media_debug(...) do { } while (0)
+#endif
 #define LED_NAME_LENGTH 32
+#define LANTIQ_FW_MARKER "lantiq_firmware"
 
 static const char config[] = "lantiq.conf";
 
@@ -98,9 +145,77 @@ static char base_path[PATH_MAX] = "/dev/vmmc";
 static int per_channel_context = 0;
 
 /*
- * The private structures of the Phone Jack channels are linked for selecting
- * outgoing channels.
+ * Call progress tones played by the DSP. The names are the ones of
+ * indications.conf, the tones are preloaded into the DSP tone table.
  */
+enum lantiq_tone {
+	LANTIQ_TONE_DIAL,
+	LANTIQ_TONE_RING,
+	LANTIQ_TONE_BUSY,
+	LANTIQ_TONE_CONGESTION,
+	LANTIQ_TONE_WAITING,
+	LANTIQ_TONE_INFO,
+	LANTIQ_TONE_HOLD,
+	LANTIQ_TONE_MAX
+};
+
+static struct lantiq_tone_cfg {
+	const char *name;                /* indications.conf name                 */
+	int fallback;                    /* predefined tone if not loaded         */
+	char data[256];                  /* tone in indications.conf syntax       */
+} lantiq_tones[LANTIQ_TONE_MAX] = {
+	[LANTIQ_TONE_DIAL]       = { "dial",        TAPI_TONE_LOCALE_DIAL_CODE },
+	[LANTIQ_TONE_RING]       = { "ring",        TAPI_TONE_LOCALE_RINGING_CODE },
+	[LANTIQ_TONE_BUSY]       = { "busy",        TAPI_TONE_LOCALE_BUSY_CODE },
+	[LANTIQ_TONE_CONGESTION] = { "congestion",  TAPI_TONE_LOCALE_CONGESTION_CODE },
+	[LANTIQ_TONE_WAITING]    = { "callwaiting", TAPI_TONE_LOCALE_WAITING_CODE },
+	[LANTIQ_TONE_INFO]       = { "info",        TAPI_TONE_LOCALE_CONGESTION_CODE },
+	[LANTIQ_TONE_HOLD]       = { "hold",        TAPI_TONE_LOCALE_NONE },
+};
+
+/* Named ring cadence, entry 0 is the built-in default */
+static struct lantiq_cadence {
+	char name[32];                   /* [cadences] name, or Alert-Info token  */
+	IFX_TAPI_RING_CADENCE_t cadence; /* bit pattern, 1 bit per 50 ms          */
+} lantiq_cadences[LANTIQ_CADENCE_MAX];
+static int lantiq_cadence_count;
+
+/* [general] line settings, or a DSP profile's, see lantiq_line_apply() */
+struct lantiq_line_cfg {
+	int txgain;                      /* in dB                                 */
+	int rxgain;                      /* in dB                                 */
+	int wlec_type;                   /* IFX_TAPI_WLEC_TYPE_*                  */
+	int wlec_nlp;                    /* IFX_TAPI_WLEC_NLP_*                   */
+	int wlec_nbfe;                   /* narrowband far end window in ms       */
+	int wlec_nbne;                   /* narrowband near end window in ms      */
+	int wlec_wbne;                   /* wideband near end window in ms        */
+	int jb_type;                     /* IFX_TAPI_JB_TYPE_*                    */
+	int jb_pckadpt;                  /* IFX_TAPI_JB_PKT_ADAPT_*               */
+	int jb_localadpt;                /* IFX_TAPI_JB_LOCAL_ADAPT_*             */
+	int jb_scaling;
+	int jb_initialsize;              /* in timestamp units                    */
+	int jb_minsize;
+	int jb_maxsize;
+	int vad_type;                    /* IFX_TAPI_ENC_VAD_*                    */
+};
+
+/* Groups of line settings, see lantiq_line_apply() */
+enum lantiq_line_setting {
+	LANTIQ_LINE_VOLUME = 1 << 0,     /* txgain, rxgain                        */
+	LANTIQ_LINE_WLEC   = 1 << 1,     /* echocancel*                           */
+	LANTIQ_LINE_JB     = 1 << 2,     /* jitterbuffer*                         */
+	LANTIQ_LINE_CID    = 1 << 3,     /* calleridtype, calleridalert           */
+	LANTIQ_LINE_VAD    = 1 << 4,     /* voiceactivitydetection                */
+	LANTIQ_LINE_ALL    = (1 << 5) - 1
+};
+
+/* Named DSP profile, entry 0 holds the [general] line settings */
+static struct lantiq_profile {
+	char name[32];                   /* [profile-NAME], or "default"          */
+	struct lantiq_line_cfg line;
+} lantiq_profiles[LANTIQ_PROFILE_MAX];
+static int lantiq_profile_count;
+
 enum channel_state {
 	ONHOOK,
 	OFFHOOK,
@@ -111,14 +226,126 @@ enum channel_state {
 	UNKNOWN
 };
 
+/*
+ * Extension patterns reachable from a dialplan context, compiled into a
+ * trie over the 16 DTMF symbols. Each node stands for one dialed digit and
+ * holds the set of symbols it accepts, so a whole pattern position like
+ * [2-5] or X is a single edge.
+ */
+#define DIGITMAP_TERMINAL   (1 << 0)     /* an extension ends here                */
+#define DIGITMAP_LOOP       (1 << 1)     /* node repeats ('.' and '!' wildcards)  */
+#define DIGITMAP_EARLY      (1 << 2)     /* '!': doesn't count as "match more"    */
+
+struct lantiq_digitmap_node {
+	uint16_t mask;                   /* accepted symbols                      */
+	uint16_t flags;
+	int child;                       /* first child, 0 if none                */
+	int sibling;                     /* next sibling, 0 if none               */
+};
+
+struct lantiq_digitmap {
+	int version;                     /* dialplan version this was built from  */
+	int usable;                      /* 0 if we must ask the dialplan instead */
+	int len;                         /* nodes in use, node 0 is the root      */
+	struct lantiq_digitmap_node nodes[LANTIQ_DIGITMAP_MAX_NODES];
+};
+
+struct lantiq_pvt;
+
+/* A per-port timer, kept in the timer wheel of the monitor thread */
+struct lantiq_timer {
+	struct lantiq_timer *next;       /* next timer in the same slot           */
+	struct lantiq_timer **pprev;     /* link pointing to us, NULL if stopped  */
+	uint64_t expires;                /* tick the timer fires at               */
+	struct lantiq_pvt *pvt;          /* argument of cb                        */
+	void (*cb)(struct lantiq_pvt *pvt); /* called with iflock held            */
+};
+
+/* How the digits collected so far match the port's dialplan context */
+enum lantiq_match {
+	LANTIQ_MATCH_NONE,               /* nothing can match, fail right away    */
+	LANTIQ_MATCH_PARTIAL,            /* prefix of an extension, wait (long)   */
+	LANTIQ_MATCH_AMBIGUOUS,          /* complete, but may match more (short)  */
+	LANTIQ_MATCH_COMPLETE            /* only one possible match, dial now     */
+};
+
+/* When the PBX is started for a call placed from a port */
+enum lantiq_overlap {
+	LANTIQ_OVERLAP_OFF,              /* once the whole number was collected   */
+	LANTIQ_OVERLAP_FIRSTDIGIT,       /* on the first digit, stream the rest   */
+	LANTIQ_OVERLAP_OFFHOOK           /* right at offhook, stream every digit  */
+};
+
+/* Work handed from the event handlers to a port's taskprocessor */
+enum lantiq_task_type {
+	LANTIQ_TASK_PREPARE,             /* offhook: refresh the digit map        */
+	LANTIQ_TASK_DIGITS,              /* wait for more digits or dial now?     */
+	LANTIQ_TASK_DIAL,                /* dial the digits if the exten exists   */
+	LANTIQ_TASK_START,               /* start the PBX on exten                */
+	LANTIQ_TASK_HANGUP,              /* queue a hangup on chan                */
+	LANTIQ_TASK_SETUP,               /* set up the port's TAPI channel        */
+	LANTIQ_TASK_FAX,                 /* send chan to the fax extension        */
+	LANTIQ_TASK_TRACE                /* write the port trace to disk          */
+};
+
+struct lantiq_task {
+	enum lantiq_task_type type;
+	struct lantiq_pvt *pvt;
+	unsigned int gen;                /* pvt->call_gen when queued             */
+	struct ast_channel *chan;        /* referenced channel for HANGUP         */
+	char exten[AST_MAX_EXTENSION];   /* digits or extension to call, or reason */
+};
+
+/* One periodic jitter buffer / RTCP statistics snapshot */
+struct lantiq_jb_sample {
+	uint32_t time;                   /* ms since the call started         */
+	uint16_t size;                   /* Jitter buffer size                */
+	uint16_t delay;                  /* Jitter buffer: playout delay      */
+	uint32_t underflow;              /* Jitter buffer injected samples    */
+	uint32_t overflow;               /* Jitter buffer dropped samples     */
+	uint32_t invalid;                /* Jitter buffer invalid packets     */
+	int32_t lost;                    /* RTCP: cumulative packets lost     */
+	uint32_t jitter;                 /* RTCP: interarrival jitter         */
+	uint8_t fraction;                /* RTCP: fraction lost (1/256)       */
+};
+
+/*
+ * The private structures of the Phone Jack channels are linked for selecting
+ * outgoing channels.
+ */
 static struct lantiq_pvt {
 	struct ast_channel *owner;       /* Channel we belong to, possibly NULL   */
 	int port_id;                     /* Port number of this object, 0..n      */
 	int channel_state;
 	char context[AST_MAX_CONTEXT];   /* this port's dialplan context          */
-	int dial_timer;                  /* timer handle for autodial timeout     */
+	struct lantiq_digitmap *digitmap; /* compiled patterns of the context     */
+	struct lantiq_timer dial_timer;  /* autodial timeout                      */
 	char dtmfbuf[AST_MAX_EXTENSION]; /* buffer holding dialed digits          */
 	int dtmfbuf_len;                 /* lenght of dtmfbuf                     */
+	int overlap;                     /* digits are streamed to a running PBX  */
+	char bbd_filename[PATH_MAX];     /* line coefficients, empty for default  */
+	struct ast_taskprocessor *tps;   /* runs dialplan lookups and call setup  */
+	unsigned int call_gen;           /* bumped on onhook, stales queued tasks */
+	unsigned int line_pending;       /* LANTIQ_LINE_CID a reload left for onhook */
+	int profile;                     /* port's DSP profile                    */
+	struct lantiq_line_cfg line;     /* line settings the DSP channel runs    */
+	int fax_detect;                  /* watch calls for fax and modem tones   */
+	int fax_armed;                   /* the DSP's tone detectors are enabled  */
+	int fax_mode;                    /* call switched to voiceband data       */
+	int line_fault;                  /* SLIC shut the line down, out of service */
+	char hotline[AST_MAX_EXTENSION]; /* extension dialed at offhook, or empty */
+	int hotline_delay;               /* warm line: ms to wait for a 1st digit */
+	struct lantiq_timer hotline_timer; /* warm line delay                     */
+	int call_waiting;                /* offer a 2nd call while in a call      */
+	struct ast_channel *waiting;     /* 2nd call, waiting or on hold          */
+	format_t waiting_format;         /* codec to use when switching to it     */
+	struct lantiq_timer cw_timer;    /* call waiting CID and tone repetition  */
+	int cw_cid_sent;                 /* off-hook CID went out for the waiting */
+	int cadence;                     /* port's default ring cadence           */
+	int cid_std;                     /* IFX_TAPI_CID_STD_*                    */
+	int cid_alert;                   /* ETSI: CID before/after the 1st ring   */
+	IFX_TAPI_CID_MSG_ELEMENT_t cid_elements[3]; /* reused for every CID       */
+	int ring_cadence;                /* cadence programmed, -1 if unknown     */
 	int rtp_timestamp;               /* timestamp for RTP packets             */
 	int ptime;			 /* Codec base ptime			  */
 	char rtp_payload;		 /* Internal RTP payload code in use	  */
@@ -128,13 +355,258 @@ static struct lantiq_pvt {
 	uint32_t call_setup_delay;       /* time between ^ and 1st ring in ms     */
 	uint32_t call_start;             /* time we started dialling / answered   */
 	uint32_t call_answer;            /* time the callee answered our call     */
+	uint64_t kpi_last_digit;         /* monotonic us of the last dialed digit */
+	uint64_t kpi_answer;             /* monotonic us of the answer event      */
+	int kpi_uplink_pending;          /* waiting for first RTP from the DSP    */
+	int kpi_downlink_pending;        /* waiting for first RTP to the DSP      */
 	uint16_t jb_size;                /* Jitter buffer size                    */
 	uint32_t jb_underflow;           /* Jitter buffer injected samples        */
 	uint32_t jb_overflow;            /* Jitter buffer dropped samples         */
 	uint16_t jb_delay;               /* Jitter buffer: playout delay          */
 	uint16_t jb_invalid;             /* Jitter buffer: Nr. of invalid packets */
+	uint32_t jb_packets;             /* Jitter buffer: Nr. of received packets*/
+	uint32_t jb_late;                /* Jitter buffer: Nr. of late packets    */
+	uint32_t jb_early;               /* Jitter buffer: Nr. of early packets   */
+	int stats_valid;                 /* JB stats of this call read in INCALL  */
+	int32_t rtcp_lost;               /* RTCP: cumulative packets lost         */
+	uint32_t rtcp_jitter;            /* RTCP: interarrival jitter             */
+	uint8_t rtcp_fraction;           /* RTCP: fraction lost (1/256)           */
+	struct lantiq_timer stats_timer; /* statistics sampling                   */
+	struct lantiq_timer media_timer; /* media watchdog                        */
+	volatile uint32_t media_rx;      /* ms of the last RTP read from the DSP  */
+	volatile uint32_t media_tx;      /* ms of the last RTP written to the DSP */
+	int read_fails;                  /* failed reads in a row                 */
+	int media_recoveries;            /* coder rebuilds during this call       */
+	uint32_t stats_start;            /* Start of statistics sampling in ms    */
+	struct lantiq_jb_sample jb_samples[LANTIQ_JB_SAMPLES]; /* sample ring   */
+	unsigned int jb_sample_head;     /* next slot to be written in the ring   */
+	unsigned int jb_sample_count;    /* valid samples in the ring             */
 } *iflist = NULL;
 
+/*
+ * Per-port hot path counters. They are only ever touched with atomic
+ * operations so they can be read and reset without taking iflock.
+ */
+static struct lantiq_port_stats {
+	volatile int rx_packets;         /* RTP packets read from the DSP         */
+	volatile int tx_packets;         /* RTP packets written to the DSP        */
+	volatile int short_writes;       /* Incomplete writes to the DSP          */
+	volatile int write_errors;       /* Failed writes to the DSP              */
+	volatile int trylock_drops;      /* Frames dropped on a busy channel lock */
+	volatile int pt_mismatches;      /* Frames with unexpected payload type   */
+	volatile int cn_frames;          /* Comfort noise frames dropped          */
+	volatile int codec_mismatches;   /* Frames to write in another codec      */
+	volatile int empty_frames;       /* Empty voice frames to write           */
+	volatile int other_frames;       /* Frames to write that aren't voice     */
+	volatile int read_errors;        /* Failed reads from the DSP             */
+	volatile int ioctl_errors;       /* Failed TAPI ioctls on this port       */
+	volatile int media_stalls;       /* Calls the media watchdog found stuck  */
+	volatile int media_recoveries;   /* Coder channels rebuilt successfully   */
+} port_stats[TAPI_AUDIO_PORT_NUM_MAX];
+
+#define LANTIQ_STAT_INC(c, field) ast_atomic_fetchadd_int(&port_stats[(c)].field, 1)
+
+/* Counters standing in for per-packet log lines, see lantiq_media_summary() */
+static const struct {
+	const char *name;
+	size_t offset;
+} media_anomalies[] = {
+	{ "payload type mismatches", offsetof(struct lantiq_port_stats, pt_mismatches) },
+	{ "codec mismatches", offsetof(struct lantiq_port_stats, codec_mismatches) },
+	{ "empty frames", offsetof(struct lantiq_port_stats, empty_frames) },
+	{ "non-voice frames", offsetof(struct lantiq_port_stats, other_frames) },
+	{ "lock drops", offsetof(struct lantiq_port_stats, trylock_drops) },
+	{ "short writes", offsetof(struct lantiq_port_stats, short_writes) },
+	{ "write errors", offsetof(struct lantiq_port_stats, write_errors) },
+	{ "read errors", offsetof(struct lantiq_port_stats, read_errors) },
+};
+
+/* Monitor thread only: counter values at the last summary */
+static struct {
+	uint32_t next;                   /* ms the next summary is due            */
+	struct lantiq_port_stats last[TAPI_AUDIO_PORT_NUM_MAX];
+} media_summary;
+
+/* What a port trace record is about */
+enum lantiq_trace_type {
+	LANTIQ_TRACE_STATE,              /* channel_state changed, arg is the line */
+	LANTIQ_TRACE_EVENT,              /* TAPI event, arg is the event ID       */
+	LANTIQ_TRACE_IOCTL,              /* failed ioctl, arg is the command      */
+	LANTIQ_TRACE_STALL,              /* media watchdog fired, arg is the try  */
+	LANTIQ_TRACE_FAULT,              /* line fault set (1) or cleared (0)     */
+	LANTIQ_TRACE_MAX
+};
+
+static const char * const trace_names[LANTIQ_TRACE_MAX] = {
+	[LANTIQ_TRACE_STATE] = "state",
+	[LANTIQ_TRACE_EVENT] = "event",
+	[LANTIQ_TRACE_IOCTL] = "ioctl",
+	[LANTIQ_TRACE_STALL] = "stall",
+	[LANTIQ_TRACE_FAULT] = "fault",
+};
+
+#define LANTIQ_TRACE_SIZE 256            /* records per port, a power of 2        */
+#define LANTIQ_TRACE_FILE "lantiq_trace%i.log" /* in the log dir, see lantiq_trace_dump() */
+
+/*
+ * Always-on binary trace of each port, cheap enough for the hot paths. Any
+ * thread claims a record with an atomic increment, no lock is taken.
+ */
+struct lantiq_trace_rec {
+	uint64_t time;                   /* monotonic us                          */
+	uint32_t arg;
+	uint8_t type;                    /* enum lantiq_trace_type                */
+	uint8_t old_state;               /* enum channel_state                    */
+	uint8_t new_state;
+	uint8_t pad;
+};
+
+static struct lantiq_trace {
+	volatile int head;               /* records ever written                  */
+	struct lantiq_trace_rec rec[LANTIQ_TRACE_SIZE];
+} port_trace[TAPI_AUDIO_PORT_NUM_MAX];
+
+/* log2 histogram of durations in microseconds; bucket n counts [2^n, 2^(n+1)) */
+#define LANTIQ_HIST_BUCKETS 24
+struct lantiq_histogram {
+	volatile int count;
+	volatile int max;                /* longest duration seen in us           */
+	volatile int bucket[LANTIQ_HIST_BUCKETS];
+};
+
+/* Signalling latency KPIs, aggregated per port */
+enum lantiq_kpi {
+	LANTIQ_KPI_DIALTONE,             /* offhook event to dial tone            */
+	LANTIQ_KPI_POSTDIAL,             /* last digit to ast_pbx_start()         */
+	LANTIQ_KPI_INTERDIGIT,           /* last digit to interdigit timeout      */
+	LANTIQ_KPI_TALKPATH_UP,          /* answer to first uplink RTP packet     */
+	LANTIQ_KPI_TALKPATH_DOWN,        /* answer to first downlink RTP packet   */
+	LANTIQ_KPI_MAX
+};
+
+static const char * const kpi_names[LANTIQ_KPI_MAX] = {
+	[LANTIQ_KPI_DIALTONE] = "Offhook to dial tone",
+	[LANTIQ_KPI_POSTDIAL] = "Last digit to PBX start",
+	[LANTIQ_KPI_INTERDIGIT] = "Interdigit timeout wait",
+	[LANTIQ_KPI_TALKPATH_UP] = "Answer to first uplink RTP",
+	[LANTIQ_KPI_TALKPATH_DOWN] = "Answer to first downlink RTP",
+};
+
+static struct lantiq_histogram port_kpi[TAPI_AUDIO_PORT_NUM_MAX][LANTIQ_KPI_MAX];
+
+/* Call count, failures and latency of every TAPI ioctl code we issue */
+struct lantiq_ioctl_stats {
+	const char *name;
+	unsigned long cmd;
+	volatile int calls;
+	volatile int errors;
+	struct lantiq_histogram latency;
+};
+
+#define LANTIQ_IOCTL_ENTRY(cmd) { #cmd, cmd }
+static struct lantiq_ioctl_stats ioctl_stats[] = {
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_EVENT_GET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_LINE_FEED_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_LINE_HOOK_STATUS_GET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_RING_START),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_RING_STOP),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_CID_TX_SEQ_START),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_TONE_LOCAL_PLAY),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_ENC_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_ENC_START),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_ENC_STOP),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_DEC_START),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_DEC_STOP),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_JB_STATISTICS_GET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_PKT_RTCP_STATISTICS_GET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_JB_STATISTICS_RESET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_PKT_RTCP_STATISTICS_RESET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_DEV_START),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_DEV_STOP),
+	LANTIQ_IOCTL_ENTRY(FIO_FW_DOWNLOAD),
+	LANTIQ_IOCTL_ENTRY(FIO_GET_VERS),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_LINE_TYPE_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_RING_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_RING_CADENCE_HR_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_MAP_DATA_ADD),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_MAP_DATA_REMOVE),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_PHONE_VOLUME_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_WLEC_PHONE_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_JB_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_CID_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_ENC_VAD_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_PKT_RTP_PT_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_TONE_TABLE_CFG_SET),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_SIG_DETECT_ENABLE),
+	LANTIQ_IOCTL_ENTRY(IFX_TAPI_SIG_DETECT_DISABLE),
+	{ "other", 0 }                   /* must be last */
+};
+
+/*
+ * TAPI events outside the call flow: counted per event ID and recorded in a
+ * trace ring. Only the monitor thread writes them, it fills a slot before
+ * publishing it, so readers go without a lock.
+ */
+#define LANTIQ_EVENT_IDS   32            /* distinct event IDs counted            */
+#define LANTIQ_EVENT_TRACE 64            /* trace ring entries, a power of 2      */
+
+static struct lantiq_event_count {
+	volatile int id;
+	volatile int count;
+} event_counts[LANTIQ_EVENT_IDS];
+static volatile int event_counts_lost;   /* events of IDs the table had no room for */
+
+static struct lantiq_event_trace {
+	struct timeval tv;
+	int port;
+	int id;
+	int data;                        /* event.data.value                      */
+	const char *action;              /* what was done about the event         */
+} event_trace[LANTIQ_EVENT_TRACE];
+static volatile int event_trace_head;    /* entries ever recorded                 */
+
+#define LANTIQ_EVENT_ENTRY(name) { #name, IFX_TAPI_EVENT_##name }
+static const struct {
+	const char *name;
+	int id;
+} lantiq_event_names[] = {
+	LANTIQ_EVENT_ENTRY(FXS_ONHOOK),
+	LANTIQ_EVENT_ENTRY(FXS_OFFHOOK),
+	LANTIQ_EVENT_ENTRY(FXS_FLASH),
+	LANTIQ_EVENT_ENTRY(DTMF_DIGIT),
+	LANTIQ_EVENT_ENTRY(PULSE_DIGIT),
+	LANTIQ_EVENT_ENTRY(COD_DEC_CHG),
+	LANTIQ_EVENT_ENTRY(TONE_GEN_END),
+	LANTIQ_EVENT_ENTRY(CID_TX_SEQ_END),
+	LANTIQ_EVENT_ENTRY(FAXMODEM_CED),
+	LANTIQ_EVENT_ENTRY(FAXMODEM_CEDEND),
+	LANTIQ_EVENT_ENTRY(FAXMODEM_DIS),
+	LANTIQ_EVENT_ENTRY(FAXMODEM_CNGFAX),
+	LANTIQ_EVENT_ENTRY(FAXMODEM_CNGMOD),
+	LANTIQ_EVENT_ENTRY(FAXMODEM_AM),
+	LANTIQ_EVENT_ENTRY(FAXMODEM_V21H),
+	LANTIQ_EVENT_ENTRY(FAULT_LINE_GK_LOW),
+	LANTIQ_EVENT_ENTRY(FAULT_LINE_GK_HIGH),
+	LANTIQ_EVENT_ENTRY(FAULT_LINE_OVERTEMP),
+	LANTIQ_EVENT_ENTRY(FAULT_LINE_OVERTEMP_END),
+	LANTIQ_EVENT_ENTRY(LT_GR909_RDY),
+	LANTIQ_EVENT_ENTRY(CID_TX_NOACK_ERR),
+	LANTIQ_EVENT_ENTRY(CID_TX_RINGCAD_ERR),
+};
+
+static const char *lantiq_event_name(int id)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(lantiq_event_names); i++) {
+		if (lantiq_event_names[i].id == id) {
+			return lantiq_event_names[i].name;
+		}
+	}
+
+	return "unknown";
+}
+
 static struct lantiq_ctx {
 		int dev_fd;
 		int channels;
@@ -142,8 +614,29 @@ static struct lantiq_ctx {
 		char voip_led[LED_NAME_LENGTH];                        /* VOIP LED name */
 		char ch_led[TAPI_AUDIO_PORT_NUM_MAX][LED_NAME_LENGTH]; /* FXS LED names */
                 int interdigit_timeout; /* Timeout in ms between dialed digits */
+		int interdigit_long_timeout; /* Timeout in ms while no extension matches yet */
+		int digit_matching;     /* Dial as soon as the digits match a single extension */
+		int overlap_dial;       /* enum lantiq_overlap */
+		int call_waiting;       /* default for the ports' callwaiting */
+		int fax_detect;         /* default for the ports' faxdetect */
+		int stats_interval;     /* JB/RTCP sampling interval in ms, 0 disables */
+		int media_timeout;      /* ms without RTP from the DSP that count as a stall, 0 disables */
+		int ready;              /* the DSP is set up, see lantiq_dev_init_thread() */
+		int fw_keep;            /* leave the DSP running on unload, see lantiq_fw_marker() */
+		int fw_kept;            /* the DSP was left running by the last unload */
+		char fw_md5[33];        /* MD5 of the firmware file */
+		char tone_zone[16];     /* indications.conf country, empty for the default */
+		int tones[LANTIQ_TONE_MAX]; /* DSP tone table index, see lantiq_tones_load() */
 } dev_ctx;
 
+/* Ports being set up in parallel on their taskprocessors, see lantiq_dev_init() */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	int pending;                     /* ports still being set up              */
+	int failed;                      /* ports whose setup failed              */
+} port_setup;
+
 static int ast_digit_begin(struct ast_channel *ast, char digit);
 static int ast_digit_end(struct ast_channel *ast, char digit, unsigned int duration);
 static int ast_lantiq_call(struct ast_channel *ast, char *dest, int timeout);
@@ -157,9 +650,24 @@ static int ast_lantiq_fixup(struct ast_channel *old, struct ast_channel *new);
 static struct ast_channel *ast_lantiq_requester(const char *type, format_t format, const struct ast_channel *requestor, void *data, int *cause);
 static int ast_lantiq_devicestate(void *data);
 static int acf_channel_read(struct ast_channel *chan, const char *funcname, char *args, char *buf, size_t buflen);
+static int acf_channel_write(struct ast_channel *chan, const char *function, char *data, const char *value);
 static void lantiq_jb_get_stats(int c);
+static void lantiq_rtcp_get_stats(int c);
+static void lantiq_stats_reset(int c);
+static void lantiq_quality_publish(struct ast_channel *ast, const struct lantiq_pvt *pvt);
+static void lantiq_stats_start(struct lantiq_pvt *pvt);
+static void lantiq_stats_stop(struct lantiq_pvt *pvt);
+static void lantiq_media_watch_stop(struct lantiq_pvt *pvt);
 static int lantiq_conf_enc(int c, format_t formatid);
 static void lantiq_reset_dtmfbuf(struct lantiq_pvt *pvt);
+static int lantiq_start_overlap(struct lantiq_pvt *pvt);
+static int lantiq_task_push(struct lantiq_pvt *pvt, enum lantiq_task_type type, const char *exten, struct ast_channel *chan);
+static void lantiq_teardown(struct lantiq_pvt *pvt);
+static void lantiq_event_dial_timeout(struct lantiq_pvt *pvt);
+static int lantiq_send_digit(int c, char digit);
+static int lantiq_hotline_start(struct lantiq_pvt *pvt);
+static void lantiq_hotline_stop(struct lantiq_pvt *pvt);
+static int lantiq_port_setup(int c);
 
 static const struct ast_channel_tech lantiq_tech = {
 	.type = "TAPI",
@@ -177,7 +685,8 @@ static const struct ast_channel_tech lantiq_tech = {
 	.fixup = ast_lantiq_fixup,
 	.requester = ast_lantiq_requester,
 	.devicestate = ast_lantiq_devicestate,
-	.func_channel_read = acf_channel_read
+	.func_channel_read = acf_channel_read,
+	.func_channel_write = acf_channel_write
 };
 
 /* Protect the interface list (of lantiq_pvt's) */
@@ -189,8 +698,14 @@ AST_MUTEX_DEFINE_STATIC(iflock);
  */
 AST_MUTEX_DEFINE_STATIC(monlock);
 
-/* The scheduling thread */
-struct ast_sched_thread *sched_thread;
+/* Hierarchical timer wheel of all port timers, run by the monitor thread */
+static struct lantiq_wheel {
+	uint64_t next;                   /* next tick to process                  */
+	uint64_t deadline;               /* tick the monitor will wake up at      */
+	int armed;                       /* timers in the wheel                   */
+	int pipe[2];                     /* wakes the monitor for earlier timers  */
+	struct lantiq_timer *slots[LANTIQ_WHEEL_LEVELS][LANTIQ_WHEEL_SIZE];
+} wheel = { .pipe = { -1, -1 } };
    
 /*
  * This is the thread for the monitor which checks for input on the channels
@@ -198,6 +713,9 @@ struct ast_sched_thread *sched_thread;
  */
 static pthread_t monitor_thread = AST_PTHREADT_NULL;
 
+/* This is the thread that brings up the DSP, see lantiq_dev_init_thread() */
+static pthread_t init_thread = AST_PTHREADT_NULL;
+
 
 #define WORDS_BIGENDIAN
 /* struct taken from some GPLed code by  Mike Borella */
@@ -302,6 +820,13 @@ static uint32_t now(void) {
 	return (uint32_t) tmp;
 }
 
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static uint32_t epoch(void) {
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
@@ -309,1067 +834,4105 @@ static uint32_t epoch(void) {
 	return tv.tv_sec;
 }
 
-static int lantiq_dev_open(const char *dev_path, const int32_t ch_num)
+/* Current time in timer wheel ticks */
+static uint64_t lantiq_tick(void)
 {
-	char dev_name[PATH_MAX];
-	memset(dev_name, 0, sizeof(dev_name));
-	snprintf(dev_name, PATH_MAX, "%s%u%u", dev_path, 1, ch_num);
-	return open((const char*)dev_name, O_RDWR, 0644);
+	return now_us() / (LANTIQ_TICK_MS * 1000);
 }
 
-static void lantiq_ring(int c, int r, const char *cid, const char *name)
+/* Called with iflock held */
+static void lantiq_timer_link(struct lantiq_timer *t)
 {
-	uint8_t status;
+	uint64_t idx = t->expires - wheel.next;
+	struct lantiq_timer **slot;
+
+	if (t->expires < wheel.next) {
+		/* already due, run with the next tick */
+		slot = &wheel.slots[0][wheel.next & LANTIQ_WHEEL_MASK];
+	} else if (idx < 1ULL << LANTIQ_WHEEL_BITS) {
+		slot = &wheel.slots[0][t->expires & LANTIQ_WHEEL_MASK];
+	} else if (idx < 1ULL << (2 * LANTIQ_WHEEL_BITS)) {
+		slot = &wheel.slots[1][(t->expires >> LANTIQ_WHEEL_BITS) & LANTIQ_WHEEL_MASK];
+	} else if (idx < 1ULL << (3 * LANTIQ_WHEEL_BITS)) {
+		slot = &wheel.slots[2][(t->expires >> (2 * LANTIQ_WHEEL_BITS)) & LANTIQ_WHEEL_MASK];
+	} else {
+		if (idx >= 1ULL << (4 * LANTIQ_WHEEL_BITS)) {
+			t->expires = wheel.next + (1ULL << (4 * LANTIQ_WHEEL_BITS)) - 1;
+		}
+		slot = &wheel.slots[3][(t->expires >> (3 * LANTIQ_WHEEL_BITS)) & LANTIQ_WHEEL_MASK];
+	}
 
-	if (r) {
-		led_blink(dev_ctx.ch_led[c], LED_FAST_BLINK);
-		if (!cid) {
-			status = (uint8_t) ioctl(dev_ctx.ch_fd[c], IFX_TAPI_RING_START, 0);
-		} else {
-			IFX_TAPI_CID_MSG_t msg;
-			IFX_TAPI_CID_MSG_ELEMENT_t elements[3];
-			int count = 0;
-			time_t timestamp;
-			struct tm *tm;
-
-			elements[count].string.elementType = IFX_TAPI_CID_ST_CLI;
-			elements[count].string.len = strlen(cid);
-			if (elements[count].string.len > IFX_TAPI_CID_MSG_LEN_MAX) {
-				elements[count].string.len = IFX_TAPI_CID_MSG_LEN_MAX;
-			}
-			strncpy((char *)elements[count++].string.element, cid, IFX_TAPI_CID_MSG_LEN_MAX);
+	t->next = *slot;
+	if (t->next) {
+		t->next->pprev = &t->next;
+	}
+	t->pprev = slot;
+	*slot = t;
+}
 
-			elements[count].string.elementType = IFX_TAPI_CID_ST_NAME;
-			elements[count].string.len = strlen(name);
-			if (elements[count].string.len > IFX_TAPI_CID_MSG_LEN_MAX) {
-				elements[count].string.len = IFX_TAPI_CID_MSG_LEN_MAX;
-			}
-			strncpy((char *)elements[count++].string.element, name, IFX_TAPI_CID_MSG_LEN_MAX);
-
-			if ((time(&timestamp) != -1) && ((tm=localtime(&timestamp)) != NULL)) {
-				elements[count].date.elementType = IFX_TAPI_CID_ST_DATE;
-				elements[count].date.day = tm->tm_mday;
-				elements[count].date.month = tm->tm_mon;
-				elements[count].date.hour = tm->tm_hour;
-				elements[count].date.mn = tm->tm_min;
-				count++;
-			}
+/* Called with iflock held */
+static void lantiq_timer_unlink(struct lantiq_timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next) {
+		t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
+}
 
-			msg.txMode = IFX_TAPI_CID_HM_ONHOOK;
-			msg.messageType = IFX_TAPI_CID_MT_CSUP;
-			msg.message = elements;
-			msg.nMsgElements = count;
+/* Called with iflock held */
+static int lantiq_timer_pending(const struct lantiq_timer *t)
+{
+	return t->pprev != NULL;
+}
 
-			status = (uint8_t) ioctl(dev_ctx.ch_fd[c], IFX_TAPI_CID_TX_SEQ_START, (IFX_int32_t) &msg);
-		}
-	} else {
-		status = (uint8_t) ioctl(dev_ctx.ch_fd[c], IFX_TAPI_RING_STOP, 0);
-		led_off(dev_ctx.ch_led[c]);
+/* Called with iflock held. (Re)arms t to call cb(pvt) in ms milliseconds. */
+static void lantiq_timer_start(struct lantiq_timer *t, struct lantiq_pvt *pvt, int ms, void (*cb)(struct lantiq_pvt *pvt))
+{
+	const uint64_t tick = lantiq_tick();
+
+	if (lantiq_timer_pending(t)) {
+		lantiq_timer_unlink(t);
+		wheel.armed--;
+	}
+	if (!wheel.armed) {
+		/* nothing to catch up with, skip the idle ticks */
+		wheel.next = tick;
 	}
 
-	if (status) {
-		ast_log(LOG_ERROR, "%s ioctl failed\n",
-			(r ? "IFX_TAPI_RING_START" : "IFX_TAPI_RING_STOP"));
+	t->pvt = pvt;
+	t->cb = cb;
+	t->expires = tick + (ms + LANTIQ_TICK_MS - 1) / LANTIQ_TICK_MS;
+	lantiq_timer_link(t);
+	wheel.armed++;
+
+	if (t->expires < wheel.deadline && wheel.pipe[1] >= 0) {
+		/* the monitor sleeps longer than that, wake it up */
+		if (write(wheel.pipe[1], "", 1) < 0 && errno != EAGAIN) {
+			ast_log(LOG_WARNING, "unable to wake the monitor thread: %s\n", strerror(errno));
+		}
 	}
 }
 
-static int lantiq_play_tone(int c, int t)
+/* Called with iflock held */
+static void lantiq_timer_stop(struct lantiq_timer *t)
 {
-	/* stop currently playing tone before starting new one */
-	if (t != TAPI_TONE_LOCALE_NONE) {
-		ioctl(dev_ctx.ch_fd[c], IFX_TAPI_TONE_LOCAL_PLAY, TAPI_TONE_LOCALE_NONE);
+	if (lantiq_timer_pending(t)) {
+		lantiq_timer_unlink(t);
+		wheel.armed--;
 	}
+}
 
-	if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_TONE_LOCAL_PLAY, t)) {
-		ast_log(LOG_DEBUG, "IFX_TAPI_TONE_LOCAL_PLAY ioctl failed\n");
-		return -1;
+/* Called with iflock held. Moves the timers of a higher level slot down. */
+static int lantiq_timer_cascade(int level, int index)
+{
+	struct lantiq_timer *t = wheel.slots[level][index];
+
+	wheel.slots[level][index] = NULL;
+	while (t) {
+		struct lantiq_timer *next = t->next;
+
+		lantiq_timer_link(t);
+		t = next;
 	}
 
-	return 0;
+	return index;
 }
 
-static enum channel_state lantiq_get_hookstatus(int port)
+#define LANTIQ_WHEEL_INDEX(n) ((wheel.next >> ((n + 1) * LANTIQ_WHEEL_BITS)) & LANTIQ_WHEEL_MASK)
+
+/* Called with iflock held from the monitor thread. Runs all expired timers. */
+static void lantiq_timer_run(void)
 {
-	uint8_t status;
+	const uint64_t tick = lantiq_tick();
 
-	if (ioctl(dev_ctx.ch_fd[port], IFX_TAPI_LINE_HOOK_STATUS_GET, &status)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_LINE_HOOK_STATUS_GET ioctl failed\n");
-		return UNKNOWN;
-	}
+	while (wheel.armed && wheel.next <= tick) {
+		const int index = wheel.next & LANTIQ_WHEEL_MASK;
+		struct lantiq_timer *list, *t;
 
-	if (status) {
-		return OFFHOOK;
-	} else {
-		return ONHOOK;
+		if (!index &&
+				!lantiq_timer_cascade(1, LANTIQ_WHEEL_INDEX(0)) &&
+				!lantiq_timer_cascade(2, LANTIQ_WHEEL_INDEX(1))) {
+			lantiq_timer_cascade(3, LANTIQ_WHEEL_INDEX(2));
+		}
+		wheel.next++;
+
+		/* callbacks may stop or rearm timers, so detach the slot first */
+		list = wheel.slots[0][index];
+		wheel.slots[0][index] = NULL;
+		if (list) {
+			list->pprev = &list;
+		}
+		while ((t = list)) {
+			lantiq_timer_unlink(t);
+			wheel.armed--;
+			t->cb(t->pvt);
+		}
 	}
 }
 
-static int
-lantiq_dev_binary_buffer_create(const char *path, uint8_t **ppBuf, uint32_t *pBufSz)
+/* Called with iflock held. Milliseconds the monitor may sleep before the next timer. */
+static int lantiq_timer_timeout(void)
 {
-	FILE *fd;
-	struct stat file_stat;
-	int status = -1;
+	const uint64_t tick = lantiq_tick();
+	uint64_t expires;
+	int i;
 
-	fd = fopen(path, "rb");
-	if (fd == NULL) {
-		ast_log(LOG_ERROR, "binary file %s open failed\n", path);
-		goto on_exit;
+	if (!wheel.armed) {
+		wheel.deadline = tick + LANTIQ_MONITOR_TIMEOUT / LANTIQ_TICK_MS;
+		return LANTIQ_MONITOR_TIMEOUT;
 	}
 
-	if (stat(path, &file_stat)) {
-		ast_log(LOG_ERROR, "file %s statistics get failed\n", path);
-		goto on_exit;
+	/* first used slot of the lowest level before the next cascade */
+	for (i = 0; i < LANTIQ_WHEEL_SIZE - (wheel.next & LANTIQ_WHEEL_MASK); i++) {
+		if (wheel.slots[0][(wheel.next + i) & LANTIQ_WHEEL_MASK]) {
+			break;
+		}
 	}
+	expires = wheel.next + i;
 
-	*ppBuf = malloc(file_stat.st_size);
-	if (*ppBuf == NULL) {
-		ast_log(LOG_ERROR, "binary file %s memory allocation failed\n", path);
-		goto on_exit;
+	wheel.deadline = expires;
+	if (expires <= tick) {
+		return 0;
 	}
-
-	if (fread (*ppBuf, sizeof(uint8_t), file_stat.st_size, fd) != file_stat.st_size) {
-		ast_log(LOG_ERROR, "file %s read failed\n", path);
-		status = -1;
-		goto on_exit;
+	if (expires - tick > LANTIQ_MONITOR_TIMEOUT / LANTIQ_TICK_MS) {
+		wheel.deadline = tick + LANTIQ_MONITOR_TIMEOUT / LANTIQ_TICK_MS;
+		return LANTIQ_MONITOR_TIMEOUT;
 	}
 
-	*pBufSz = file_stat.st_size;
-	status = 0;
+	return (expires - tick) * LANTIQ_TICK_MS;
+}
 
-on_exit:
-	if (fd != NULL)
-		fclose(fd);
+static void lantiq_hist_add(struct lantiq_histogram *h, uint64_t us)
+{
+	int b = 0;
 
-	if (*ppBuf != NULL && status)
-		free(*ppBuf);
+	while ((us >> (b + 1)) && b < LANTIQ_HIST_BUCKETS - 1) {
+		b++;
+	}
 
-	return status;
+	ast_atomic_fetchadd_int(&h->bucket[b], 1);
+	ast_atomic_fetchadd_int(&h->count, 1);
+	if (us > (uint32_t) h->max) {
+		/* racy, but only ever used for reporting */
+		h->max = us > INT_MAX ? INT_MAX : us;
+	}
 }
 
-static int32_t lantiq_dev_firmware_download(int32_t fd, const char *path)
+static void lantiq_hist_reset(struct lantiq_histogram *h)
 {
-	uint8_t *firmware = NULL;
-	uint32_t size = 0;
-	VMMC_IO_INIT vmmc_io_init;
+	int b;
 
-	ast_log(LOG_DEBUG, "loading firmware: \"%s\".\n", path);
+	h->count = 0;
+	h->max = 0;
+	for (b = 0; b < LANTIQ_HIST_BUCKETS; b++) {
+		h->bucket[b] = 0;
+	}
+}
 
-	if (lantiq_dev_binary_buffer_create(path, &firmware, &size))
-		return -1;
+/* Print the non-empty buckets of a histogram on a single CLI line */
+static void lantiq_hist_print(int fd, const struct lantiq_histogram *h)
+{
+	char line[256];
+	char *p = line;
+	size_t left = sizeof(line);
+	int b;
+
+	line[0] = '\0';
+	for (b = 0; b < LANTIQ_HIST_BUCKETS; b++) {
+		if (h->bucket[b]) {
+			ast_build_string(&p, &left, " %uus:%u", b ? 1U << b : 0, (uint32_t) h->bucket[b]);
+		}
+	}
+	ast_cli(fd, "      %s\n", line);
+}
 
-	memset(&vmmc_io_init, 0, sizeof(VMMC_IO_INIT));
-	vmmc_io_init.pPRAMfw = firmware;
-	vmmc_io_init.pram_size = size;
+static int lantiq_fd_port(int fd)
+{
+	int c;
 
-	if (ioctl(fd, FIO_FW_DOWNLOAD, &vmmc_io_init)) {
-		ast_log(LOG_ERROR, "FIO_FW_DOWNLOAD ioctl failed\n");
-		return -1;
+	for (c = 0; c < dev_ctx.channels; c++) {
+		if (dev_ctx.ch_fd[c] == fd) {
+			return c;
+		}
 	}
 
-	if (firmware != NULL)
-		free(firmware);
+	return -1;
+}
 
-	return 0;
+/* Appends a record to the port's trace ring, lock-free so any thread may call it */
+static void lantiq_trace(int c, enum lantiq_trace_type type, int old_state, int new_state, uint32_t arg)
+{
+	struct lantiq_trace *t = &port_trace[c];
+	struct lantiq_trace_rec *rec = &t->rec[ast_atomic_fetchadd_int(&t->head, 1) & (LANTIQ_TRACE_SIZE - 1)];
+
+	rec->time = now_us();
+	rec->arg = arg;
+	rec->type = type;
+	rec->old_state = old_state;
+	rec->new_state = new_state;
 }
 
-static const char *state_string(enum channel_state s)
+/* Called with iflock held. Every channel_state change of a running port goes through here. */
+static void lantiq_state_change(struct lantiq_pvt *pvt, enum channel_state state, int line)
 {
-	switch (s) {
-		case ONHOOK: return "ONHOOK";
-		case OFFHOOK: return "OFFHOOK";
-		case DIALING: return "DIALING";
-		case INCALL: return "INCALL";
-		case CALL_ENDED: return "CALL_ENDED";
-		case RINGING: return "RINGING";
-		default: return "UNKNOWN";
-	}
+	lantiq_trace(pvt->port_id, LANTIQ_TRACE_STATE, pvt->channel_state, state, line);
+	pvt->channel_state = state;
 }
+#define lantiq_state_set(pvt, state) lantiq_state_change((pvt), (state), __LINE__)
 
-static const char *control_string(int c)
+/* Name of an ioctl code in the statistics table, "other" if it isn't listed */
+static const char *lantiq_ioctl_name(uint32_t cmd)
 {
-	switch (c) {
-		case AST_CONTROL_HANGUP: return "Other end has hungup";
-		case AST_CONTROL_RING: return "Local ring";
-		case AST_CONTROL_RINGING: return "Remote end is ringing";
-		case AST_CONTROL_ANSWER: return "Remote end has answered";
-		case AST_CONTROL_BUSY: return "Remote end is busy";
-		case AST_CONTROL_TAKEOFFHOOK: return "Make it go off hook";
-		case AST_CONTROL_OFFHOOK: return "Line is off hook";
-		case AST_CONTROL_CONGESTION: return "Congestion (circuits busy)";
-		case AST_CONTROL_FLASH: return "Flash hook";
-		case AST_CONTROL_WINK: return "Wink";
-		case AST_CONTROL_OPTION: return "Set a low-level option";
-		case AST_CONTROL_RADIO_KEY: return "Key Radio";
-		case AST_CONTROL_RADIO_UNKEY: return "Un-Key Radio";
-		case AST_CONTROL_PROGRESS: return "Remote end is making Progress";
-		case AST_CONTROL_PROCEEDING: return "Remote end is proceeding";
-		case AST_CONTROL_HOLD: return "Hold";
-		case AST_CONTROL_UNHOLD: return "Unhold";
-		case AST_CONTROL_SRCUPDATE: return "Media Source Update";
-		case AST_CONTROL_CONNECTED_LINE: return "Connected Line";
-		case AST_CONTROL_REDIRECTING: return "Redirecting";
-		case AST_CONTROL_INCOMPLETE: return "Incomplete";
-		case -1: return "Stop tone";
-		default: return "Unknown";
+	const struct lantiq_ioctl_stats *st = ioctl_stats;
+
+	while (st->cmd && (uint32_t) st->cmd != cmd) {
+		st++;
 	}
+
+	return st->name;
 }
 
-static int ast_lantiq_indicate(struct ast_channel *chan, int condition, const void *data, size_t datalen)
+/*
+ * All TAPI ioctls go through here so call counts, failures and the time
+ * spent inside the driver are accounted per ioctl code.
+ */
+static int lantiq_ioctl_timed(int fd, unsigned long cmd, unsigned long arg)
 {
-	ast_verb(3, "phone indication \"%s\"\n", control_string(condition));
+	struct lantiq_ioctl_stats *st = ioctl_stats;
+	uint64_t start;
+	int res, c;
 
-	struct lantiq_pvt *pvt = chan->tech_pvt;
+	while (st->cmd && st->cmd != cmd) {
+		st++;
+	}
 
-	switch (condition) {
-		case -1:
-			{
-				lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_NONE);
-				return 0;
-			}
-		case AST_CONTROL_CONGESTION:
-		case AST_CONTROL_BUSY:
-			{
-				lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_BUSY_CODE);
-				return 0;
-			}
-		case AST_CONTROL_RINGING:
-		case AST_CONTROL_PROGRESS:
-			{
-				pvt->call_setup_delay = now() - pvt->call_setup_start;
-				lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_RINGING_CODE);
-				return 0;
-			}
-		default:
-			{
-				/* -1 lets asterisk generate the tone */
-				return -1;
-			}
+	start = now_us();
+	res = ioctl(fd, cmd, arg);
+	lantiq_hist_add(&st->latency, now_us() - start);
+
+	ast_atomic_fetchadd_int(&st->calls, 1);
+	if (res) {
+		ast_atomic_fetchadd_int(&st->errors, 1);
+		if ((c = lantiq_fd_port(fd)) >= 0) {
+			LANTIQ_STAT_INC(c, ioctl_errors);
+			lantiq_trace(c, LANTIQ_TRACE_IOCTL, iflist[c].channel_state, iflist[c].channel_state, cmd);
+		}
 	}
+
+	return res;
 }
+#define lantiq_ioctl(fd, cmd, arg) lantiq_ioctl_timed((fd), (cmd), (unsigned long) (arg))
 
-static int ast_lantiq_fixup(struct ast_channel *old, struct ast_channel *new)
+/* Account the time elapsed since a monotonic us timestamp to a port KPI */
+static void lantiq_kpi_add(int c, enum lantiq_kpi kpi, uint64_t since)
 {
-	ast_log(LOG_DEBUG, "entering... no code here...\n");
-	return 0;
+	if (since) {
+		lantiq_hist_add(&port_kpi[c][kpi], now_us() - since);
+	}
 }
 
-static int ast_digit_begin(struct ast_channel *chan, char digit)
+/* Called with iflock held when a call gets answered on either side */
+static void lantiq_kpi_answer(struct lantiq_pvt *pvt)
 {
-	/* TODO: Modify this callback to let Asterisk support controlling the length of DTMF */
-	ast_log(LOG_DEBUG, "entering... no code here...\n");
-	return 0;
+	pvt->kpi_answer = now_us();
+	pvt->kpi_uplink_pending = 1;
+	pvt->kpi_downlink_pending = 1;
 }
 
-static int ast_digit_end(struct ast_channel *ast, char digit, unsigned int duration)
+static int lantiq_dev_open(const char *dev_path, const int32_t ch_num)
 {
-	ast_log(LOG_DEBUG, "entering... no code here...\n");
-	return 0;
+	char dev_name[PATH_MAX];
+	memset(dev_name, 0, sizeof(dev_name));
+	snprintf(dev_name, PATH_MAX, "%s%u%u", dev_path, 1, ch_num);
+	return open((const char*)dev_name, O_RDWR, 0644);
 }
 
-static int ast_lantiq_call(struct ast_channel *ast, char *dest, int timeout)
-{
-	int res = 0;
+/* CID standards by calleridtype name */
+static const struct {
+	const char *name;
+	int std;
+} lantiq_cid_stds[] = {
+	{ "telecordia", IFX_TAPI_CID_STD_TELCORDIA },
+	{ "etsifsk", IFX_TAPI_CID_STD_ETSI_FSK },
+	{ "etsidtmf", IFX_TAPI_CID_STD_ETSI_DTMF },
+	{ "sin", IFX_TAPI_CID_STD_SIN },
+	{ "ntt", IFX_TAPI_CID_STD_NTT },
+	{ "kpndtmf", IFX_TAPI_CID_STD_KPN_DTMF },
+	{ "kpndtmffsk", IFX_TAPI_CID_STD_KPN_DTMF_FSK },
+};
 
-	/* lock to prevent simultaneous access with do_monitor thread processing */
-	ast_mutex_lock(&iflock);
+/* ETSI CID alerting by calleridalert name */
+static const struct {
+	const char *name;
+	int alert;
+} lantiq_cid_alerts[] = {
+	{ "firstring", IFX_TAPI_CID_ALERT_ETSI_FR },
+	{ "dtas", IFX_TAPI_CID_ALERT_ETSI_DTAS },
+	{ "ringpulse", IFX_TAPI_CID_ALERT_ETSI_RP },
+	{ "linereversal", IFX_TAPI_CID_ALERT_ETSI_LRDTAS },
+};
 
-	struct lantiq_pvt *pvt = ast->tech_pvt;
-	ast_log(LOG_DEBUG, "state: %s\n", state_string(pvt->channel_state));
+static int lantiq_cid_std_parse(const char *value)
+{
+	int i;
 
-	if (pvt->channel_state == ONHOOK) {
-		ast_log(LOG_DEBUG, "port %i is ringing\n", pvt->port_id);
+	for (i = 0; i < ARRAY_LEN(lantiq_cid_stds); i++) {
+		if (!strcasecmp(value, lantiq_cid_stds[i].name)) {
+			return lantiq_cid_stds[i].std;
+		}
+	}
 
-		const char *cid = ast->connected.id.number.valid ? ast->connected.id.number.str : NULL;
-		const char *name = ast->connected.id.name.valid ? ast->connected.id.name.str : NULL;
-		ast_log(LOG_DEBUG, "port %i CID: %s <%s>\n", pvt->port_id, cid ? cid : "none", name ? name : "");
+	return -1;
+}
 
-		lantiq_ring(pvt->port_id, 1, cid, name);
-		pvt->channel_state = RINGING;
+static int lantiq_cid_alert_parse(const char *value)
+{
+	int i;
 
-		ast_setstate(ast, AST_STATE_RINGING);
-		ast_queue_control(ast, AST_CONTROL_RINGING);
-	} else {
-		ast_log(LOG_DEBUG, "port %i is busy\n", pvt->port_id);
-		ast_setstate(ast, AST_STATE_BUSY);
-		ast_queue_control(ast, AST_CONTROL_BUSY);
-		res = -1;
+	for (i = 0; i < ARRAY_LEN(lantiq_cid_alerts); i++) {
+		if (!strcasecmp(value, lantiq_cid_alerts[i].name)) {
+			return lantiq_cid_alerts[i].alert;
+		}
 	}
 
-	ast_mutex_unlock(&iflock);
+	return -1;
+}
 
-	return res;
+/*
+ * Driver defaults of the ETSI CID timing in ms. A std_cfg handed to
+ * IFX_TAPI_CID_CFG_SET replaces every one of them, not just the alert.
+ */
+#define LANTIQ_CID_ETSI_CFG(alert) { \
+	.nETSIAlertRing = (alert), \
+	.nETSIAlertNoRing = IFX_TAPI_CID_ALERT_ETSI_DTAS, \
+	.nAlertToneOnhook = 0,             /* driver's own DT-AS tone */ \
+	.nAlertToneOffhook = 0, \
+	.ringPulseTime = 500, \
+	.dataOut2restoreTimeOnhook = 300, \
+	.dataOut2restoreTimeOffhook = 300, \
+	.nAckTone = 'D', \
+	.ack2dataOutDelay = 60, \
+	.cas2ackTime = 160, \
+	.afterRingPulseTime = 500, \
+	.afterFirstRing = 600, \
+	.nOSItime = 200, \
 }
 
-static int ast_lantiq_hangup(struct ast_channel *ast)
+/*
+ * Configures the port's CID standard, and for ETSI when CID is sent. The
+ * driver keeps its own settings unless another alert than the first ring is
+ * asked for.
+ */
+static int lantiq_cid_cfg(struct lantiq_pvt *pvt)
 {
-	/* lock to prevent simultaneous access with do_monitor thread processing */
-	ast_mutex_lock(&iflock);
+	IFX_TAPI_CID_CFG_t cid_cfg;
+	IFX_TAPI_CID_STD_TYPE_t std_cfg;
 
-	struct lantiq_pvt *pvt = ast->tech_pvt;
-	ast_log(LOG_DEBUG, "state: %s\n", state_string(pvt->channel_state));
-	
-	if (ast->_state == AST_STATE_RINGING) {
-		// FIXME
-		ast_debug(1, "TAPI: ast_lantiq_hangup(): ast->_state == AST_STATE_RINGING\n");
-	}
+	memset(&cid_cfg, 0, sizeof(cid_cfg));
+	cid_cfg.nStandard = pvt->cid_std;
 
-	switch (pvt->channel_state) {
-		case RINGING:
-		case ONHOOK: 
-			lantiq_ring(pvt->port_id, 0, NULL, NULL);
-			pvt->channel_state = ONHOOK;
-			break;
-		default:
-			ast_log(LOG_DEBUG, "we were hung up, play busy tone\n");
-			pvt->channel_state = CALL_ENDED;
-			lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_BUSY_CODE);
+	if (pvt->cid_alert != IFX_TAPI_CID_ALERT_ETSI_FR) {
+		switch (pvt->cid_std) {
+			case IFX_TAPI_CID_STD_ETSI_FSK:
+				std_cfg.etsiFSK = (IFX_TAPI_CID_STD_ETSI_FSK_t) LANTIQ_CID_ETSI_CFG(pvt->cid_alert);
+				cid_cfg.cfg = &std_cfg;
+				break;
+			case IFX_TAPI_CID_STD_ETSI_DTMF:
+				std_cfg.etsiDTMF = (IFX_TAPI_CID_STD_ETSI_DTMF_t) LANTIQ_CID_ETSI_CFG(pvt->cid_alert);
+				cid_cfg.cfg = &std_cfg;
+				break;
+		}
 	}
 
-	lantiq_jb_get_stats(pvt->port_id);
+	return lantiq_ioctl(dev_ctx.ch_fd[pvt->port_id], IFX_TAPI_CID_CFG_SET, &cid_cfg);
+}
 
-	ast_setstate(ast, AST_STATE_DOWN);
-	ast_module_unref(ast_module_info->self);
-	ast->tech_pvt = NULL;
-	pvt->owner = NULL;
+/*
+ * CID date, only converted again when the minute changes. ast_localtime()
+ * caches the zone and is thread-safe unlike localtime().
+ */
+static struct {
+	time_t expires;                  /* start of the next minute              */
+	IFX_uint32_t day, month, hour, mn;
+} cid_date;
 
-	ast_mutex_unlock(&iflock);
+/* Called with iflock held */
+static void lantiq_cid_date(IFX_TAPI_CID_MSG_ELEMENT_t *element)
+{
+	struct timeval tv = ast_tvnow();
 
-	return 0;
+	if (tv.tv_sec >= cid_date.expires) {
+		struct ast_tm tm;
+
+		ast_localtime(&tv, &tm, NULL);
+		cid_date.day = tm.tm_mday;
+		cid_date.month = tm.tm_mon + 1;
+		cid_date.hour = tm.tm_hour;
+		cid_date.mn = tm.tm_min;
+		cid_date.expires = tv.tv_sec - tm.tm_sec + 60;
+	}
+
+	element->date.elementType = IFX_TAPI_CID_ST_DATE;
+	element->date.day = cid_date.day;
+	element->date.month = cid_date.month;
+	element->date.hour = cid_date.hour;
+	element->date.mn = cid_date.mn;
 }
 
-static int ast_lantiq_answer(struct ast_channel *ast)
+static void lantiq_cid_string(IFX_TAPI_CID_MSG_ELEMENT_t *element, IFX_TAPI_CID_SERVICE_TYPE_t type, const char *s)
 {
-	ast_log(LOG_DEBUG, "Remote end has answered call.\n");
-	struct lantiq_pvt *pvt = ast->tech_pvt;
-
-	if (lantiq_conf_enc(pvt->port_id, ast->writeformat))
-		return -1;
+	IFX_uint32_t len;
 
-	pvt->call_answer = epoch();
-	return 0;
+	element->string.elementType = type;
+	for (len = 0; len < IFX_TAPI_CID_MSG_LEN_MAX && s[len]; len++) {
+		element->string.element[len] = s[len];
+	}
+	element->string.len = len;
 }
 
-static struct ast_frame * ast_lantiq_read(struct ast_channel *ast)
+/*
+ * Called with iflock held. Sends Caller ID with the first ring (onhook) or to
+ * a caller in a call (offhook), the message is built in the port's buffer.
+ */
+static int lantiq_send_cid(int c, int mode, const char *cid, const char *name)
 {
-	ast_log(LOG_DEBUG, "entering... no code here...\n");
-	return NULL;
+	IFX_TAPI_CID_MSG_ELEMENT_t *elements = iflist[c].cid_elements;
+	IFX_TAPI_CID_MSG_t msg;
+	int count = 0;
+
+	lantiq_cid_string(&elements[count++], IFX_TAPI_CID_ST_CLI, cid);
+	if (name) {
+		lantiq_cid_string(&elements[count++], IFX_TAPI_CID_ST_NAME, name);
+	}
+	lantiq_cid_date(&elements[count++]);
+
+	msg.txMode = mode;
+	msg.messageType = IFX_TAPI_CID_MT_CSUP;
+	msg.message = elements;
+	msg.nMsgElements = count;
+
+	return lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_CID_TX_SEQ_START, (IFX_int32_t) &msg);
 }
 
-static int lantiq_conf_enc(int c, format_t formatid)
+/*
+ * Converts "on/off[,on/off...]" in ms into a TAPI ring cadence. Returns -1 if
+ * the value is malformed or doesn't fit.
+ */
+static int lantiq_cadence_parse(const char *data, IFX_TAPI_RING_CADENCE_t *cadence)
 {
-	/* Configure encoder before starting RTP session */
-	IFX_TAPI_ENC_CFG_t enc_cfg;
+	char *buf = ast_strdupa(data), *part;
+	unsigned int bits = 0;
 
-	memset(&enc_cfg, 0, sizeof(IFX_TAPI_ENC_CFG_t));
-	switch (formatid) {
-		case AST_FORMAT_G723_1:
-#if defined G723_HIGH_RATE
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G723_63;
-			iflist[c].rtp_payload = RTP_G723_63;
-#else
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G723_53;
-			iflist[c].rtp_payload = RTP_G723_53;
-#endif
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_30;
-			iflist[c].ptime = 30;
-			break;
-		case AST_FORMAT_G729A:
-			 enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G729;
-			 enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
-			 iflist[c].ptime = 10;
-			 iflist[c].rtp_payload = RTP_G729;
-			 break;
-		case AST_FORMAT_ULAW:
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_MLAW;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
-			iflist[c].ptime = 10;
-			iflist[c].rtp_payload = RTP_PCMU;
-			break;
-		case AST_FORMAT_ALAW:
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_ALAW;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
-			iflist[c].ptime = 10;
-			iflist[c].rtp_payload = RTP_PCMA;
-			break;
-		case AST_FORMAT_G726:
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G726_32;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
-			iflist[c].ptime = 10;
-			iflist[c].rtp_payload = RTP_G726;
-			break;
-		case AST_FORMAT_ILBC:
-			/* iLBC 15.2kbps is currently unsupported by Asterisk */
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_ILBC_133;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_30;
-			iflist[c].ptime = 30;
-			iflist[c].rtp_payload = RTP_ILBC;
-			break;
-		case AST_FORMAT_SLINEAR:
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_LIN16_8;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
-			iflist[c].ptime = 10;
-			iflist[c].rtp_payload = RTP_SLIN8;
-			break;
-		case AST_FORMAT_SLINEAR16:
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_LIN16_16;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_10;
-			iflist[c].ptime = 10;
-			iflist[c].rtp_payload = RTP_SLIN16;
-			break;
-		case AST_FORMAT_G722:
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G722_64;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
-			iflist[c].ptime = 20;
-			iflist[c].rtp_payload = RTP_G722;
-			break;
-		case AST_FORMAT_SIREN7:
-			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G7221_32;
-			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
-			iflist[c].ptime = 20;
-			iflist[c].rtp_payload = RTP_SIREN7;
-			break;
-		default:
-			ast_log(LOG_ERROR, "unsupported format %llu (%s)\n", formatid, ast_getformatname(formatid));
-			return -1;
-	}
-	iflist[c].codec = formatid;
-	ast_log(LOG_DEBUG, "Configuring encoder to use TAPI codec type %d (%s) on channel %i\n", enc_cfg.nEncType, ast_getformatname(formatid), c);
+	memset(cadence, 0, sizeof(*cadence));
 
-	if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_CFG_SET, &enc_cfg)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_ENC_CFG_SET %d failed\n", c);
-	}
+	while ((part = strsep(&buf, ","))) {
+		unsigned int on, off;
 
-	if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_START, 0)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_ENC_START ioctl failed\n");
+		if (sscanf(part, "%30u/%30u", &on, &off) != 2) {
+			return -1;
+		}
+		on = (on + LANTIQ_CADENCE_STEP / 2) / LANTIQ_CADENCE_STEP;
+		off = (off + LANTIQ_CADENCE_STEP / 2) / LANTIQ_CADENCE_STEP;
+		if (bits + on + off > sizeof(cadence->data) * 8) {
+			return -1;
+		}
+		for (; on; on--, bits++) {
+			cadence->data[bits / 8] |= 0x80 >> (bits % 8);
+		}
+		bits += off;
 	}
 
-	if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_DEC_START, 0)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_DEC_START ioctl failed\n");
+	if (!bits) {
+		return -1;
 	}
+	cadence->nr = bits;
 
 	return 0;
 }
 
+/* Returns the library index of the cadence called name, or -1 */
+static int lantiq_cadence_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < lantiq_cadence_count; i++) {
+		if (!strcasecmp(lantiq_cadences[i].name, name)) {
+			return i;
+		}
+	}
 
-static int ast_lantiq_write(struct ast_channel *ast, struct ast_frame *frame)
+	return -1;
+}
+
+/*
+ * Picks the ring cadence for a call: the LANTIQ_CADENCE channel variable,
+ * else the ALERT_INFO one (e.g. "<http://127.0.0.1/Bellcore-dr2>" or
+ * "info=dr2"), else the port's default.
+ */
+static int lantiq_cadence_select(struct lantiq_pvt *pvt, struct ast_channel *chan)
 {
-	char buf[RTP_BUFFER_LEN];
-	rtp_header_t *rtp_header = (rtp_header_t *) buf;
-	struct lantiq_pvt *pvt = ast->tech_pvt;
-	int ret;
+	const char *var;
+	char *alert, *s;
+	int i;
 
-	if(frame->frametype != AST_FRAME_VOICE) {
-		ast_log(LOG_DEBUG, "unhandled frame type\n");
-		return 0;
+	if ((var = pbx_builtin_getvar_helper(chan, "LANTIQ_CADENCE")) && !ast_strlen_zero(var)) {
+		if ((i = lantiq_cadence_find(var)) >= 0) {
+			return i;
+		}
+		ast_log(LOG_WARNING, "Unknown ring cadence '%s' for %s\n", var, chan->name);
 	}
 
-	if(frame->subclass.codec != pvt->codec) {
-		ast_debug(1, "Received AST voice frame type %llu (%s) but %s was expected.\n", frame->subclass.codec, ast_getformatname(frame->subclass.codec), ast_getformatname(pvt->codec));
-		return 0;
+	if ((var = pbx_builtin_getvar_helper(chan, "ALERT_INFO")) && !ast_strlen_zero(var)) {
+		alert = ast_strdupa(var);
+		if ((s = strcasestr(alert, "info="))) {
+			alert = s + 5;
+		} else if ((s = strrchr(alert, '/'))) {
+			alert = s + 1;
+		}
+		alert = ast_strip_quoted(alert, "<", ">");
+		alert[strcspn(alert, ";>")] = '\0';
+		if ((i = lantiq_cadence_find(alert)) >= 0) {
+			return i;
+		}
+		ast_debug(1, "no ring cadence for Alert-Info '%s'\n", var);
 	}
 
-	if (frame->datalen == 0) {
-		ast_log(LOG_DEBUG, "we've been prodded\n");
+	return pvt->cadence;
+}
+
+/* Called with iflock held. Programs a cadence unless it's the current one already. */
+static int lantiq_cadence_set(struct lantiq_pvt *pvt, int cadence)
+{
+	if (pvt->ring_cadence == cadence) {
 		return 0;
 	}
 
-	rtp_header->version      = 2;
-	rtp_header->padding      = 0;
-	rtp_header->extension    = 0;
-	rtp_header->csrc_count   = 0;
-	rtp_header->marker       = 0;
-	rtp_header->ssrc         = 0;
-	rtp_header->payload_type = pvt->rtp_payload;
+	if (lantiq_ioctl(dev_ctx.ch_fd[pvt->port_id], IFX_TAPI_RING_CADENCE_HR_SET, &lantiq_cadences[cadence].cadence)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_RING_CADENCE_HR_SET failed\n");
+		pvt->ring_cadence = -1;
+		return -1;
+	}
+	ast_debug(1, "port %i rings with cadence %s\n", pvt->port_id + 1, lantiq_cadences[cadence].name);
+	pvt->ring_cadence = cadence;
 
-	const int subframes = (iflist[pvt->port_id].ptime + frame->len - 1) / iflist[pvt->port_id].ptime; /* number of subframes in AST frame */
-	const int subframes_rtp = (RTP_BUFFER_LEN - RTP_HEADER_LEN) * subframes / frame->datalen; /* how many frames fit in a single RTP packet */
+	return 0;
+}
 
-	/* By default stick to the maximum multiple of native frame length */
-	int length = subframes_rtp * frame->datalen / subframes;
-	int samples = length * frame->samples / frame->datalen;
+/*
+ * Issues the line settings selected by what (LANTIQ_LINE_*) to a port. The
+ * CID settings are the port's own, the rest come from line.
+ */
+static int lantiq_line_apply(int c, const struct lantiq_line_cfg *line, unsigned int what)
+{
+	IFX_TAPI_LINE_VOLUME_t line_vol;
+	IFX_TAPI_WLEC_CFG_t wlec_cfg;
+	IFX_TAPI_JB_CFG_t jb_cfg;
 
-	char *head = frame->data.ptr;
-	const char *tail = frame->data.ptr + frame->datalen;
-	while (head < tail) {
-		rtp_header->seqno        = pvt->rtp_seqno++;
-		rtp_header->timestamp    = pvt->rtp_timestamp;
+	/* set volume */
+	if (what & LANTIQ_LINE_VOLUME) {
+		memset(&line_vol, 0, sizeof(line_vol));
+		line_vol.nGainRx = line->rxgain;
+		line_vol.nGainTx = line->txgain;
 
-		if ((tail - head) < (RTP_BUFFER_LEN - RTP_HEADER_LEN)) {
-			length = tail - head;
-			samples = length * frame->samples / frame->datalen;
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_PHONE_VOLUME_SET, &line_vol)) {
+			ast_log(LOG_ERROR, "IFX_TAPI_PHONE_VOLUME_SET %d failed\n", c);
+			return -1;
 		}
+	}
 
-		memcpy(buf + RTP_HEADER_LEN, head, length);
-		head += length;
-		pvt->rtp_timestamp += (rtp_header->payload_type == RTP_G722) ? samples / 2 : samples; /* per RFC3551 */
+	/* Configure line echo canceller */
+	if (what & LANTIQ_LINE_WLEC) {
+		memset(&wlec_cfg, 0, sizeof(wlec_cfg));
+		wlec_cfg.nType = line->wlec_type;
+		wlec_cfg.bNlp = line->wlec_nlp;
+		wlec_cfg.nNBFEwindow = line->wlec_nbfe;
+		wlec_cfg.nNBNEwindow = line->wlec_nbne;
+		wlec_cfg.nWBNEwindow = line->wlec_wbne;
 
-		ret = write(dev_ctx.ch_fd[pvt->port_id], buf, RTP_HEADER_LEN + length);
-		if (ret < 0) {
-			ast_debug(1, "TAPI: ast_lantiq_write(): error writing.\n");
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_WLEC_PHONE_CFG_SET, &wlec_cfg)) {
+			ast_log(LOG_ERROR, "IFX_TAPI_WLEC_PHONE_CFG_SET %d failed\n", c);
 			return -1;
 		}
-		if (ret != (RTP_HEADER_LEN + length)) {
-			ast_log(LOG_WARNING, "Short TAPI write of %d bytes, expected %d bytes\n", ret, RTP_HEADER_LEN + length);
-			continue;
-		}
+	}
 
-#ifdef TODO_DEVEL_INFO
-		ast_debug(1, "ast_lantiq_write(): size: %i version: %i padding: %i extension: %i csrc_count: %i\n"
-			 "marker: %i payload_type: %s seqno: %i timestamp: %i ssrc: %i\n",
-				 (int)ret,
-				 (int)rtp_header->version,
-				 (int)rtp_header->padding,
-				 (int)rtp_header->extension,
-				 (int)rtp_header->csrc_count,
-				 (int)rtp_header->marker,
-				 ast_codec2str(frame->subclass.codec),
-				 (int)rtp_header->seqno,
-				 (int)rtp_header->timestamp,
-				 (int)rtp_header->ssrc);
-#endif
+	/* Configure jitter buffer */
+	if (what & LANTIQ_LINE_JB) {
+		memset(&jb_cfg, 0, sizeof(jb_cfg));
+		jb_cfg.nJbType = line->jb_type;
+		jb_cfg.nPckAdpt = line->jb_pckadpt;
+		jb_cfg.nLocalAdpt = line->jb_localadpt;
+		jb_cfg.nScaling = line->jb_scaling;
+		jb_cfg.nInitialSize = line->jb_initialsize;
+		jb_cfg.nMinSize = line->jb_minsize;
+		jb_cfg.nMaxSize = line->jb_maxsize;
+
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_JB_CFG_SET, &jb_cfg)) {
+			ast_log(LOG_ERROR, "IFX_TAPI_JB_CFG_SET %d failed\n", c);
+			return -1;
+		}
+	}
+
+	/* Configure Caller ID type */
+	if ((what & LANTIQ_LINE_CID) && lantiq_cid_cfg(&iflist[c])) {
+		ast_log(LOG_ERROR, "IIFX_TAPI_CID_CFG_SET %d failed\n", c);
+		return -1;
+	}
+
+	/* Configure voice activity detection */
+	if ((what & LANTIQ_LINE_VAD) && lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_VAD_CFG_SET, line->vad_type)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_ENC_VAD_CFG_SET %d failed\n", c);
+		return -1;
 	}
 
 	return 0;
 }
 
-static int acf_channel_read(struct ast_channel *chan, const char *funcname, char *args, char *buf, size_t buflen)
+/* Returns the LANTIQ_LINE_* groups in which a and b differ */
+static unsigned int lantiq_line_diff(const struct lantiq_line_cfg *a, const struct lantiq_line_cfg *b)
 {
-	struct lantiq_pvt *pvt;
-	int res = 0;
+	unsigned int what = 0;
 
-	if (!chan || chan->tech != &lantiq_tech) {
-		ast_log(LOG_ERROR, "This function requires a valid Lantiq TAPI channel\n");
-		return -1;
+	if (a->txgain != b->txgain || a->rxgain != b->rxgain) {
+		what |= LANTIQ_LINE_VOLUME;
+	}
+	if (a->wlec_type != b->wlec_type || a->wlec_nlp != b->wlec_nlp
+		|| a->wlec_nbfe != b->wlec_nbfe || a->wlec_nbne != b->wlec_nbne
+		|| a->wlec_wbne != b->wlec_wbne) {
+		what |= LANTIQ_LINE_WLEC;
+	}
+	if (a->jb_type != b->jb_type || a->jb_pckadpt != b->jb_pckadpt
+		|| a->jb_localadpt != b->jb_localadpt || a->jb_scaling != b->jb_scaling
+		|| a->jb_initialsize != b->jb_initialsize || a->jb_minsize != b->jb_minsize
+		|| a->jb_maxsize != b->jb_maxsize) {
+		what |= LANTIQ_LINE_JB;
+	}
+	if (a->vad_type != b->vad_type) {
+		what |= LANTIQ_LINE_VAD;
 	}
 
-	ast_mutex_lock(&iflock);
+	return what;
+}
 
-	pvt = (struct lantiq_pvt*) chan->tech_pvt;
+/*
+ * Called with iflock held. Switches the port to line, issuing only the groups
+ * that differ from what the port runs with.
+ */
+static int lantiq_line_set(struct lantiq_pvt *pvt, const struct lantiq_line_cfg *line)
+{
+	unsigned int what = lantiq_line_diff(&pvt->line, line);
 
-	if (!strcasecmp(args, "csd")) {
-		snprintf(buf, buflen, "%lu", (unsigned long int) pvt->call_setup_delay);
-	} else if (!strcasecmp(args, "jitter_stats")){
-		lantiq_jb_get_stats(pvt->port_id);
-		snprintf(buf, buflen, "jbBufSize=%u,jbUnderflow=%u,jbOverflow=%u,jbDelay=%u,jbInvalid=%u",
-				(uint32_t) pvt->jb_size,
-				(uint32_t) pvt->jb_underflow,
-				(uint32_t) pvt->jb_overflow,
-				(uint32_t) pvt->jb_delay,
-				(uint32_t) pvt->jb_invalid);
-	} else if (!strcasecmp(args, "jbBufSize")) {
-		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_size);
-	} else if (!strcasecmp(args, "jbUnderflow")) {
-		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_underflow);
-	} else if (!strcasecmp(args, "jbOverflow")) {
-		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_overflow);
-	} else if (!strcasecmp(args, "jbDelay")) {
-		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_delay);
-	} else if (!strcasecmp(args, "jbInvalid")) {
-		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_invalid);
-	} else if (!strcasecmp(args, "start")) {
-		struct tm *tm = gmtime((const time_t*)&pvt->call_start);
-		strftime(buf, buflen, "%F %T", tm);
-	} else if (!strcasecmp(args, "answer")) {
-		struct tm *tm = gmtime((const time_t*)&pvt->call_answer);
-		strftime(buf, buflen, "%F %T", tm);
-	} else {
-		res = -1;
+	if (!what) {
+		return 0;
 	}
 
-	ast_mutex_unlock(&iflock);
+	ast_debug(1, "port %i: reissuing line settings 0x%x\n", pvt->port_id + 1, what);
+	if (lantiq_line_apply(pvt->port_id, line, what)) {
+		/* pvt->line is left as it was, so the next switch retries */
+		return -1;
+	}
+	pvt->line = *line;
 
-	return res;
+	return 0;
 }
 
-
-static struct ast_frame * ast_lantiq_exception(struct ast_channel *ast)
+/* Returns the index of the DSP profile called name, or -1 */
+static int lantiq_profile_find(const char *name)
 {
-	ast_log(LOG_DEBUG, "entering... no code here...\n");
-	return NULL;
-}
-
-static void lantiq_jb_get_stats(int c) {
-	struct lantiq_pvt *pvt = &iflist[c];
+	int i;
 
-	IFX_TAPI_JB_STATISTICS_t param;
-	memset (&param, 0, sizeof (param));
-	if (ioctl (dev_ctx.ch_fd[c], IFX_TAPI_JB_STATISTICS_GET, (IFX_int32_t) &param) != IFX_SUCCESS) {
-		ast_debug(1, "Error getting jitter buffer  stats.\n");
-	} else {
-#if !defined (TAPI_VERSION3) && defined (TAPI_VERSION4)
-		ast_debug(1, "Jitter buffer stats:  dev=%u, ch=%u, nType=%u, nBufSize=%u, nIsUnderflow=%u, nDsOverflow=%u, nPODelay=%u, nInvalid=%u\n", 
-				(uint32_t) param.dev,
-				(uint32_t) param.ch,
-#else
-		ast_debug(1, "Jitter buffer stats:  nType=%u, nBufSize=%u, nIsUnderflow=%u, nDsOverflow=%u, nPODelay=%u, nInvalid=%u\n", 
-#endif
-				(uint32_t) param.nType,
-				(uint32_t) param.nBufSize,
-				(uint32_t) param.nIsUnderflow,
-				(uint32_t) param.nDsOverflow,
-				(uint32_t) param.nPODelay,
-				(uint32_t) param.nInvalid);
-		
-		pvt->jb_size = param.nBufSize;
-		pvt->jb_underflow = param.nIsUnderflow;
-		pvt->jb_overflow = param.nDsOverflow;
-		pvt->jb_invalid = param.nInvalid;
-		pvt->jb_delay = param.nPODelay;
+	for (i = 0; i < lantiq_profile_count; i++) {
+		if (!strcasecmp(lantiq_profiles[i].name, name)) {
+			return i;
+		}
 	}
-}
 
+	return -1;
+}
 
-static int lantiq_standby(int c)
+/* Called with iflock held. Switches the port to the LANTIQ_PROFILE channel variable's profile. */
+static void lantiq_profile_select(struct lantiq_pvt *pvt, struct ast_channel *chan)
 {
-	ast_debug(1, "Stopping line feed for channel %i\n", c);
-	if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_STANDBY)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_LINE_FEED_SET ioctl failed\n");
-		return -1;
-	}
+	const char *var = pbx_builtin_getvar_helper(chan, "LANTIQ_PROFILE");
+	int profile;
 
-	if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_STOP, 0)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_ENC_STOP ioctl failed\n");
-		return -1;
+	if (ast_strlen_zero(var)) {
+		return;
 	}
 
-	if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_DEC_STOP, 0)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_DEC_STOP ioctl failed\n");
-		return -1;
+	if ((profile = lantiq_profile_find(var)) < 0) {
+		ast_log(LOG_WARNING, "Unknown DSP profile '%s' for %s\n", var, chan->name);
+		return;
 	}
 
-	return lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
+	if (lantiq_line_set(pvt, &lantiq_profiles[profile].line)) {
+		ast_log(LOG_WARNING, "port %i didn't fully switch to DSP profile %s\n", pvt->port_id + 1, var);
+	}
 }
 
-static int lantiq_end_dialing(int c)
+/*
+ * Called with iflock held. Once the port is onhook, issues the CID settings a
+ * reload changed and returns the port to its own profile.
+ */
+static void lantiq_line_pending(struct lantiq_pvt *pvt)
 {
-	ast_log(LOG_DEBUG, "TODO - DEBUG MSG\n");
-	struct lantiq_pvt *pvt = &iflist[c];
-
-	if (pvt->dial_timer) {
-		ast_sched_thread_del(sched_thread, pvt->dial_timer);
-		pvt->dial_timer = 0;
+	if (pvt->channel_state != ONHOOK) {
+		return;
 	}
 
-	if(pvt->owner) {
-		ast_hangup(pvt->owner);
+	if (pvt->line_pending && lantiq_line_apply(pvt->port_id, &pvt->line, pvt->line_pending)) {
+		ast_log(LOG_WARNING, "port %i keeps its previous caller id settings\n", pvt->port_id + 1);
 	}
-	lantiq_reset_dtmfbuf(pvt);
+	pvt->line_pending = 0;
 
-	return 0;
+	if (lantiq_line_set(pvt, &lantiq_profiles[pvt->profile].line)) {
+		ast_log(LOG_WARNING, "port %i keeps part of its previous line settings\n", pvt->port_id + 1);
+	}
 }
 
-static int lantiq_end_call(int c)
+static void lantiq_ring(int c, int r, const char *cid, const char *name)
 {
-	ast_log(LOG_DEBUG, "TODO - DEBUG MSG\n");
+	uint8_t status;
 
-	struct lantiq_pvt *pvt = &iflist[c];
-	
-	if(pvt->owner) {
-		lantiq_jb_get_stats(c);
-		ast_queue_hangup(pvt->owner);
+	if (r) {
+		led_blink(dev_ctx.ch_led[c], LED_FAST_BLINK);
+		if (!cid) {
+			status = (uint8_t) lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_RING_START, 0);
+		} else {
+			status = (uint8_t) lantiq_send_cid(c, IFX_TAPI_CID_HM_ONHOOK, cid, name);
+		}
+	} else {
+		status = (uint8_t) lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_RING_STOP, 0);
+		led_off(dev_ctx.ch_led[c]);
 	}
 
-	return 0;
+	if (status) {
+		ast_log(LOG_ERROR, "%s ioctl failed\n",
+			(r ? "IFX_TAPI_RING_START" : "IFX_TAPI_RING_STOP"));
+	}
 }
 
-static struct ast_channel * lantiq_channel(int state, int c, char *ext, char *ctx, format_t format)
+/*
+ * Converts a tone in indications.conf syntax ("f1[+f2]/ms,...") into a simple
+ * DSP tone. Modulated frequencies (f1*f2) are played mixed, MIDI notes are
+ * not supported. The DSP repeats the whole cadence, so a tone whose repeated
+ * part is silent, like the special information tone, is played once, and for
+ * others the parts played once ('!') are dropped.
+ */
+static int lantiq_tone_parse(const char *data, IFX_TAPI_TONE_t *tone, unsigned int index)
 {
-	struct ast_channel *chan = NULL;
-	struct lantiq_pvt *pvt = &iflist[c];
+	IFX_TAPI_TONE_SIMPLE_t *simple = &tone->simple;
+	IFX_uint32_t freqs[4] = { 0 };
+	int nfreqs = 0, steps = 0, once = 0, repeat = 0, pass, i, j;
+	char *buf, *part;
+
+	memset(tone, 0, sizeof(*tone));
+	simple->format = IFX_TAPI_TONE_TYPE_SIMPLE;
+	simple->index = index;
+
+	/* 1st pass: decide which parts are played, 2nd pass: fill in the steps */
+	for (pass = 0; pass < 2; pass++) {
+		buf = ast_strdupa(data);
+		while ((part = strsep(&buf, ","))) {
+			unsigned int f1 = 0, f2 = 0, ms = 0;
+			int bang = 0, mask = 0;
+
+			part = ast_strip(part);
+			if (*part == '!') {
+				bang = 1;
+				part++;
+			}
+			if (ast_strlen_zero(part)) {
+				continue;
+			}
+			if (sscanf(part, "%30u+%30u/%30u", &f1, &f2, &ms) != 3 &&
+					sscanf(part, "%30u*%30u/%30u", &f1, &f2, &ms) != 3 &&
+					sscanf(part, "%30u/%30u", &f1, &ms) != 2 &&
+					sscanf(part, "%30u+%30u", &f1, &f2) != 2 &&
+					sscanf(part, "%30u*%30u", &f1, &f2) != 2 &&
+					sscanf(part, "%30u", &f1) != 1) {
+				ast_log(LOG_WARNING, "unsupported tone part '%s' in '%s'\n", part, data);
+				return -1;
+			}
 
-	chan = ast_channel_alloc(1, state, NULL, NULL, "", ext, ctx, 0, c, "TAPI/%d", c + 1);
-	if (! chan) {
-		ast_log(LOG_DEBUG, "Cannot allocate channel!\n");
-		return NULL;
-	}
-/*
-	char buf[BUFSIZ];
-	if (format != 0 && ! (format & lantiq_tech.capabilities)) {
-		ast_log(LOG_WARNING, "Requested channel with unsupported format %s. Forcing ALAW.\n", ast_getformatname_multiple(buf, sizeof(buf), format));
-		format = AST_FORMAT_ALAW;
-	} else {
-		format = lantiq_tech.capabilities;
-	}
-*/
-	chan->tech = &lantiq_tech;
-	chan->nativeformats = lantiq_tech.capabilities;
-	chan->tech_pvt = pvt;
+			if (!pass) {
+				if (bang) {
+					once = 1;
+				} else if (f1 || f2) {
+					repeat = 1;
+				}
+				continue;
+			}
+			if (bang == repeat) {
+				/* !part of a repeating tone or the silent tail of a one shot tone */
+				continue;
+			}
 
-	pvt->owner = chan;
+			for (j = 0; j < 2; j++) {
+				const unsigned int f = j ? f2 : f1;
 
-	if (format != 0)
-		if (lantiq_conf_enc(c, format) < 0)
-			return NULL;
+				if (!f) {
+					continue;
+				}
+				for (i = 0; i < nfreqs && freqs[i] != f; i++);
+				if (i == nfreqs) {
+					if (nfreqs == ARRAY_LEN(freqs)) {
+						ast_log(LOG_WARNING, "too many frequencies in tone '%s'\n", data);
+						return -1;
+					}
+					freqs[nfreqs++] = f;
+				}
+				mask |= 1 << i;
+			}
 
-	return chan;
-}
+			if (steps == IFX_TAPI_TONE_STEPS_MAX) {
+				ast_log(LOG_WARNING, "tone '%s' has more than %d steps, truncated\n", data, IFX_TAPI_TONE_STEPS_MAX);
+				break;
+			}
+			/* without duration the part is played until stopped */
+			simple->cadence[steps] = ms ? ms : 1000;
+			simple->frequencies[steps] = mask;
+			steps++;
+		}
+		if (!pass && !repeat && !once) {
+			break;
+		}
+	}
 
-static struct ast_channel * ast_lantiq_requester(const char *type, format_t format, const struct ast_channel *requestor, void *data, int *cause)
-{
-	ast_mutex_lock(&iflock);
+	if (!steps) {
+		ast_log(LOG_WARNING, "tone '%s' has nothing to play\n", data);
+		return -1;
+	}
 
-	char buf[BUFSIZ];
-	struct ast_channel *chan = NULL;
-	int port_id = -1;
+	simple->freqA = freqs[0];
+	simple->freqB = freqs[1];
+	simple->freqC = freqs[2];
+	simple->freqD = freqs[3];
+	simple->levelA = simple->levelB = simple->levelC = simple->levelD = LANTIQ_TONE_LEVEL;
+	/* 0 repeats endlessly */
+	simple->loop = repeat ? 0 : 1;
 
-	ast_debug(1, "Asked to create a TAPI channel with formats: %s\n", ast_getformatname_multiple(buf, sizeof(buf), format));
+	return 0;
+}
 
+/*
+ * Called from load_config(). Takes each tone from the [tones] section or else
+ * from the indications.conf zone, the tones are loaded into the DSP later on.
+ */
+static void lantiq_tones_config(struct ast_config *cfg)
+{
+	struct ast_tone_zone *zone;
+	struct ast_variable *v;
+	int t;
 
-	/* check for correct data argument */
-	if (ast_strlen_zero(data)) {
-		ast_log(LOG_ERROR, "Unable to create channel with empty destination.\n");
-		*cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
-		goto bailout;
+	for (t = 0; t < LANTIQ_TONE_MAX; t++) {
+		lantiq_tones[t].data[0] = '\0';
 	}
 
-	/* get our port number */
-	port_id = atoi((char*) data);
-	if (port_id < 1 || port_id > dev_ctx.channels) {
-		ast_log(LOG_ERROR, "Unknown channel ID: \"%s\"\n", (char*) data);
-		*cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
-		goto bailout;
+	for (v = ast_variable_browse(cfg, "tones"); v; v = v->next) {
+		for (t = 0; t < LANTIQ_TONE_MAX && strcasecmp(v->name, lantiq_tones[t].name); t++);
+		if (t == LANTIQ_TONE_MAX) {
+			ast_log(LOG_WARNING, "Unknown tone '%s' in section [tones]\n", v->name);
+			continue;
+		}
+		ast_copy_string(lantiq_tones[t].data, v->value, sizeof(lantiq_tones[t].data));
 	}
 
-	/* on asterisk user's side, we're using port 1-2.
-	 * Here in non normal human's world, we begin
-	 * counting at 0.
-	 */
-	port_id -= 1;
+	zone = ast_get_indication_zone(ast_strlen_zero(dev_ctx.tone_zone) ? NULL : dev_ctx.tone_zone);
+	if (!zone) {
+		ast_log(LOG_WARNING, "No indications for tone zone '%s', using the DSP's predefined tones\n", dev_ctx.tone_zone);
+		return;
+	}
 
+	for (t = 0; t < LANTIQ_TONE_MAX; t++) {
+		struct ast_tone_zone_sound *ts;
 
-	/* Bail out if channel is already in use */
-	struct lantiq_pvt *pvt = &iflist[port_id];
-	if (! pvt->channel_state == ONHOOK) {
-		ast_debug(1, "TAPI channel %i alread in use.\n", port_id+1);
-	} else {
-		chan = lantiq_channel(AST_STATE_DOWN, port_id, NULL, NULL, format);
+		if (!ast_strlen_zero(lantiq_tones[t].data)) {
+			continue;
+		}
+		if ((ts = ast_get_indication_tone(zone, lantiq_tones[t].name))) {
+			ast_copy_string(lantiq_tones[t].data, ts->data, sizeof(lantiq_tones[t].data));
+			ast_tone_zone_sound_unref(ts);
+		}
 	}
 
-bailout:
-	ast_mutex_unlock(&iflock);
-	return chan;
+	ast_tone_zone_unref(zone);
 }
 
-static int ast_lantiq_devicestate(void *data)
+/*
+ * Programs the configured tones into the DSP tone table once, the table is
+ * shared by all ports. Tones which can't be loaded fall back to the
+ * predefined ones.
+ */
+static void lantiq_tones_load(void)
 {
-	int port = atoi((char *) data) - 1;
-	if ((port < 1) || (port > dev_ctx.channels)) {
-		return AST_DEVICE_INVALID;
+	IFX_TAPI_TONE_t tone;
+	int t, loaded = 0;
+
+	for (t = 0; t < LANTIQ_TONE_MAX; t++) {
+		dev_ctx.tones[t] = lantiq_tones[t].fallback;
+
+		if (ast_strlen_zero(lantiq_tones[t].data)) {
+			continue;
+		}
+		if (lantiq_tone_parse(lantiq_tones[t].data, &tone, LANTIQ_TONE_INDEX_BASE + t)) {
+			continue;
+		}
+		if (lantiq_ioctl(dev_ctx.ch_fd[0], IFX_TAPI_TONE_TABLE_CFG_SET, &tone)) {
+			ast_log(LOG_WARNING, "IFX_TAPI_TONE_TABLE_CFG_SET for tone %s failed\n", lantiq_tones[t].name);
+			continue;
+		}
+		dev_ctx.tones[t] = LANTIQ_TONE_INDEX_BASE + t;
+		loaded++;
 	}
 
-	switch (iflist[port].channel_state) {
-		case ONHOOK:
-			return AST_DEVICE_NOT_INUSE;
-		case OFFHOOK:
-		case DIALING:
-		case INCALL:
-		case CALL_ENDED:
-			return AST_DEVICE_INUSE;
-		case RINGING:
-			return AST_DEVICE_RINGING;
-		case UNKNOWN:
-		default:
-			return AST_DEVICE_UNKNOWN;
-	}
+	ast_verb(3, "loaded %i call progress tones into the DSP\n", loaded);
 }
 
-static int lantiq_dev_data_handler(int c)
+static int lantiq_play_tone(int c, int t)
 {
-	char buf[BUFSIZ];
-	struct ast_frame frame = {0};
-
-	int res = read(dev_ctx.ch_fd[c], buf, sizeof(buf));
-	if (res <= 0) {
-		ast_log(LOG_ERROR, "we got read error %i\n", res);
-		return 0;
-	}
-
-	rtp_header_t *rtp = (rtp_header_t*) buf;
-	struct lantiq_pvt *pvt = (struct lantiq_pvt *) &iflist[c];
-	if ((!pvt->owner) || (pvt->owner->_state != AST_STATE_UP)) {
-		return 0;
-	}
-
-	if(rtp->payload_type != pvt->rtp_payload) {
-		if (rtp->payload_type == RTP_CN) {
-			/* TODO: Handle Comfort Noise frames */
-			ast_debug(1, "Dropping Comfort Noise frame\n");
-		}
-		ast_debug(1, "Received RTP payload type %d but %d was expected.\n", rtp->payload_type, pvt->rtp_payload);
-		return 0;
+	/* stop currently playing tone before starting new one */
+	if (t != TAPI_TONE_LOCALE_NONE) {
+		lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_TONE_LOCAL_PLAY, TAPI_TONE_LOCALE_NONE);
 	}
 
-	frame.src = "TAPI";
-	frame.frametype = AST_FRAME_VOICE;
-	frame.subclass.codec = pvt->codec;
-	frame.datalen = res - RTP_HEADER_LEN;
-	frame.data.ptr = buf + RTP_HEADER_LEN;
-	frame.samples = ast_codec_get_samples(&frame);
-
-	if(!ast_channel_trylock(pvt->owner)) {
-		ast_queue_frame(pvt->owner, &frame);
-		ast_channel_unlock(pvt->owner);
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_TONE_LOCAL_PLAY, t)) {
+		ast_log(LOG_DEBUG, "IFX_TAPI_TONE_LOCAL_PLAY ioctl failed\n");
+		return -1;
 	}
 
-/*	ast_debug(1, "lantiq_dev_data_handler(): size: %i version: %i padding: %i extension: %i csrc_count: %i \n"
-				 "marker: %i payload_type: %s seqno: %i timestamp: %i ssrc: %i\n", 
-				 (int)res,
-				 (int)rtp->version,
-				 (int)rtp->padding,
-				 (int)rtp->extension,
-				 (int)rtp->csrc_count,
-				 (int)rtp->marker,
-				 ast_codec2str(frame.subclass.codec),
-				 (int)rtp->seqno,
-				 (int)rtp->timestamp,
-				 (int)rtp->ssrc);
-*/
 	return 0;
 }
 
-static int accept_call(int c)
-{ 
-	ast_log(LOG_DEBUG, "TODO - DEBUG MSG\n");
+/* Called with iflock held. Off-hook CID once, then the waiting tone again every while. */
+static void lantiq_event_cw_timeout(struct lantiq_pvt *pvt)
+{
+	struct ast_channel *chan = pvt->waiting;
 
-	struct lantiq_pvt *pvt = &iflist[c];
+	if (!chan || chan->_state != AST_STATE_RINGING || pvt->channel_state != INCALL) {
+		return;
+	}
 
-	if (pvt->owner) {
-		struct ast_channel *chan = pvt->owner;
+	if (!pvt->cw_cid_sent) {
+		const char *cid = chan->connected.id.number.valid ? chan->connected.id.number.str : NULL;
+		const char *name = chan->connected.id.name.valid ? chan->connected.id.name.str : NULL;
 
-		switch (chan->_state) {
-			case AST_STATE_RINGING:
-				lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
-				ast_queue_control(pvt->owner, AST_CONTROL_ANSWER);
-				pvt->channel_state = INCALL;
-				pvt->call_start = epoch();
-				pvt->call_answer = pvt->call_start;
-				break;
-			default:
-				ast_log(LOG_WARNING, "entered unhandled state %s\n", ast_state2str(chan->_state));
+		pvt->cw_cid_sent = 1;
+		if (cid && lantiq_send_cid(pvt->port_id, IFX_TAPI_CID_HM_OFFHOOK, cid, name)) {
+			ast_log(LOG_WARNING, "off-hook CID on port %i failed\n", pvt->port_id + 1);
 		}
+	} else {
+		lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_WAITING]);
 	}
 
-	return 0;
+	lantiq_timer_start(&pvt->cw_timer, pvt, LANTIQ_CW_REPEAT, lantiq_event_cw_timeout);
 }
 
-static int lantiq_dev_event_hook(int c, int state)
+/* Called with iflock held. Announces pvt->waiting to the user in the active call. */
+static void lantiq_cw_start(struct lantiq_pvt *pvt)
 {
-	ast_mutex_lock(&iflock);
-
-	ast_log(LOG_DEBUG, "on port %i detected event %s hook\n", c, state ? "on" : "off");
-
-	int ret = -1;
-	if (state) { /* going onhook */
-		switch (iflist[c].channel_state) {
-			case DIALING: 
-				ret = lantiq_end_dialing(c);
-				break;
-			case INCALL: 
-				ret = lantiq_end_call(c);
-				break;
-		}
+	pvt->cw_cid_sent = 0;
+	lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_WAITING]);
+	lantiq_timer_start(&pvt->cw_timer, pvt, LANTIQ_CW_CID_DELAY, lantiq_event_cw_timeout);
+}
 
-		iflist[c].channel_state = ONHOOK;
+/*
+ * Called with iflock held when the port went onhook with a second call
+ * around: ring the phone again for it.
+ */
+static void lantiq_cw_recall(struct lantiq_pvt *pvt)
+{
+	struct ast_channel *chan = pvt->waiting;
+	const char *cid = chan->connected.id.number.valid ? chan->connected.id.number.str : NULL;
+	const char *name = chan->connected.id.name.valid ? chan->connected.id.name.str : NULL;
 
-		/* stop DSP data feed */
-		lantiq_standby(c);
-		led_off(dev_ctx.ch_led[c]);
+	lantiq_timer_stop(&pvt->cw_timer);
+	pvt->waiting = NULL;
+	/* the previous owner is being torn down and finds itself replaced */
+	pvt->owner = chan;
 
-	} else { /* going offhook */
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_ACTIVE)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_LINE_FEED_SET ioctl failed\n");
-			goto out;
-		}
+	ast_debug(1, "ringing port %i again for %s\n", pvt->port_id + 1, chan->name);
+	lantiq_stats_reset(pvt->port_id);
+	lantiq_conf_enc(pvt->port_id, pvt->waiting_format);
+	lantiq_cadence_set(pvt, lantiq_cadence_select(pvt, chan));
+	lantiq_ring(pvt->port_id, 1, cid, name);
+	lantiq_state_set(pvt, RINGING);
+}
 
-		switch (iflist[c].channel_state) {
-			case RINGING: 
-				ret = accept_call(c);
-				led_blink(dev_ctx.ch_led[c], LED_SLOW_BLINK);
-				break;
-			default:
-				iflist[c].channel_state = OFFHOOK;
-				lantiq_play_tone(c, TAPI_TONE_LOCALE_DIAL_CODE);
-				ret = 0;
-				led_on(dev_ctx.ch_led[c]);
-				break;
-		}
+static enum channel_state lantiq_get_hookstatus(int port)
+{
+	uint8_t status;
 
+	if (lantiq_ioctl(dev_ctx.ch_fd[port], IFX_TAPI_LINE_HOOK_STATUS_GET, &status)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_LINE_HOOK_STATUS_GET ioctl failed\n");
+		return UNKNOWN;
 	}
 
-out:
-	ast_mutex_unlock(&iflock);
-
-	return ret;
+	if (status) {
+		return OFFHOOK;
+	} else {
+		return ONHOOK;
+	}
 }
 
-static void lantiq_reset_dtmfbuf(struct lantiq_pvt *pvt)
-{
-	pvt->dtmfbuf[0] = '\0';
-	pvt->dtmfbuf_len = 0;
-}
+/* Firmware or BBD file mapped read-only, with its MD5 */
+struct lantiq_image {
+	void *data;
+	size_t size;
+	char md5[33];
+};
 
-static void lantiq_dial(struct lantiq_pvt *pvt)
+/* Maps a binary file read-only and computes its MD5 */
+static int lantiq_image_map(const char *path, struct lantiq_image *image)
 {
-	struct ast_channel *chan = NULL;
+	struct MD5Context md5;
+	unsigned char digest[16];
+	struct stat file_stat;
+	int fd, i;
 
-	ast_mutex_lock(&iflock);
-	ast_log(LOG_DEBUG, "user want's to dial %s.\n", pvt->dtmfbuf);
+	memset(image, 0, sizeof(*image));
 
-	if (ast_exists_extension(NULL, pvt->context, pvt->dtmfbuf, 1, NULL)) {
-		ast_debug(1, "found extension %s, dialing\n", pvt->dtmfbuf);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		ast_log(LOG_ERROR, "binary file %s open failed: %s\n", path, strerror(errno));
+		return -1;
+	}
 
-		ast_verbose(VERBOSE_PREFIX_3 " extension exists, starting PBX %s\n", pvt->dtmfbuf);
+	if (fstat(fd, &file_stat) || !file_stat.st_size) {
+		ast_log(LOG_ERROR, "file %s statistics get failed\n", path);
+		close(fd);
+		return -1;
+	}
 
-		chan = lantiq_channel(AST_STATE_UP, pvt->port_id, pvt->dtmfbuf, pvt->context, 0);
-		if (!chan) {
-			ast_log(LOG_ERROR, "couldn't create channel\n");
-			goto bailout;
-		}
-		chan->tech_pvt = pvt;
-		pvt->owner = chan;
+	image->data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image->data == MAP_FAILED) {
+		ast_log(LOG_ERROR, "binary file %s mmap failed: %s\n", path, strerror(errno));
+		image->data = NULL;
+		return -1;
+	}
+	image->size = file_stat.st_size;
 
-		ast_setstate(chan, AST_STATE_RING);
-		pvt->channel_state = INCALL;
+	MD5Init(&md5);
+	MD5Update(&md5, image->data, image->size);
+	MD5Final(digest, &md5);
+	for (i = 0; i < sizeof(digest); i++) {
+		snprintf(image->md5 + 2 * i, 3, "%02x", digest[i]);
+	}
 
-		pvt->call_setup_start = now();
-		pvt->call_start = epoch();
+	return 0;
+}
 
-		if (ast_pbx_start(chan)) {
-			ast_log(LOG_WARNING, " unable to start PBX on %s\n", chan->name);
-			ast_hangup(chan);
-		}
-	} else {
-		ast_log(LOG_DEBUG, "no extension found\n");
-		lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_BUSY_CODE);
-		pvt->channel_state = CALL_ENDED;
+static void lantiq_image_unmap(struct lantiq_image *image)
+{
+	if (image->data) {
+		munmap(image->data, image->size);
+		image->data = NULL;
 	}
-	
-	lantiq_reset_dtmfbuf(pvt);
-bailout:
-	ast_mutex_unlock(&iflock);
 }
 
-static int lantiq_event_dial_timeout(const void* data)
+/*
+ * Marker files in the run directory record what was downloaded into the DSP.
+ * Writes content to the marker if write is set, else returns 1 if the marker
+ * holds content.
+ */
+static int lantiq_marker(const char *name, const char *content, int write)
 {
-	ast_debug(1, "TAPI: lantiq_event_dial_timeout()\n");
+	char path[PATH_MAX], buf[64] = "";
+	FILE *f;
 
-	struct lantiq_pvt *pvt = (struct lantiq_pvt *) data;
-	pvt->dial_timer = 0;
+	snprintf(path, sizeof(path), "%s/%s", ast_config_AST_RUN_DIR, name);
 
-	if (! pvt->channel_state == ONHOOK) {
-		lantiq_dial(pvt);
-	} else {
-		ast_debug(1, "TAPI: lantiq_event_dial_timeout(): dial timeout in state ONHOOK.\n");
+	if (write) {
+		if (!(f = fopen(path, "w"))) {
+			ast_log(LOG_WARNING, "unable to write %s: %s\n", path, strerror(errno));
+			return 0;
+		}
+		fputs(content, f);
+		fclose(f);
+		return 1;
 	}
 
-	return 0;
+	if (!(f = fopen(path, "r"))) {
+		return 0;
+	}
+	if (!fgets(buf, sizeof(buf), f)) {
+		buf[0] = '\0';
+	}
+	fclose(f);
+
+	return !strcmp(buf, content);
 }
 
-static int lantiq_send_digit(int c, char digit) 
+static void lantiq_marker_remove(const char *name)
 {
-	struct lantiq_pvt *pvt = &iflist[c];
-
-	struct ast_frame f = { .frametype = AST_FRAME_DTMF, .subclass.integer = digit };
+	char path[PATH_MAX];
 
-	if (pvt->owner) {
-		ast_log(LOG_DEBUG, "Port %i transmitting digit \"%c\"\n", c, digit);
-		return ast_queue_frame(pvt->owner, &f);
-	} else {
-		ast_debug(1, "Warning: lantiq_send_digit() without owner!\n");
-		return -1;
-	}
+	snprintf(path, sizeof(path), "%s/%s", ast_config_AST_RUN_DIR, name);
+	unlink(path);
 }
 
-static void lantiq_dev_event_digit(int c, char digit)
+/*
+ * The firmware marker records the MD5 of the firmware the DSP runs and the
+ * version the DSP reported after the download. The download is skipped as
+ * long as both still match. Writes the marker if write is set, else checks
+ * it, returns 1 if the firmware needs no download.
+ */
+static int lantiq_fw_marker(const char *md5, int write)
 {
-	ast_mutex_lock(&iflock);
+	char expected[64];
+	VMMC_IO_VERSION version;
 
-	ast_log(LOG_DEBUG, "on port %i detected digit \"%c\"\n", c, digit);
+	memset(&version, 0, sizeof(version));
+	if (lantiq_ioctl(dev_ctx.dev_fd, FIO_GET_VERS, &version) || !version.nEdspVers) {
+		/* nothing running, e.g. the driver was reloaded */
+		lantiq_marker_remove(LANTIQ_FW_MARKER);
+		return 0;
+	}
+	snprintf(expected, sizeof(expected), "%s %u.%u.%u\n", md5,
+		version.nEdspVers, version.nEdspIntern, version.nEDSPHotFix);
 
-	struct lantiq_pvt *pvt = &iflist[c];
+	return lantiq_marker(LANTIQ_FW_MARKER, expected, write);
+}
 
-	switch (pvt->channel_state) {
-		case INCALL:
-			lantiq_send_digit(c, digit);
-			break;
-		case OFFHOOK:  
-			pvt->channel_state = DIALING;
+/*
+ * Downloads the firmware unless the DSP already runs this image. Returns 1 if
+ * it was downloaded, 0 if skipped, -1 on failure.
+ */
+static int32_t lantiq_dev_firmware_download(int32_t fd, const char *path)
+{
+	struct lantiq_image firmware;
+	VMMC_IO_INIT vmmc_io_init;
 
-			lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
-			led_blink(dev_ctx.ch_led[c], LED_SLOW_BLINK);
+	ast_log(LOG_DEBUG, "loading firmware: \"%s\".\n", path);
 
-			/* fall through */
-		case DIALING: 
-			if (digit == '#') {
-				if (pvt->dial_timer) {
-					ast_sched_thread_del(sched_thread, pvt->dial_timer);
-					pvt->dial_timer = 0;
-				}
+	if (lantiq_image_map(path, &firmware))
+		return -1;
 
-				ast_mutex_unlock(&iflock);
-				lantiq_dial(pvt);
-				return;
-			} else {
-				if (pvt->dtmfbuf_len < AST_MAX_EXTENSION - 1) {
-					pvt->dtmfbuf[pvt->dtmfbuf_len] = digit;
-					pvt->dtmfbuf[++pvt->dtmfbuf_len] = '\0';
-				} else {
-					/* No more room for another digit */
-					lantiq_end_dialing(c);
-					lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_BUSY_CODE);
-					pvt->channel_state = CALL_ENDED;
-					break;
-				}
+	ast_copy_string(dev_ctx.fw_md5, firmware.md5, sizeof(dev_ctx.fw_md5));
+	if (lantiq_fw_marker(firmware.md5, 0)) {
+		ast_verb(3, "DSP already runs firmware %s (md5 %s), skipping download\n", path, firmware.md5);
+		lantiq_image_unmap(&firmware);
+		return 0;
+	}
 
-				/* setup autodial timer */
-				if (!pvt->dial_timer) {
-					ast_log(LOG_DEBUG, "setting new timer\n");
-					pvt->dial_timer = ast_sched_thread_add(sched_thread, dev_ctx.interdigit_timeout, lantiq_event_dial_timeout, (const void*) pvt);
-				} else {
-					ast_log(LOG_DEBUG, "replacing timer\n");
-					struct sched_context *sched = ast_sched_thread_get_context(sched_thread);
-					AST_SCHED_REPLACE(pvt->dial_timer, sched, dev_ctx.interdigit_timeout, lantiq_event_dial_timeout, (const void*) pvt);
-				}
-			}
-			break;
-		default:
-			ast_log(LOG_ERROR, "don't know what to do in unhandled state\n");
-			break;
+	memset(&vmmc_io_init, 0, sizeof(VMMC_IO_INIT));
+	vmmc_io_init.pPRAMfw = firmware.data;
+	vmmc_io_init.pram_size = firmware.size;
+
+	if (lantiq_ioctl(fd, FIO_FW_DOWNLOAD, &vmmc_io_init)) {
+		ast_log(LOG_ERROR, "FIO_FW_DOWNLOAD ioctl failed\n");
+		lantiq_image_unmap(&firmware);
+		return -1;
 	}
 
-	ast_mutex_unlock(&iflock);
-	return;
+	lantiq_image_unmap(&firmware);
+
+	return 1;
 }
 
-static void lantiq_dev_event_handler(void)
+/*
+ * Downloads the line coefficients (BBD) into each port. Ports sharing a BBD
+ * file share one mapping. A port's download is skipped if the DSP kept its
+ * firmware (fw_loaded not set) and the port's marker has the file's MD5.
+ */
+static int lantiq_dev_bbd_download(int fw_loaded)
 {
-	IFX_TAPI_EVENT_t event;
-	unsigned int i;
+	struct lantiq_image images[TAPI_AUDIO_PORT_NUM_MAX];
+	const char *paths[TAPI_AUDIO_PORT_NUM_MAX];
+	int c, i, res = 0;
 
-	for (i = 0; i < dev_ctx.channels ; i++) {
-		ast_mutex_lock(&iflock);
+	memset(images, 0, sizeof(images));
 
-		memset (&event, 0, sizeof(event));
-		event.ch = i;
-		if (ioctl(dev_ctx.dev_fd, IFX_TAPI_EVENT_GET, &event)) {
-			ast_mutex_unlock(&iflock);
+	for (c = 0; !res && c < dev_ctx.channels; c++) {
+		char marker[32], md5[34];
+		VMMC_DWLD_t bbd_data;
+
+		paths[c] = ast_strlen_zero(iflist[c].bbd_filename) ? bbd_filename : iflist[c].bbd_filename;
+		if (paths[c] == bbd_filename && access(bbd_filename, R_OK)) {
+			/* the default file is optional */
+			ast_debug(1, "no BBD file %s for port %i, keeping the driver's line coefficients\n", bbd_filename, c + 1);
 			continue;
 		}
-		if (event.id == IFX_TAPI_EVENT_NONE) {
-			ast_mutex_unlock(&iflock);
+
+		/* ports with the same file share its mapping, if it was mapped */
+		for (i = 0; i < c && (!images[i].data || strcmp(paths[i], paths[c])); i++);
+		if (i == c && lantiq_image_map(paths[c], &images[c])) {
+			res = -1;
 			continue;
 		}
 
-		ast_mutex_unlock(&iflock);
+		snprintf(marker, sizeof(marker), "lantiq_bbd%i", c + 1);
+		snprintf(md5, sizeof(md5), "%s\n", images[i].md5);
+		if (!fw_loaded && lantiq_marker(marker, md5, 0)) {
+			ast_debug(1, "port %i already has BBD %s\n", c + 1, paths[c]);
+			continue;
+		}
 
-		switch(event.id) {
-			case IFX_TAPI_EVENT_FXS_ONHOOK:
-				lantiq_dev_event_hook(i, 1);
-				break;
+		ast_log(LOG_DEBUG, "loading BBD \"%s\" into port %i.\n", paths[c], c + 1);
+		memset(&bbd_data, 0, sizeof(bbd_data));
+		bbd_data.buf = images[i].data;
+		bbd_data.size = images[i].size;
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], FIO_BBD_DOWNLOAD, &bbd_data)) {
+			ast_log(LOG_ERROR, "FIO_BBD_DOWNLOAD %d failed\n", c);
+			lantiq_marker_remove(marker);
+			res = -1;
+			continue;
+		}
+		lantiq_marker(marker, md5, 1);
+	}
+
+	for (c = 0; c < dev_ctx.channels; c++) {
+		lantiq_image_unmap(&images[c]);
+	}
+
+	return res;
+}
+
+static const char *state_string(enum channel_state s)
+{
+	switch (s) {
+		case ONHOOK: return "ONHOOK";
+		case OFFHOOK: return "OFFHOOK";
+		case DIALING: return "DIALING";
+		case INCALL: return "INCALL";
+		case CALL_ENDED: return "CALL_ENDED";
+		case RINGING: return "RINGING";
+		default: return "UNKNOWN";
+	}
+}
+
+static const char *control_string(int c)
+{
+	switch (c) {
+		case AST_CONTROL_HANGUP: return "Other end has hungup";
+		case AST_CONTROL_RING: return "Local ring";
+		case AST_CONTROL_RINGING: return "Remote end is ringing";
+		case AST_CONTROL_ANSWER: return "Remote end has answered";
+		case AST_CONTROL_BUSY: return "Remote end is busy";
+		case AST_CONTROL_TAKEOFFHOOK: return "Make it go off hook";
+		case AST_CONTROL_OFFHOOK: return "Line is off hook";
+		case AST_CONTROL_CONGESTION: return "Congestion (circuits busy)";
+		case AST_CONTROL_FLASH: return "Flash hook";
+		case AST_CONTROL_WINK: return "Wink";
+		case AST_CONTROL_OPTION: return "Set a low-level option";
+		case AST_CONTROL_RADIO_KEY: return "Key Radio";
+		case AST_CONTROL_RADIO_UNKEY: return "Un-Key Radio";
+		case AST_CONTROL_PROGRESS: return "Remote end is making Progress";
+		case AST_CONTROL_PROCEEDING: return "Remote end is proceeding";
+		case AST_CONTROL_HOLD: return "Hold";
+		case AST_CONTROL_UNHOLD: return "Unhold";
+		case AST_CONTROL_SRCUPDATE: return "Media Source Update";
+		case AST_CONTROL_CONNECTED_LINE: return "Connected Line";
+		case AST_CONTROL_REDIRECTING: return "Redirecting";
+		case AST_CONTROL_INCOMPLETE: return "Incomplete";
+		case -1: return "Stop tone";
+		default: return "Unknown";
+	}
+}
+
+static int ast_lantiq_indicate(struct ast_channel *chan, int condition, const void *data, size_t datalen)
+{
+	ast_verb(3, "phone indication \"%s\"\n", control_string(condition));
+
+	struct lantiq_pvt *pvt = chan->tech_pvt;
+
+	if (chan != pvt->owner) {
+		/* tones of a waiting or held call would disturb the active one */
+		return 0;
+	}
+
+	switch (condition) {
+		case -1:
+		case AST_CONTROL_UNHOLD:
+			{
+				lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_NONE);
+				return 0;
+			}
+		case AST_CONTROL_BUSY:
+			{
+				lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_BUSY]);
+				return 0;
+			}
+		case AST_CONTROL_CONGESTION:
+		case AST_CONTROL_INCOMPLETE:
+			{
+				lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_CONGESTION]);
+				return 0;
+			}
+		case AST_CONTROL_RINGING:
+		case AST_CONTROL_PROGRESS:
+			{
+				pvt->call_setup_delay = now() - pvt->call_setup_start;
+				lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_RING]);
+				return 0;
+			}
+		case AST_CONTROL_HOLD:
+			{
+				if (dev_ctx.tones[LANTIQ_TONE_HOLD] == TAPI_TONE_LOCALE_NONE) {
+					return -1;
+				}
+				lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_HOLD]);
+				return 0;
+			}
+		default:
+			{
+				/* -1 lets asterisk generate the tone */
+				return -1;
+			}
+	}
+}
+
+static int ast_lantiq_fixup(struct ast_channel *old, struct ast_channel *new)
+{
+	struct lantiq_pvt *pvt = new->tech_pvt;
+
+	ast_mutex_lock(&iflock);
+	if (pvt->owner == old) {
+		pvt->owner = new;
+	}
+	if (pvt->waiting == old) {
+		pvt->waiting = new;
+	}
+	ast_mutex_unlock(&iflock);
+
+	return 0;
+}
+
+static int ast_digit_begin(struct ast_channel *chan, char digit)
+{
+	/* TODO: Modify this callback to let Asterisk support controlling the length of DTMF */
+	ast_log(LOG_DEBUG, "entering... no code here...\n");
+	return 0;
+}
+
+static int ast_digit_end(struct ast_channel *ast, char digit, unsigned int duration)
+{
+	ast_log(LOG_DEBUG, "entering... no code here...\n");
+	return 0;
+}
+
+static int ast_lantiq_call(struct ast_channel *ast, char *dest, int timeout)
+{
+	int res = 0;
+
+	/* lock to prevent simultaneous access with do_monitor thread processing */
+	ast_mutex_lock(&iflock);
+
+	struct lantiq_pvt *pvt = ast->tech_pvt;
+	ast_log(LOG_DEBUG, "state: %s\n", state_string(pvt->channel_state));
+
+	if (ast == pvt->waiting) {
+		ast_log(LOG_DEBUG, "port %i is in a call, call waiting\n", pvt->port_id);
+		lantiq_cw_start(pvt);
+
+		ast_setstate(ast, AST_STATE_RINGING);
+		ast_queue_control(ast, AST_CONTROL_RINGING);
+	} else if (pvt->channel_state == ONHOOK) {
+		ast_log(LOG_DEBUG, "port %i is ringing\n", pvt->port_id);
+
+		const char *cid = ast->connected.id.number.valid ? ast->connected.id.number.str : NULL;
+		const char *name = ast->connected.id.name.valid ? ast->connected.id.name.str : NULL;
+		ast_log(LOG_DEBUG, "port %i CID: %s <%s>\n", pvt->port_id, cid ? cid : "none", name ? name : "");
+
+		lantiq_cadence_set(pvt, lantiq_cadence_select(pvt, ast));
+		lantiq_profile_select(pvt, ast);
+		lantiq_ring(pvt->port_id, 1, cid, name);
+		lantiq_state_set(pvt, RINGING);
+
+		ast_setstate(ast, AST_STATE_RINGING);
+		ast_queue_control(ast, AST_CONTROL_RINGING);
+	} else {
+		ast_log(LOG_DEBUG, "port %i is busy\n", pvt->port_id);
+		ast_setstate(ast, AST_STATE_BUSY);
+		ast_queue_control(ast, AST_CONTROL_BUSY);
+		res = -1;
+	}
+
+	ast_mutex_unlock(&iflock);
+
+	return res;
+}
+
+static int ast_lantiq_hangup(struct ast_channel *ast)
+{
+	/* lock to prevent simultaneous access with do_monitor thread processing */
+	ast_mutex_lock(&iflock);
+
+	struct lantiq_pvt *pvt = ast->tech_pvt;
+	ast_log(LOG_DEBUG, "state: %s\n", state_string(pvt->channel_state));
+
+	if (ast == pvt->waiting) {
+		ast_debug(1, "waiting call on port %i hung up\n", pvt->port_id + 1);
+		lantiq_timer_stop(&pvt->cw_timer);
+		if (ast->_state == AST_STATE_RINGING && pvt->channel_state == INCALL) {
+			lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_NONE);
+		}
+		pvt->waiting = NULL;
+		goto detach;
+	}
+	if (ast != pvt->owner) {
+		/* replaced by a call waiting recall, the port is not ours anymore */
+		goto detach;
+	}
+
+	if (ast->_state == AST_STATE_RINGING) {
+		// FIXME
+		ast_debug(1, "TAPI: ast_lantiq_hangup(): ast->_state == AST_STATE_RINGING\n");
+	}
+
+	lantiq_stats_stop(pvt);
+	lantiq_media_watch_stop(pvt);
+	pvt->overlap = 0;
+
+	/* before leaving INCALL, see lantiq_quality_estimate() */
+	lantiq_jb_get_stats(pvt->port_id);
+	lantiq_rtcp_get_stats(pvt->port_id);
+
+	switch (pvt->channel_state) {
+		case RINGING:
+		case ONHOOK: 
+			lantiq_ring(pvt->port_id, 0, NULL, NULL);
+			lantiq_state_set(pvt, ONHOOK);
+			lantiq_line_pending(pvt);
+			break;
+		default:
+			ast_log(LOG_DEBUG, "we were hung up, play busy tone\n");
+			lantiq_state_set(pvt, CALL_ENDED);
+			lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_BUSY]);
+	}
+
+	lantiq_quality_publish(ast, pvt);
+	pvt->owner = NULL;
+
+detach:
+	ast_setstate(ast, AST_STATE_DOWN);
+	ast_module_unref(ast_module_info->self);
+	ast->tech_pvt = NULL;
+
+	ast_mutex_unlock(&iflock);
+
+	return 0;
+}
+
+static int ast_lantiq_answer(struct ast_channel *ast)
+{
+	ast_log(LOG_DEBUG, "Remote end has answered call.\n");
+	struct lantiq_pvt *pvt = ast->tech_pvt;
+
+	ast_mutex_lock(&iflock);
+	if (lantiq_conf_enc(pvt->port_id, ast->writeformat)) {
+		ast_mutex_unlock(&iflock);
+		return -1;
+	}
+
+	pvt->call_answer = epoch();
+	lantiq_kpi_answer(pvt);
+	ast_mutex_unlock(&iflock);
+	return 0;
+}
+
+static struct ast_frame * ast_lantiq_read(struct ast_channel *ast)
+{
+	ast_log(LOG_DEBUG, "entering... no code here...\n");
+	return NULL;
+}
+
+/* Enables or disables the DSP's fax and modem tone detectors, both directions */
+static void lantiq_fax_detect(int c, int enable)
+{
+	IFX_TAPI_SIG_DETECTION_t sig;
+
+	memset(&sig, 0, sizeof(sig));
+	sig.sig = IFX_TAPI_SIG_CEDRX | IFX_TAPI_SIG_CEDTX
+		| IFX_TAPI_SIG_CNGFAXRX | IFX_TAPI_SIG_CNGFAXTX
+		| IFX_TAPI_SIG_CNGMODRX | IFX_TAPI_SIG_CNGMODTX
+		| IFX_TAPI_SIG_AMRX | IFX_TAPI_SIG_AMTX
+		| IFX_TAPI_SIG_V21HRX | IFX_TAPI_SIG_V21HTX;
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], enable ? IFX_TAPI_SIG_DETECT_ENABLE : IFX_TAPI_SIG_DETECT_DISABLE, &sig)) {
+		ast_log(LOG_WARNING, "IFX_TAPI_SIG_DETECT_%s %d failed\n", enable ? "ENABLE" : "DISABLE", c);
+		return;
+	}
+	iflist[c].fax_armed = enable;
+}
+
+/*
+ * Called with iflock held. Rebuilds the port's coder channel: stops the coder,
+ * maps the data channel to the phone again and restarts the coder, the other
+ * ports' calls are left alone, and only a few times per call.
+ */
+static void lantiq_media_recover(struct lantiq_pvt *pvt, const char *reason)
+{
+	const int c = pvt->port_id;
+	IFX_TAPI_MAP_DATA_t map_data;
+	int res = 0;
+
+	LANTIQ_STAT_INC(c, media_stalls);
+	lantiq_trace(c, LANTIQ_TRACE_STALL, pvt->channel_state, pvt->channel_state, pvt->media_recoveries + 1);
+	if (pvt->media_recoveries >= LANTIQ_MEDIA_RECOVERIES) {
+		if (pvt->media_recoveries++ == LANTIQ_MEDIA_RECOVERIES) {
+			ast_log(LOG_ERROR, "port %i: media stalled (%s) after %i coder rebuilds, giving up\n",
+				c + 1, reason, LANTIQ_MEDIA_RECOVERIES);
+		}
+		return;
+	}
+	pvt->media_recoveries++;
+	ast_log(LOG_WARNING, "port %i: media stalled (%s), rebuilding the coder channel\n", c + 1, reason);
+	lantiq_task_push(pvt, LANTIQ_TASK_TRACE, reason, NULL);
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_STOP, 0)) {
+		ast_log(LOG_WARNING, "IFX_TAPI_ENC_STOP ioctl failed\n");
+	}
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_DEC_STOP, 0)) {
+		ast_log(LOG_WARNING, "IFX_TAPI_DEC_STOP ioctl failed\n");
+	}
+
+	memset(&map_data, 0, sizeof(map_data));
+	map_data.nDstCh = c;
+	map_data.nChType = IFX_TAPI_MAP_TYPE_PHONE;
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_MAP_DATA_REMOVE, &map_data)) {
+		ast_log(LOG_WARNING, "IFX_TAPI_MAP_DATA_REMOVE %d failed\n", c);
+	}
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_MAP_DATA_ADD, &map_data)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_MAP_DATA_ADD %d failed\n", c);
+		res = -1;
+	}
+
+	/* restarts the coder and the watchdog */
+	if (lantiq_conf_enc(c, pvt->codec)) {
+		res = -1;
+	}
+	if (!res) {
+		LANTIQ_STAT_INC(c, media_recoveries);
+	}
+
+	manager_event(EVENT_FLAG_SYSTEM, "LantiqMediaRecovery",
+		"Channel: %s\r\n"
+		"Port: %i\r\n"
+		"Reason: %s\r\n"
+		"Attempt: %i\r\n"
+		"Result: %s\r\n",
+		pvt->owner ? pvt->owner->name : "", c + 1, reason, pvt->media_recoveries,
+		res ? "Failed" : "Success");
+}
+
+/* Called with iflock held. Looks for a stalled uplink while the port is in a call. */
+static void lantiq_event_media_timeout(struct lantiq_pvt *pvt)
+{
+	if (!dev_ctx.media_timeout || !pvt->owner || pvt->channel_state != INCALL) {
+		/* call over, lantiq_conf_enc() arms us again */
+		return;
+	}
+
+	if (pvt->owner->_state != AST_STATE_UP || pvt->line.vad_type != IFX_TAPI_ENC_VAD_NOVAD) {
+		/* not talking yet, or the DSP may stay quiet during silence */
+		pvt->media_rx = now();
+	} else if (now() - pvt->media_rx >= dev_ctx.media_timeout) {
+		/* lantiq_conf_enc() rearms us, unless the call ran out of attempts */
+		lantiq_media_recover(pvt, "no RTP from the DSP");
+		return;
+	}
+
+	lantiq_timer_start(&pvt->media_timer, pvt, dev_ctx.media_timeout / 2, lantiq_event_media_timeout);
+}
+
+/* Called with iflock held. Arms the media watchdog when the coder starts. */
+static void lantiq_media_watch_start(struct lantiq_pvt *pvt)
+{
+	pvt->media_rx = pvt->media_tx = now();
+	pvt->read_fails = 0;
+	if (dev_ctx.media_timeout) {
+		lantiq_timer_start(&pvt->media_timer, pvt, dev_ctx.media_timeout / 2, lantiq_event_media_timeout);
+	}
+}
+
+/* Called with iflock held when the coder stops */
+static void lantiq_media_watch_stop(struct lantiq_pvt *pvt)
+{
+	lantiq_timer_stop(&pvt->media_timer);
+	pvt->media_recoveries = 0;
+}
+
+/* Called with iflock held. Returns -1 if the coder didn't start. */
+static int lantiq_conf_enc(int c, format_t formatid)
+{
+	/* Configure encoder before starting RTP session */
+	IFX_TAPI_ENC_CFG_t enc_cfg;
+	int res = 0;
+
+	memset(&enc_cfg, 0, sizeof(IFX_TAPI_ENC_CFG_t));
+	switch (formatid) {
+		case AST_FORMAT_G723_1:
+#if defined G723_HIGH_RATE
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G723_63;
+			iflist[c].rtp_payload = RTP_G723_63;
+#else
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G723_53;
+			iflist[c].rtp_payload = RTP_G723_53;
+#endif
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_30;
+			iflist[c].ptime = 30;
+			break;
+		case AST_FORMAT_G729A:
+			 enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G729;
+			 enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
+			 iflist[c].ptime = 10;
+			 iflist[c].rtp_payload = RTP_G729;
+			 break;
+		case AST_FORMAT_ULAW:
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_MLAW;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
+			iflist[c].ptime = 10;
+			iflist[c].rtp_payload = RTP_PCMU;
+			break;
+		case AST_FORMAT_ALAW:
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_ALAW;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
+			iflist[c].ptime = 10;
+			iflist[c].rtp_payload = RTP_PCMA;
+			break;
+		case AST_FORMAT_G726:
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G726_32;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
+			iflist[c].ptime = 10;
+			iflist[c].rtp_payload = RTP_G726;
+			break;
+		case AST_FORMAT_ILBC:
+			/* iLBC 15.2kbps is currently unsupported by Asterisk */
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_ILBC_133;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_30;
+			iflist[c].ptime = 30;
+			iflist[c].rtp_payload = RTP_ILBC;
+			break;
+		case AST_FORMAT_SLINEAR:
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_LIN16_8;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
+			iflist[c].ptime = 10;
+			iflist[c].rtp_payload = RTP_SLIN8;
+			break;
+		case AST_FORMAT_SLINEAR16:
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_LIN16_16;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_10;
+			iflist[c].ptime = 10;
+			iflist[c].rtp_payload = RTP_SLIN16;
+			break;
+		case AST_FORMAT_G722:
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G722_64;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
+			iflist[c].ptime = 20;
+			iflist[c].rtp_payload = RTP_G722;
+			break;
+		case AST_FORMAT_SIREN7:
+			enc_cfg.nEncType = IFX_TAPI_COD_TYPE_G7221_32;
+			enc_cfg.nFrameLen = IFX_TAPI_COD_LENGTH_20;
+			iflist[c].ptime = 20;
+			iflist[c].rtp_payload = RTP_SIREN7;
+			break;
+		default:
+			ast_log(LOG_ERROR, "unsupported format %llu (%s)\n", formatid, ast_getformatname(formatid));
+			return -1;
+	}
+	iflist[c].codec = formatid;
+	ast_log(LOG_DEBUG, "Configuring encoder to use TAPI codec type %d (%s) on channel %i\n", enc_cfg.nEncType, ast_getformatname(formatid), c);
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_CFG_SET, &enc_cfg)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_ENC_CFG_SET %d failed\n", c);
+		res = -1;
+	}
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_START, 0)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_ENC_START ioctl failed\n");
+		res = -1;
+	}
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_DEC_START, 0)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_DEC_START ioctl failed\n");
+		res = -1;
+	}
+
+	if (iflist[c].fax_detect && !iflist[c].fax_armed) {
+		lantiq_fax_detect(c, 1);
+	}
+
+	/* armed on failure too, so a coder that didn't start gets rebuilt */
+	lantiq_media_watch_start(&iflist[c]);
+
+	return res;
+}
+
+
+static int ast_lantiq_write(struct ast_channel *ast, struct ast_frame *frame)
+{
+	char buf[RTP_BUFFER_LEN];
+	rtp_header_t *rtp_header = (rtp_header_t *) buf;
+	struct lantiq_pvt *pvt = ast->tech_pvt;
+	int ret;
+
+	if (ast != pvt->owner) {
+		/* waiting or on hold, the coder belongs to the other call */
+		return 0;
+	}
+
+	if(frame->frametype != AST_FRAME_VOICE) {
+		LANTIQ_STAT_INC(pvt->port_id, other_frames);
+		lantiq_media_debug("unhandled frame type %d\n", frame->frametype);
+		return 0;
+	}
+
+	if(frame->subclass.codec != pvt->codec) {
+		LANTIQ_STAT_INC(pvt->port_id, codec_mismatches);
+		lantiq_media_debug("Received AST voice frame type %llu (%s) but %s was expected.\n", frame->subclass.codec, ast_getformatname(frame->subclass.codec), ast_getformatname(pvt->codec));
+		return 0;
+	}
+
+	if (frame->datalen == 0) {
+		LANTIQ_STAT_INC(pvt->port_id, empty_frames);
+		lantiq_media_debug("we've been prodded\n");
+		return 0;
+	}
+
+	rtp_header->version      = 2;
+	rtp_header->padding      = 0;
+	rtp_header->extension    = 0;
+	rtp_header->csrc_count   = 0;
+	rtp_header->marker       = 0;
+	rtp_header->ssrc         = 0;
+	rtp_header->payload_type = pvt->rtp_payload;
+
+	const int subframes = (iflist[pvt->port_id].ptime + frame->len - 1) / iflist[pvt->port_id].ptime; /* number of subframes in AST frame */
+	const int subframes_rtp = (RTP_BUFFER_LEN - RTP_HEADER_LEN) * subframes / frame->datalen; /* how many frames fit in a single RTP packet */
+
+	/* By default stick to the maximum multiple of native frame length */
+	int length = subframes_rtp * frame->datalen / subframes;
+	int samples = length * frame->samples / frame->datalen;
+
+	char *head = frame->data.ptr;
+	const char *tail = frame->data.ptr + frame->datalen;
+	while (head < tail) {
+		rtp_header->seqno        = pvt->rtp_seqno++;
+		rtp_header->timestamp    = pvt->rtp_timestamp;
+
+		if ((tail - head) < (RTP_BUFFER_LEN - RTP_HEADER_LEN)) {
+			length = tail - head;
+			samples = length * frame->samples / frame->datalen;
+		}
+
+		memcpy(buf + RTP_HEADER_LEN, head, length);
+		head += length;
+		pvt->rtp_timestamp += (rtp_header->payload_type == RTP_G722) ? samples / 2 : samples; /* per RFC3551 */
+
+		ret = write(dev_ctx.ch_fd[pvt->port_id], buf, RTP_HEADER_LEN + length);
+		if (ret < 0) {
+			LANTIQ_STAT_INC(pvt->port_id, write_errors);
+			lantiq_media_debug("TAPI: ast_lantiq_write(): error writing.\n");
+			return -1;
+		}
+		if (ret != (RTP_HEADER_LEN + length)) {
+			LANTIQ_STAT_INC(pvt->port_id, short_writes);
+			lantiq_media_debug("Short TAPI write of %d bytes, expected %d bytes\n", ret, RTP_HEADER_LEN + length);
+			continue;
+		}
+		LANTIQ_STAT_INC(pvt->port_id, tx_packets);
+		pvt->media_tx = now();
+		if (pvt->kpi_downlink_pending) {
+			pvt->kpi_downlink_pending = 0;
+			lantiq_kpi_add(pvt->port_id, LANTIQ_KPI_TALKPATH_DOWN, pvt->kpi_answer);
+		}
+
+#ifdef TODO_DEVEL_INFO
+		ast_debug(1, "ast_lantiq_write(): size: %i version: %i padding: %i extension: %i csrc_count: %i\n"
+			 "marker: %i payload_type: %s seqno: %i timestamp: %i ssrc: %i\n",
+				 (int)ret,
+				 (int)rtp_header->version,
+				 (int)rtp_header->padding,
+				 (int)rtp_header->extension,
+				 (int)rtp_header->csrc_count,
+				 (int)rtp_header->marker,
+				 ast_codec2str(frame->subclass.codec),
+				 (int)rtp_header->seqno,
+				 (int)rtp_header->timestamp,
+				 (int)rtp_header->ssrc);
+#endif
+	}
+
+	return 0;
+}
+
+/*
+ * Codec impairment factors (Ie) and packet-loss robustness (Bpl) for the
+ * E-model, taken from ITU-T G.113 Appendix I where available. Wideband
+ * codecs are rated on the narrowband scale.
+ */
+static const struct lantiq_codec_impairment {
+	format_t codec;
+	int ie;
+	double bpl;
+} lantiq_impairments[] = {
+	{ AST_FORMAT_ULAW,       0, 25.1 },
+	{ AST_FORMAT_ALAW,       0, 25.1 },
+	{ AST_FORMAT_SLINEAR,    0, 25.1 },
+	{ AST_FORMAT_SLINEAR16,  0, 25.1 },
+	{ AST_FORMAT_G722,       0, 25.1 },
+	{ AST_FORMAT_SIREN7,     0, 25.1 },
+	{ AST_FORMAT_G726,       7, 10.0 },
+	{ AST_FORMAT_G729A,     11, 19.0 },
+	{ AST_FORMAT_ILBC,      10, 32.0 },
+	{ AST_FORMAT_G723_1,    15, 16.1 },
+};
+
+struct lantiq_quality {
+	double rfactor;                  /* E-model transmission rating           */
+	double mos;                      /* Estimated MOS-CQE                     */
+	double loss;                     /* Packet loss in percent                */
+	uint32_t delay;                  /* Estimated one way delay in ms         */
+	uint32_t jitter;                 /* Interarrival jitter in ms             */
+};
+
+/*
+ * Simplified E-model (ITU-T G.107) on top of the counters collected by
+ * lantiq_jb_get_stats() and lantiq_rtcp_get_stats(). Only the impairments
+ * the DSP can see are accounted for: playout delay, jitter and lost or
+ * discarded packets on the downlink. Returns -1 if the call never reached
+ * INCALL, its statistics couldn't be read or no media was received.
+ */
+static int lantiq_quality_estimate(const struct lantiq_pvt *pvt, struct lantiq_quality *q)
+{
+	const int rate = (pvt->codec & (AST_FORMAT_SLINEAR16 | AST_FORMAT_SIREN7)) ? 16 : 8; /* G.722 uses an 8kHz RTP clock */
+	uint32_t lost, expected;
+	double ie = 0, bpl = 25.1, d, id, ie_eff, r;
+	unsigned int i;
+
+	if (!pvt->stats_valid || !pvt->codec || !pvt->jb_packets) {
+		return -1;
+	}
+
+	for (i = 0; i < ARRAY_LEN(lantiq_impairments); i++) {
+		if (lantiq_impairments[i].codec == pvt->codec) {
+			ie = lantiq_impairments[i].ie;
+			bpl = lantiq_impairments[i].bpl;
+			break;
+		}
+	}
+
+	/* jb_overflow counts dropped samples, not packets, so it stays out */
+	lost = pvt->jb_late + pvt->jb_early + pvt->jb_invalid;
+	if (pvt->rtcp_lost > 0) {
+		lost += pvt->rtcp_lost;
+	}
+	expected = pvt->jb_packets + (pvt->rtcp_lost > 0 ? pvt->rtcp_lost : 0);
+	q->loss = expected ? 100.0 * lost / expected : 0;
+	if (q->loss > 100) {
+		q->loss = 100;
+	}
+
+	/* effective latency: playout delay, twice the jitter and the coder frame */
+	q->jitter = pvt->rtcp_jitter / rate;
+	q->delay = pvt->jb_delay + 2 * q->jitter + 2 * pvt->ptime;
+	d = q->delay;
+
+	id = 0.024 * d;
+	if (d > 177.3) {
+		id += 0.11 * (d - 177.3);
+	}
+	ie_eff = ie + (95 - ie) * q->loss / (q->loss + bpl);
+
+	r = 93.2 - id - ie_eff;
+	if (r < 0) {
+		r = 0;
+	} else if (r > 100) {
+		r = 100;
+	}
+	q->rfactor = r;
+	q->mos = 1 + 0.035 * r + 0.000007 * r * (r - 60) * (100 - r);
+	if (q->mos < 1) {
+		q->mos = 1;
+	} else if (q->mos > 4.5) {
+		q->mos = 4.5;
+	}
+
+	return 0;
+}
+
+/* Expose the call quality summary as channel variables, CDR variables and a CEL event */
+static void lantiq_quality_publish(struct ast_channel *ast, const struct lantiq_pvt *pvt)
+{
+	struct lantiq_quality q;
+	char rfactor[16], mos[16], loss[16], delay[16], jitter[16];
+	char extra[128];
+
+	if (lantiq_quality_estimate(pvt, &q)) {
+		return;
+	}
+
+	snprintf(rfactor, sizeof(rfactor), "%.1f", q.rfactor);
+	snprintf(mos, sizeof(mos), "%.2f", q.mos);
+	snprintf(loss, sizeof(loss), "%.2f", q.loss);
+	snprintf(delay, sizeof(delay), "%u", q.delay);
+	snprintf(jitter, sizeof(jitter), "%u", q.jitter);
+
+	ast_debug(1, "Call quality on port %i: R=%s MOS=%s loss=%s%% delay=%sms jitter=%sms\n",
+			pvt->port_id, rfactor, mos, loss, delay, jitter);
+
+	pbx_builtin_setvar_helper(ast, "LANTIQ_RFACTOR", rfactor);
+	pbx_builtin_setvar_helper(ast, "LANTIQ_MOS", mos);
+	pbx_builtin_setvar_helper(ast, "LANTIQ_LOSS", loss);
+	pbx_builtin_setvar_helper(ast, "LANTIQ_DELAY", delay);
+	pbx_builtin_setvar_helper(ast, "LANTIQ_JITTER", jitter);
+
+	if (ast->cdr) {
+		ast_cdr_setvar(ast->cdr, "lantiq_rfactor", rfactor, 0);
+		ast_cdr_setvar(ast->cdr, "lantiq_mos", mos, 0);
+		ast_cdr_setvar(ast->cdr, "lantiq_loss", loss, 0);
+	}
+
+	snprintf(extra, sizeof(extra), "rfactor=%s,mos=%s,loss=%s,delay=%s,jitter=%s",
+			rfactor, mos, loss, delay, jitter);
+	ast_cel_report_event(ast, AST_CEL_USER_DEFINED, "LANTIQ_QUALITY", extra, NULL);
+}
+
+static int acf_channel_read(struct ast_channel *chan, const char *funcname, char *args, char *buf, size_t buflen)
+{
+	struct lantiq_pvt *pvt;
+	int res = 0;
+
+	if (!chan || chan->tech != &lantiq_tech) {
+		ast_log(LOG_ERROR, "This function requires a valid Lantiq TAPI channel\n");
+		return -1;
+	}
+
+	ast_mutex_lock(&iflock);
+
+	pvt = (struct lantiq_pvt*) chan->tech_pvt;
+
+	if (!strcasecmp(args, "csd")) {
+		snprintf(buf, buflen, "%lu", (unsigned long int) pvt->call_setup_delay);
+	} else if (!strcasecmp(args, "jitter_stats")){
+		lantiq_jb_get_stats(pvt->port_id);
+		snprintf(buf, buflen, "jbBufSize=%u,jbUnderflow=%u,jbOverflow=%u,jbDelay=%u,jbInvalid=%u",
+				(uint32_t) pvt->jb_size,
+				(uint32_t) pvt->jb_underflow,
+				(uint32_t) pvt->jb_overflow,
+				(uint32_t) pvt->jb_delay,
+				(uint32_t) pvt->jb_invalid);
+	} else if (!strcasecmp(args, "rtcp_stats")) {
+		lantiq_rtcp_get_stats(pvt->port_id);
+		snprintf(buf, buflen, "rtcpLost=%d,rtcpFraction=%u,rtcpJitter=%u",
+				pvt->rtcp_lost,
+				(uint32_t) pvt->rtcp_fraction,
+				pvt->rtcp_jitter);
+	} else if (!strcasecmp(args, "jitter_samples")) {
+		unsigned int i;
+		char *p = buf;
+		size_t left = buflen;
+
+		/* oldest first: time:size:delay:underflow:overflow:invalid:lost:jitter */
+		buf[0] = '\0';
+		for (i = 0; i < pvt->jb_sample_count; i++) {
+			const struct lantiq_jb_sample *s = &pvt->jb_samples[(pvt->jb_sample_head + LANTIQ_JB_SAMPLES - pvt->jb_sample_count + i) % LANTIQ_JB_SAMPLES];
+			if (ast_build_string(&p, &left, "%s%u:%u:%u:%u:%u:%u:%d:%u", i ? ";" : "",
+						s->time, (uint32_t) s->size, (uint32_t) s->delay,
+						s->underflow, s->overflow, s->invalid, s->lost, s->jitter)) {
+				break;
+			}
+		}
+	} else if (!strcasecmp(args, "quality") || !strcasecmp(args, "rfactor") || !strcasecmp(args, "mos")) {
+		struct lantiq_quality q;
+
+		lantiq_jb_get_stats(pvt->port_id);
+		lantiq_rtcp_get_stats(pvt->port_id);
+		if (lantiq_quality_estimate(pvt, &q)) {
+			buf[0] = '\0';
+		} else if (!strcasecmp(args, "rfactor")) {
+			snprintf(buf, buflen, "%.1f", q.rfactor);
+		} else if (!strcasecmp(args, "mos")) {
+			snprintf(buf, buflen, "%.2f", q.mos);
+		} else {
+			snprintf(buf, buflen, "rfactor=%.1f,mos=%.2f,loss=%.2f,delay=%u,jitter=%u",
+					q.rfactor, q.mos, q.loss, q.delay, q.jitter);
+		}
+	} else if (!strcasecmp(args, "jbBufSize")) {
+		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_size);
+	} else if (!strcasecmp(args, "jbUnderflow")) {
+		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_underflow);
+	} else if (!strcasecmp(args, "jbOverflow")) {
+		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_overflow);
+	} else if (!strcasecmp(args, "jbDelay")) {
+		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_delay);
+	} else if (!strcasecmp(args, "jbInvalid")) {
+		snprintf(buf, buflen, "%u", (uint32_t) pvt->jb_invalid);
+	} else if (!strcasecmp(args, "start")) {
+		struct tm *tm = gmtime((const time_t*)&pvt->call_start);
+		strftime(buf, buflen, "%F %T", tm);
+	} else if (!strcasecmp(args, "answer")) {
+		struct tm *tm = gmtime((const time_t*)&pvt->call_answer);
+		strftime(buf, buflen, "%F %T", tm);
+	} else {
+		res = -1;
+	}
+
+	ast_mutex_unlock(&iflock);
+
+	return res;
+}
+
+/* CHANNEL(profile)=NAME switches the port to a DSP profile for the rest of the call */
+static int acf_channel_write(struct ast_channel *chan, const char *function, char *data, const char *value)
+{
+	struct lantiq_pvt *pvt;
+	int profile, res = 0;
+
+	if (!chan || chan->tech != &lantiq_tech) {
+		ast_log(LOG_ERROR, "This function requires a valid Lantiq TAPI channel\n");
+		return -1;
+	}
+
+	if (strcasecmp(data, "profile")) {
+		return -1;
+	}
+
+	ast_mutex_lock(&iflock);
+
+	pvt = (struct lantiq_pvt*) chan->tech_pvt;
+
+	if ((profile = lantiq_profile_find(value)) < 0) {
+		ast_log(LOG_WARNING, "Unknown DSP profile '%s'\n", value);
+		res = -1;
+	} else if (!pvt || pvt->owner != chan) {
+		/* a waiting call shares the port, see lantiq_dev_event_flash() */
+		ast_log(LOG_WARNING, "%s doesn't own its port, not switching the DSP profile\n", chan->name);
+		res = -1;
+	} else {
+		ast_verb(3, "%s switches to DSP profile %s\n", chan->name, lantiq_profiles[profile].name);
+		res = lantiq_line_set(pvt, &lantiq_profiles[profile].line);
+	}
+
+	ast_mutex_unlock(&iflock);
+
+	return res;
+}
+
+
+static struct ast_frame * ast_lantiq_exception(struct ast_channel *ast)
+{
+	ast_log(LOG_DEBUG, "entering... no code here...\n");
+	return NULL;
+}
+
+static void lantiq_jb_get_stats(int c) {
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	IFX_TAPI_JB_STATISTICS_t param;
+	memset (&param, 0, sizeof (param));
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_JB_STATISTICS_GET, (IFX_int32_t) &param) != IFX_SUCCESS) {
+		ast_debug(1, "Error getting jitter buffer  stats.\n");
+	} else {
+#if !defined (TAPI_VERSION3) && defined (TAPI_VERSION4)
+		ast_debug(1, "Jitter buffer stats:  dev=%u, ch=%u, nType=%u, nBufSize=%u, nIsUnderflow=%u, nDsOverflow=%u, nPODelay=%u, nInvalid=%u\n", 
+				(uint32_t) param.dev,
+				(uint32_t) param.ch,
+#else
+		ast_debug(1, "Jitter buffer stats:  nType=%u, nBufSize=%u, nIsUnderflow=%u, nDsOverflow=%u, nPODelay=%u, nInvalid=%u\n", 
+#endif
+				(uint32_t) param.nType,
+				(uint32_t) param.nBufSize,
+				(uint32_t) param.nIsUnderflow,
+				(uint32_t) param.nDsOverflow,
+				(uint32_t) param.nPODelay,
+				(uint32_t) param.nInvalid);
+		
+		pvt->jb_size = param.nBufSize;
+		pvt->jb_underflow = param.nIsUnderflow;
+		pvt->jb_overflow = param.nDsOverflow;
+		pvt->jb_invalid = param.nInvalid;
+		pvt->jb_delay = param.nPODelay;
+		pvt->jb_packets = param.nPackets;
+		pvt->jb_late = param.nLate;
+		pvt->jb_early = param.nEarly;
+		if (pvt->channel_state == INCALL) {
+			pvt->stats_valid = 1;
+		}
+	}
+}
+
+static void lantiq_rtcp_get_stats(int c) {
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	IFX_TAPI_PKT_RTCP_STATISTICS_t param;
+	memset (&param, 0, sizeof (param));
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_PKT_RTCP_STATISTICS_GET, (IFX_int32_t) &param) != IFX_SUCCESS) {
+		ast_debug(1, "Error getting RTCP stats.\n");
+	} else {
+		ast_debug(1, "RTCP stats:  psent=%u, osent=%u, fraction=%u, lost=%d, jitter=%u\n",
+				(uint32_t) param.psent,
+				(uint32_t) param.osent,
+				(uint32_t) param.fraction,
+				(int32_t) param.lost,
+				(uint32_t) param.jitter);
+
+		pvt->rtcp_lost = param.lost;
+		pvt->rtcp_fraction = param.fraction;
+		pvt->rtcp_jitter = param.jitter;
+	}
+}
+
+/*
+ * Called with iflock held when a call takes over the port's coder. The DSP
+ * counts from its last reset, so the statistics of a call start over here.
+ */
+static void lantiq_stats_reset(int c)
+{
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_JB_STATISTICS_RESET, 0)) {
+		ast_debug(1, "Error resetting jitter buffer stats.\n");
+	}
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_PKT_RTCP_STATISTICS_RESET, 0)) {
+		ast_debug(1, "Error resetting RTCP stats.\n");
+	}
+
+	pvt->jb_size = 0;
+	pvt->jb_underflow = 0;
+	pvt->jb_overflow = 0;
+	pvt->jb_delay = 0;
+	pvt->jb_invalid = 0;
+	pvt->jb_packets = 0;
+	pvt->jb_late = 0;
+	pvt->jb_early = 0;
+	pvt->rtcp_lost = 0;
+	pvt->rtcp_jitter = 0;
+	pvt->rtcp_fraction = 0;
+	pvt->stats_valid = 0;
+}
+
+static void lantiq_stats_sample(int c)
+{
+	struct lantiq_pvt *pvt = &iflist[c];
+	struct lantiq_jb_sample *s = &pvt->jb_samples[pvt->jb_sample_head];
+
+	lantiq_jb_get_stats(c);
+	lantiq_rtcp_get_stats(c);
+
+	s->time = now() - pvt->stats_start;
+	s->size = pvt->jb_size;
+	s->delay = pvt->jb_delay;
+	s->underflow = pvt->jb_underflow;
+	s->overflow = pvt->jb_overflow;
+	s->invalid = pvt->jb_invalid;
+	s->lost = pvt->rtcp_lost;
+	s->jitter = pvt->rtcp_jitter;
+	s->fraction = pvt->rtcp_fraction;
+
+	pvt->jb_sample_head = (pvt->jb_sample_head + 1) % LANTIQ_JB_SAMPLES;
+	if (pvt->jb_sample_count < LANTIQ_JB_SAMPLES) {
+		pvt->jb_sample_count++;
+	}
+}
+
+/* Called with iflock held */
+static void lantiq_event_stats_timeout(struct lantiq_pvt *pvt)
+{
+	if (pvt->channel_state == INCALL) {
+		lantiq_stats_sample(pvt->port_id);
+		/* keep the same interval */
+		lantiq_timer_start(&pvt->stats_timer, pvt, dev_ctx.stats_interval, lantiq_event_stats_timeout);
+	}
+}
+
+/* Called with iflock held when a port enters INCALL */
+static void lantiq_stats_start(struct lantiq_pvt *pvt)
+{
+	/* whatever was read before belongs to another call */
+	pvt->stats_valid = 0;
+	pvt->jb_sample_head = 0;
+	pvt->jb_sample_count = 0;
+	pvt->stats_start = now();
+
+	if (!dev_ctx.stats_interval || lantiq_timer_pending(&pvt->stats_timer)) {
+		return;
+	}
+
+	lantiq_timer_start(&pvt->stats_timer, pvt, dev_ctx.stats_interval, lantiq_event_stats_timeout);
+}
+
+/* Called with iflock held when a port leaves INCALL */
+static void lantiq_stats_stop(struct lantiq_pvt *pvt)
+{
+	lantiq_timer_stop(&pvt->stats_timer);
+}
+
+static char *lantiq_show_jitter(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct lantiq_pvt *pvt;
+	unsigned int i;
+	int port;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq show jitter";
+		e->usage =
+			"Usage: lantiq show jitter <port>\n"
+			"       Shows the jitter buffer and RTCP statistics sampled\n"
+			"       during the current (or last) call on a TAPI port.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	port = atoi(a->argv[3]);
+	if (port < 1 || port > dev_ctx.channels) {
+		ast_cli(a->fd, "Unknown port '%s'\n", a->argv[3]);
+		return CLI_FAILURE;
+	}
+
+	ast_mutex_lock(&iflock);
+	pvt = &iflist[port - 1];
+	ast_cli(a->fd, "%8s %6s %6s %10s %10s %10s %8s %8s %5s\n",
+		"Time(ms)", "Size", "Delay", "Underflow", "Overflow", "Invalid", "Lost", "Jitter", "Frac");
+	for (i = 0; i < pvt->jb_sample_count; i++) {
+		const struct lantiq_jb_sample *s = &pvt->jb_samples[(pvt->jb_sample_head + LANTIQ_JB_SAMPLES - pvt->jb_sample_count + i) % LANTIQ_JB_SAMPLES];
+		ast_cli(a->fd, "%8u %6u %6u %10u %10u %10u %8d %8u %5u\n",
+			s->time, (uint32_t) s->size, (uint32_t) s->delay,
+			s->underflow, s->overflow, s->invalid,
+			s->lost, s->jitter, (uint32_t) s->fraction);
+	}
+	ast_cli(a->fd, "%u sample(s), interval %i ms\n", pvt->jb_sample_count, dev_ctx.stats_interval);
+	ast_mutex_unlock(&iflock);
+
+	return CLI_SUCCESS;
+}
+
+static char *lantiq_show_ports(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int c;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq show ports";
+		e->usage =
+			"Usage: lantiq show ports\n"
+			"       Shows the state of every TAPI port.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-4s %-10s %-20s %-8s %-4s %-6s %-10s %-8s %-8s\n",
+		"Port", "State", "Owner", "Codec", "PT", "Seq", "Timestamp", "RX(ms)", "TX(ms)");
+
+	ast_mutex_lock(&iflock);
+	for (c = 0; c < dev_ctx.channels; c++) {
+		struct lantiq_pvt *pvt = &iflist[c];
+
+		char rx[16] = "-", tx[16] = "-";
+
+		if (pvt->owner && pvt->channel_state == INCALL) {
+			/* time since the last RTP packet in either direction */
+			snprintf(rx, sizeof(rx), "%u", now() - pvt->media_rx);
+			snprintf(tx, sizeof(tx), "%u", now() - pvt->media_tx);
+		}
+		ast_cli(a->fd, "%-4i %-10s %-20s %-8s %-4i %-6u %-10u %-8s %-8s\n",
+			c + 1,
+			pvt->line_fault ? "FAULT" : state_string(pvt->channel_state),
+			pvt->owner ? pvt->owner->name : "(none)",
+			pvt->codec ? ast_getformatname(pvt->codec) : "-",
+			(int) pvt->rtp_payload,
+			(uint32_t) pvt->rtp_seqno,
+			(uint32_t) pvt->rtp_timestamp,
+			rx, tx);
+	}
+	ast_mutex_unlock(&iflock);
+
+	return CLI_SUCCESS;
+}
+
+static char *lantiq_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int c;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq show stats";
+		e->usage =
+			"Usage: lantiq show stats\n"
+			"       Shows the media path and ioctl counters of every TAPI port,\n"
+			"       including the stalls the media watchdog found and the\n"
+			"       coder channels it rebuilt.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-4s %10s %10s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+		"Port", "RX pkts", "TX pkts", "ShortWr", "WrErr", "LockDrop", "PTMism", "RdErr", "IoctlErr",
+		"Stalls", "Recover", "CN", "CodecMis", "Empty", "NonVoice");
+
+	for (c = 0; c < dev_ctx.channels; c++) {
+		const struct lantiq_port_stats *st = &port_stats[c];
+
+		ast_cli(a->fd, "%-4i %10u %10u %8u %8u %8u %8u %8u %8u %8u %8u %8u %8u %8u %8u\n",
+			c + 1,
+			(uint32_t) st->rx_packets,
+			(uint32_t) st->tx_packets,
+			(uint32_t) st->short_writes,
+			(uint32_t) st->write_errors,
+			(uint32_t) st->trylock_drops,
+			(uint32_t) st->pt_mismatches,
+			(uint32_t) st->read_errors,
+			(uint32_t) st->ioctl_errors,
+			(uint32_t) st->media_stalls,
+			(uint32_t) st->media_recoveries,
+			(uint32_t) st->cn_frames,
+			(uint32_t) st->codec_mismatches,
+			(uint32_t) st->empty_frames,
+			(uint32_t) st->other_frames);
+	}
+
+	return CLI_SUCCESS;
+}
+
+static char *lantiq_show_ioctls(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	const struct lantiq_ioctl_stats *st;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq show ioctls";
+		e->usage =
+			"Usage: lantiq show ioctls\n"
+			"       Shows call counts, failures and latency histograms\n"
+			"       of the TAPI ioctls issued by the driver.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-36s %10s %8s %10s\n", "Ioctl", "Calls", "Errors", "Max(us)");
+	for (st = ioctl_stats; ; st++) {
+		if (st->calls) {
+			ast_cli(a->fd, "%-36s %10u %8u %10u\n", st->name,
+				(uint32_t) st->calls, (uint32_t) st->errors, (uint32_t) st->latency.max);
+			lantiq_hist_print(a->fd, &st->latency);
+		}
+		if (!st->cmd) {
+			break;
+		}
+	}
+
+	return CLI_SUCCESS;
+}
+
+static char *lantiq_show_kpis(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int c, k;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq show kpis";
+		e->usage =
+			"Usage: lantiq show kpis\n"
+			"       Shows the signalling latency histograms of every TAPI port:\n"
+			"       time to dial tone, post-dial delay, interdigit timeout\n"
+			"       waits and answer to talk path in both directions.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	for (c = 0; c < dev_ctx.channels; c++) {
+		ast_cli(a->fd, "Port %i:\n", c + 1);
+		ast_cli(a->fd, "  %-30s %8s %10s\n", "KPI", "Count", "Max(us)");
+		for (k = 0; k < LANTIQ_KPI_MAX; k++) {
+			const struct lantiq_histogram *h = &port_kpi[c][k];
+
+			ast_cli(a->fd, "  %-30s %8u %10u\n", kpi_names[k], (uint32_t) h->count, (uint32_t) h->max);
+			if (h->count) {
+				lantiq_hist_print(a->fd, h);
+			}
+		}
+	}
+
+	return CLI_SUCCESS;
+}
+
+/* Formats a trace record, with its time relative to now */
+static void lantiq_trace_format(const struct lantiq_trace_rec *rec, uint64_t now, char *buf, size_t len)
+{
+	const uint64_t age = now > rec->time ? now - rec->time : 0;
+	char arg[48];
+
+	switch (rec->type) {
+		case LANTIQ_TRACE_STATE:
+			snprintf(arg, sizeof(arg), "line %u", rec->arg);
+			break;
+		case LANTIQ_TRACE_EVENT:
+			snprintf(arg, sizeof(arg), "%08X %s", rec->arg, lantiq_event_name(rec->arg));
+			break;
+		case LANTIQ_TRACE_IOCTL:
+			ast_copy_string(arg, lantiq_ioctl_name(rec->arg), sizeof(arg));
+			break;
+		case LANTIQ_TRACE_STALL:
+			snprintf(arg, sizeof(arg), "rebuild %u", rec->arg);
+			break;
+		case LANTIQ_TRACE_FAULT:
+			ast_copy_string(arg, rec->arg ? "set" : "cleared", sizeof(arg));
+			break;
+		default:
+			arg[0] = '\0';
+	}
+
+	snprintf(buf, len, "-%5u.%06u %-5s %-10s %-10s %s",
+		(uint32_t) (age / 1000000), (uint32_t) (age % 1000000),
+		rec->type < LANTIQ_TRACE_MAX ? trace_names[rec->type] : "?",
+		state_string(rec->old_state), state_string(rec->new_state), arg);
+}
+
+/* Index of the oldest record still in a port's trace ring, and its end */
+static void lantiq_trace_range(int c, unsigned int *first, unsigned int *end)
+{
+	*end = port_trace[c].head;
+	*first = *end > LANTIQ_TRACE_SIZE ? *end - LANTIQ_TRACE_SIZE : 0;
+}
+
+/* Runs on the port's taskprocessor. Writes the port's trace ring to the log dir. */
+static void lantiq_trace_dump(int c, const char *reason)
+{
+	const uint64_t now = now_us();
+	char path[PATH_MAX], line[128];
+	struct timeval tv = ast_tvnow();
+	unsigned int i, end;
+	struct ast_tm tm;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/" LANTIQ_TRACE_FILE, ast_config_AST_LOG_DIR, c + 1);
+	if (!(f = fopen(path, "w"))) {
+		ast_log(LOG_WARNING, "unable to write %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	ast_localtime(&tv, &tm, NULL);
+	fprintf(f, "TAPI port %i trace at %04d-%02d-%02d %02d:%02d:%02d: %s\n",
+		c + 1, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, reason);
+	for (lantiq_trace_range(c, &i, &end); i != end; i++) {
+		lantiq_trace_format(&port_trace[c].rec[i & (LANTIQ_TRACE_SIZE - 1)], now, line, sizeof(line));
+		fprintf(f, "%s\n", line);
+	}
+	fclose(f);
+
+	ast_verb(3, "TAPI port %i trace written to %s\n", c + 1, path);
+}
+
+static char *lantiq_show_trace(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	const uint64_t now = now_us();
+	unsigned int i, end;
+	char line[128];
+	int port;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq show trace";
+		e->usage =
+			"Usage: lantiq show trace <port>\n"
+			"       Shows the last state changes, TAPI events, failed ioctls\n"
+			"       and media stalls of a TAPI port, oldest first, with their\n"
+			"       age in seconds. Line faults and media stalls also write\n"
+			"       it to " LANTIQ_TRACE_FILE " in the log directory.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4) {
+		return CLI_SHOWUSAGE;
+	}
+
+	port = atoi(a->argv[3]);
+	if (port < 1 || port > dev_ctx.channels) {
+		ast_cli(a->fd, "Invalid port %s\n", a->argv[3]);
+		return CLI_FAILURE;
+	}
+
+	ast_cli(a->fd, "%-13s %-5s %-10s %-10s %s\n", "Age(s)", "Type", "Old", "New", "Argument");
+	for (lantiq_trace_range(port - 1, &i, &end); i != end; i++) {
+		lantiq_trace_format(&port_trace[port - 1].rec[i & (LANTIQ_TRACE_SIZE - 1)], now, line, sizeof(line));
+		ast_cli(a->fd, "%s\n", line);
+	}
+
+	return CLI_SUCCESS;
+}
+
+static char *lantiq_show_events(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	int i, head;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq show events";
+		e->usage =
+			"Usage: lantiq show events\n"
+			"       Shows how often each unexpected TAPI event was seen\n"
+			"       and the most recent ones, newest first.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-10s %-24s %10s\n", "Event", "Name", "Count");
+	for (i = 0; i < LANTIQ_EVENT_IDS && event_counts[i].id; i++) {
+		ast_cli(a->fd, "%08X   %-24s %10u\n", (uint32_t) event_counts[i].id,
+			lantiq_event_name(event_counts[i].id), (uint32_t) event_counts[i].count);
+	}
+	if (event_counts_lost) {
+		ast_cli(a->fd, "%-35s %10u\n", "(other IDs)", (uint32_t) event_counts_lost);
+	}
+
+	ast_cli(a->fd, "\n%-12s %-4s %-10s %-24s %-6s %s\n", "Time", "Port", "Event", "Name", "Data", "Action");
+	head = event_trace_head;
+	for (i = head - 1; i >= 0 && i >= head - LANTIQ_EVENT_TRACE; i--) {
+		const struct lantiq_event_trace *t = &event_trace[i & (LANTIQ_EVENT_TRACE - 1)];
+		struct ast_tm tm;
+
+		ast_localtime(&t->tv, &tm, NULL);
+		ast_cli(a->fd, "%02d:%02d:%02d.%03d %-4i %08X   %-24s %04X   %s\n",
+			tm.tm_hour, tm.tm_min, tm.tm_sec, tm.tm_usec / 1000, t->port + 1,
+			(uint32_t) t->id, lantiq_event_name(t->id), (uint32_t) t->data & 0xFFFF, t->action);
+	}
+
+	return CLI_SUCCESS;
+}
+
+static char *lantiq_reset_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct lantiq_ioctl_stats *ist;
+	int c, k;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "lantiq reset stats";
+		e->usage =
+			"Usage: lantiq reset stats\n"
+			"       Clears the counters shown by 'lantiq show stats',\n"
+			"       'lantiq show ioctls', 'lantiq show kpis' and\n"
+			"       'lantiq show events'.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	for (c = 0; c < TAPI_AUDIO_PORT_NUM_MAX; c++) {
+		struct lantiq_port_stats *st = &port_stats[c];
+
+		st->rx_packets = 0;
+		st->tx_packets = 0;
+		st->short_writes = 0;
+		st->write_errors = 0;
+		st->trylock_drops = 0;
+		st->pt_mismatches = 0;
+		st->cn_frames = 0;
+		st->codec_mismatches = 0;
+		st->empty_frames = 0;
+		st->other_frames = 0;
+		st->read_errors = 0;
+		st->ioctl_errors = 0;
+		st->media_stalls = 0;
+		st->media_recoveries = 0;
+		for (k = 0; k < LANTIQ_KPI_MAX; k++) {
+			lantiq_hist_reset(&port_kpi[c][k]);
+		}
+	}
+	for (ist = ioctl_stats; ; ist++) {
+		ist->calls = 0;
+		ist->errors = 0;
+		lantiq_hist_reset(&ist->latency);
+		if (!ist->cmd) {
+			break;
+		}
+	}
+	/* the IDs stay, the monitor thread may be adding to their slots */
+	for (k = 0; k < LANTIQ_EVENT_IDS; k++) {
+		event_counts[k].count = 0;
+	}
+	event_counts_lost = 0;
+	ast_cli(a->fd, "TAPI port counters cleared\n");
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry lantiq_cli[] = {
+	AST_CLI_DEFINE(lantiq_show_ports, "Show the state of the TAPI ports"),
+	AST_CLI_DEFINE(lantiq_show_stats, "Show TAPI port counters"),
+	AST_CLI_DEFINE(lantiq_show_ioctls, "Show TAPI ioctl statistics"),
+	AST_CLI_DEFINE(lantiq_show_kpis, "Show TAPI signalling latency KPIs"),
+	AST_CLI_DEFINE(lantiq_show_events, "Show unexpected TAPI events"),
+	AST_CLI_DEFINE(lantiq_show_trace, "Show the event and state trace of a TAPI port"),
+	AST_CLI_DEFINE(lantiq_reset_stats, "Reset TAPI port counters"),
+	AST_CLI_DEFINE(lantiq_show_jitter, "Show sampled jitter buffer statistics of a TAPI port"),
+};
+
+static int lantiq_standby(int c)
+{
+	ast_debug(1, "Stopping line feed for channel %i\n", c);
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_STANDBY)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_LINE_FEED_SET ioctl failed\n");
+		return -1;
+	}
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_STOP, 0)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_ENC_STOP ioctl failed\n");
+		return -1;
+	}
+
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_DEC_STOP, 0)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_DEC_STOP ioctl failed\n");
+		return -1;
+	}
+
+	if (iflist[c].fax_armed) {
+		lantiq_fax_detect(c, 0);
+	}
+	iflist[c].fax_mode = 0;
+	lantiq_media_watch_stop(&iflist[c]);
+
+	return lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
+}
+
+static int lantiq_end_dialing(int c)
+{
+	ast_log(LOG_DEBUG, "TODO - DEBUG MSG\n");
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	lantiq_timer_stop(&pvt->dial_timer);
+
+	lantiq_teardown(pvt);
+	lantiq_reset_dtmfbuf(pvt);
+
+	return 0;
+}
+
+static int lantiq_end_call(int c)
+{
+	ast_log(LOG_DEBUG, "TODO - DEBUG MSG\n");
+
+	struct lantiq_pvt *pvt = &iflist[c];
+	
+	if(pvt->owner) {
+		lantiq_jb_get_stats(c);
+		lantiq_teardown(pvt);
+	}
+
+	return 0;
+}
+
+/* Allocates a channel for port c, not yet attached to the port's pvt */
+static struct ast_channel *lantiq_channel_alloc(int state, int c, const char *ext, const char *ctx)
+{
+	struct ast_channel *chan;
+
+	chan = ast_channel_alloc(1, state, NULL, NULL, "", ext, ctx, 0, c, "TAPI/%d", c + 1);
+	if (! chan) {
+		ast_log(LOG_DEBUG, "Cannot allocate channel!\n");
+		return NULL;
+	}
+
+	chan->tech = &lantiq_tech;
+	chan->nativeformats = lantiq_tech.capabilities;
+
+	return chan;
+}
+
+static struct ast_channel * lantiq_channel(int state, int c, char *ext, char *ctx, format_t format)
+{
+	struct ast_channel *chan = NULL;
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	chan = lantiq_channel_alloc(state, c, ext, ctx);
+	if (! chan) {
+		return NULL;
+	}
+/*
+	char buf[BUFSIZ];
+	if (format != 0 && ! (format & lantiq_tech.capabilities)) {
+		ast_log(LOG_WARNING, "Requested channel with unsupported format %s. Forcing ALAW.\n", ast_getformatname_multiple(buf, sizeof(buf), format));
+		format = AST_FORMAT_ALAW;
+	} else {
+		format = lantiq_tech.capabilities;
+	}
+*/
+	chan->tech_pvt = pvt;
+
+	pvt->owner = chan;
+	lantiq_stats_reset(c);
+
+	if (format != 0)
+		if (lantiq_conf_enc(c, format) < 0)
+			return NULL;
+
+	return chan;
+}
+
+static struct ast_channel * ast_lantiq_requester(const char *type, format_t format, const struct ast_channel *requestor, void *data, int *cause)
+{
+	ast_mutex_lock(&iflock);
+
+	char buf[BUFSIZ];
+	struct ast_channel *chan = NULL;
+	int port_id = -1;
+
+	ast_debug(1, "Asked to create a TAPI channel with formats: %s\n", ast_getformatname_multiple(buf, sizeof(buf), format));
+
+
+	/* check for correct data argument */
+	if (ast_strlen_zero(data)) {
+		ast_log(LOG_ERROR, "Unable to create channel with empty destination.\n");
+		*cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
+		goto bailout;
+	}
+
+	/* get our port number */
+	port_id = atoi((char*) data);
+	if (port_id < 1 || port_id > dev_ctx.channels) {
+		ast_log(LOG_ERROR, "Unknown channel ID: \"%s\"\n", (char*) data);
+		*cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
+		goto bailout;
+	}
+
+	/* on asterisk user's side, we're using port 1-2.
+	 * Here in non normal human's world, we begin
+	 * counting at 0.
+	 */
+	port_id -= 1;
+
+	if (!dev_ctx.ready) {
+		ast_debug(1, "TAPI device not ready yet, port %i unavailable\n", port_id + 1);
+		*cause = AST_CAUSE_REQUESTED_CHAN_UNAVAIL;
+		goto bailout;
+	}
+
+	/* Bail out if channel is already in use */
+	struct lantiq_pvt *pvt = &iflist[port_id];
+	if (pvt->line_fault) {
+		ast_debug(1, "TAPI port %i is out of service after a line fault\n", port_id + 1);
+		*cause = AST_CAUSE_REQUESTED_CHAN_UNAVAIL;
+	} else if (pvt->channel_state == ONHOOK) {
+		chan = lantiq_channel(AST_STATE_DOWN, port_id, NULL, NULL, format);
+	} else if (pvt->call_waiting && pvt->channel_state == INCALL && pvt->owner && !pvt->waiting) {
+		/* shares the port's coder with the active call, see lantiq_dev_event_flash() */
+		chan = lantiq_channel_alloc(AST_STATE_DOWN, port_id, NULL, NULL);
+		if (chan) {
+			chan->tech_pvt = pvt;
+			pvt->waiting = chan;
+			pvt->waiting_format = format;
+		}
+	} else {
+		ast_debug(1, "TAPI channel %i alread in use.\n", port_id+1);
+	}
+
+bailout:
+	ast_mutex_unlock(&iflock);
+	return chan;
+}
+
+static int ast_lantiq_devicestate(void *data)
+{
+	int port = atoi((char *) data) - 1;
+	if ((port < 0) || (port >= dev_ctx.channels)) {
+		return AST_DEVICE_INVALID;
+	}
+
+	/* still booting, or the DSP failed to come up */
+	if (!dev_ctx.ready) {
+		return AST_DEVICE_UNAVAILABLE;
+	}
+
+	if (iflist[port].line_fault) {
+		return AST_DEVICE_UNAVAILABLE;
+	}
+
+	switch (iflist[port].channel_state) {
+		case ONHOOK:
+			return AST_DEVICE_NOT_INUSE;
+		case OFFHOOK:
+		case DIALING:
+		case INCALL:
+		case CALL_ENDED:
+			return AST_DEVICE_INUSE;
+		case RINGING:
+			return AST_DEVICE_RINGING;
+		case UNKNOWN:
+		default:
+			return AST_DEVICE_UNKNOWN;
+	}
+}
+
+static int lantiq_dev_data_handler(int c)
+{
+	char buf[BUFSIZ];
+	struct ast_frame frame = {0};
+
+	struct lantiq_pvt *pvt = (struct lantiq_pvt *) &iflist[c];
+	int res = read(dev_ctx.ch_fd[c], buf, sizeof(buf));
+	if (res <= 0) {
+		LANTIQ_STAT_INC(c, read_errors);
+		lantiq_media_debug("we got read error %i\n", res);
+		if (++pvt->read_fails >= LANTIQ_MEDIA_READ_FAILS) {
+			ast_mutex_lock(&iflock);
+			pvt->read_fails = 0;
+			if (pvt->owner && pvt->channel_state == INCALL) {
+				lantiq_media_recover(pvt, "read errors");
+			}
+			ast_mutex_unlock(&iflock);
+		}
+		return 0;
+	}
+	LANTIQ_STAT_INC(c, rx_packets);
+	pvt->media_rx = now();
+	pvt->read_fails = 0;
+
+	rtp_header_t *rtp = (rtp_header_t*) buf;
+	if ((!pvt->owner) || (pvt->owner->_state != AST_STATE_UP)) {
+		return 0;
+	}
+
+	if(rtp->payload_type != pvt->rtp_payload) {
+		if (rtp->payload_type == RTP_CN) {
+			/* TODO: Handle Comfort Noise frames */
+			LANTIQ_STAT_INC(c, cn_frames);
+			lantiq_media_debug("Dropping Comfort Noise frame\n");
+			return 0;
+		}
+		LANTIQ_STAT_INC(c, pt_mismatches);
+		lantiq_media_debug("Received RTP payload type %d but %d was expected.\n", rtp->payload_type, pvt->rtp_payload);
+		return 0;
+	}
+
+	frame.src = "TAPI";
+	frame.frametype = AST_FRAME_VOICE;
+	frame.subclass.codec = pvt->codec;
+	frame.datalen = res - RTP_HEADER_LEN;
+	frame.data.ptr = buf + RTP_HEADER_LEN;
+	frame.samples = ast_codec_get_samples(&frame);
+
+	if(!ast_channel_trylock(pvt->owner)) {
+		ast_queue_frame(pvt->owner, &frame);
+		ast_channel_unlock(pvt->owner);
+		if (pvt->kpi_uplink_pending) {
+			pvt->kpi_uplink_pending = 0;
+			lantiq_kpi_add(c, LANTIQ_KPI_TALKPATH_UP, pvt->kpi_answer);
+		}
+	} else {
+		LANTIQ_STAT_INC(c, trylock_drops);
+	}
+
+/*	ast_debug(1, "lantiq_dev_data_handler(): size: %i version: %i padding: %i extension: %i csrc_count: %i \n"
+				 "marker: %i payload_type: %s seqno: %i timestamp: %i ssrc: %i\n", 
+				 (int)res,
+				 (int)rtp->version,
+				 (int)rtp->padding,
+				 (int)rtp->extension,
+				 (int)rtp->csrc_count,
+				 (int)rtp->marker,
+				 ast_codec2str(frame.subclass.codec),
+				 (int)rtp->seqno,
+				 (int)rtp->timestamp,
+				 (int)rtp->ssrc);
+*/
+	return 0;
+}
+
+static int accept_call(int c)
+{ 
+	ast_log(LOG_DEBUG, "TODO - DEBUG MSG\n");
+
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	if (pvt->owner) {
+		struct ast_channel *chan = pvt->owner;
+
+		switch (chan->_state) {
+			case AST_STATE_RINGING:
+				lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
+				ast_queue_control(pvt->owner, AST_CONTROL_ANSWER);
+				lantiq_state_set(pvt, INCALL);
+				pvt->call_start = epoch();
+				pvt->call_answer = pvt->call_start;
+				lantiq_kpi_answer(pvt);
+				lantiq_stats_start(pvt);
+				break;
+			case AST_STATE_UP:
+				/* held call rung back by lantiq_cw_recall() */
+				ast_queue_control(pvt->owner, AST_CONTROL_UNHOLD);
+				lantiq_state_set(pvt, INCALL);
+				pvt->call_start = epoch();
+				lantiq_stats_start(pvt);
+				break;
+			default:
+				ast_log(LOG_WARNING, "entered unhandled state %s\n", ast_state2str(chan->_state));
+		}
+	}
+
+	return 0;
+}
+
+/* Map a dialed character to its symbol index, -1 if it can't be dialed */
+static int lantiq_digitmap_symbol(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c == '*') {
+		return 10;
+	} else if (c == '#') {
+		return 11;
+	} else if (c >= 'A' && c <= 'D') {
+		return 12 + c - 'A';
+	} else if (c >= 'a' && c <= 'd') {
+		return 12 + c - 'a';
+	}
+
+	return -1;
+}
+
+static int lantiq_digitmap_node(struct lantiq_digitmap *map, int parent, uint16_t mask, uint16_t flags)
+{
+	int n;
+
+	for (n = map->nodes[parent].child; n; n = map->nodes[n].sibling) {
+		if (map->nodes[n].mask == mask && (map->nodes[n].flags & (DIGITMAP_LOOP | DIGITMAP_EARLY)) == flags) {
+			return n;
+		}
+	}
+
+	if (map->len >= LANTIQ_DIGITMAP_MAX_NODES) {
+		return -1;
+	}
+
+	n = map->len++;
+	map->nodes[n].mask = mask;
+	map->nodes[n].flags = flags;
+	map->nodes[n].child = 0;
+	map->nodes[n].sibling = map->nodes[parent].child;
+	map->nodes[parent].child = n;
+
+	return n;
+}
+
+/* Add one extension name to the trie. Names that can't be dialed are skipped. */
+static int lantiq_digitmap_add(struct lantiq_digitmap *map, const char *exten)
+{
+	uint16_t masks[AST_MAX_EXTENSION];
+	uint16_t tail = 0;
+	int len = 0, node = 0, i, sym;
+	const char *p = exten;
+
+	if (*p == '_') {
+		for (p++; *p && !tail; p++) {
+			uint16_t mask = 0;
+
+			switch (*p) {
+				case 'X': case 'x': mask = 0x03FF; break;
+				case 'Z': case 'z': mask = 0x03FE; break;
+				case 'N': case 'n': mask = 0x03FC; break;
+				case '.': tail = DIGITMAP_LOOP; continue;
+				case '!': tail = DIGITMAP_LOOP | DIGITMAP_EARLY; continue;
+				case '-': case ' ': continue;
+				case '[':
+					for (p++; *p && *p != ']'; p++) {
+						if (p[1] == '-' && p[2] && p[2] != ']') {
+							int from = lantiq_digitmap_symbol(p[0]), to = lantiq_digitmap_symbol(p[2]);
+							if (from >= 0 && to >= from && to <= 9) {
+								for (sym = from; sym <= to; sym++) {
+									mask |= 1 << sym;
+								}
+							}
+							p += 2;
+						} else if ((sym = lantiq_digitmap_symbol(*p)) >= 0) {
+							mask |= 1 << sym;
+						}
+					}
+					if (!*p) {
+						return 0;
+					}
+					break;
+				default:
+					if ((sym = lantiq_digitmap_symbol(*p)) < 0) {
+						return 0;
+					}
+					mask = 1 << sym;
+					break;
+			}
+			if (!mask || len >= AST_MAX_EXTENSION) {
+				return 0;
+			}
+			masks[len++] = mask;
+		}
+	} else {
+		for (; *p; p++) {
+			if (*p == '-') {
+				continue;
+			}
+			if ((sym = lantiq_digitmap_symbol(*p)) < 0 || len >= AST_MAX_EXTENSION) {
+				return 0;
+			}
+			masks[len++] = 1 << sym;
+		}
+	}
+
+	if (!len && !tail) {
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		if ((node = lantiq_digitmap_node(map, node, masks[i], 0)) < 0) {
+			return -1;
+		}
+	}
+
+	if (tail & DIGITMAP_EARLY) {
+		/* '!' also matches zero digits */
+		map->nodes[node].flags |= DIGITMAP_TERMINAL;
+	}
+	if (tail && (node = lantiq_digitmap_node(map, node, 0xFFFF, tail)) < 0) {
+		return -1;
+	}
+	map->nodes[node].flags |= DIGITMAP_TERMINAL;
+
+	return 0;
+}
+
+/* Hints and other extensions without a priority 1 can't be dialed */
+static int lantiq_digitmap_dialable(struct ast_exten *exten)
+{
+	struct ast_exten *prio = NULL;
+
+	while ((prio = ast_walk_extension_priorities(exten, prio))) {
+		if (ast_get_extension_priority(prio) == 1) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Called with the contexts lock held. The map is a superset of the dialplan:
+ * caller ID restricted extensions and timed includes are added regardless,
+ * so a complete match is confirmed by lantiq_match_digits() before dialing.
+ */
+static void lantiq_digitmap_add_context(struct lantiq_digitmap *map, const char *name, int depth)
+{
+	struct ast_context *con = NULL;
+	struct ast_exten *exten = NULL;
+	struct ast_include *inc = NULL;
+
+	if (depth > LANTIQ_DIGITMAP_MAX_DEPTH) {
+		map->usable = 0;
+		return;
+	}
+
+	while ((con = ast_walk_contexts(con))) {
+		if (!strcasecmp(ast_get_context_name(con), name)) {
+			break;
+		}
+	}
+	if (!con) {
+		return;
+	}
+
+	ast_rdlock_context(con);
+	if (ast_walk_context_switches(con, NULL)) {
+		/* switches can match anything, only the dialplan itself knows */
+		map->usable = 0;
+	}
+	while (map->usable && (exten = ast_walk_context_extensions(con, exten))) {
+		if (!lantiq_digitmap_dialable(exten)) {
+			continue;
+		}
+		if (lantiq_digitmap_add(map, ast_get_extension_name(exten))) {
+			map->usable = 0;
+		}
+	}
+	while (map->usable && (inc = ast_walk_context_includes(con, inc))) {
+		lantiq_digitmap_add_context(map, ast_get_include_name(inc), depth + 1);
+	}
+	ast_unlock_context(con);
+}
+
+/*
+ * Runs on the port's taskprocessor when the phone goes offhook with
+ * digitmatching on. Recompiles the port's digit map if the dialplan was
+ * reloaded since, so a reload costs nothing for ports that don't dial.
+ */
+static void lantiq_digitmap_refresh(struct lantiq_pvt *pvt)
+{
+	const int version = ast_wrlock_contexts_version();
+	struct lantiq_digitmap *map = pvt->digitmap;
+
+	if (map && map->version == version) {
+		return;
+	}
+
+	if (!map && !(map = ast_calloc(1, sizeof(*map)))) {
+		return;
+	}
+
+	map->version = version;
+	map->usable = 1;
+	map->len = 1;
+	memset(&map->nodes[0], 0, sizeof(map->nodes[0]));
+
+	ast_rdlock_contexts();
+	lantiq_digitmap_add_context(map, pvt->context, 0);
+	ast_unlock_contexts();
+
+	ast_debug(1, "Digit map for context %s: %d nodes%s\n", pvt->context, map->len,
+			map->usable ? "" : ", unusable");
+	pvt->digitmap = map;
+}
+
+/* Add a node to the next active set unless already there; -1 if the set is full */
+static int lantiq_digitmap_push(int *set, int *len, int node)
+{
+	int i;
+
+	for (i = 0; i < *len; i++) {
+		if (set[i] == node) {
+			return 0;
+		}
+	}
+	if (*len == LANTIQ_DIGITMAP_MAX_ACTIVE) {
+		return -1;
+	}
+	set[(*len)++] = node;
+
+	return 0;
+}
+
+/* Walk the trie with the collected digits. Returns -1 if the dialplan must be asked instead. */
+static int lantiq_digitmap_match(const struct lantiq_digitmap *map, const char *digits)
+{
+	int active[LANTIQ_DIGITMAP_MAX_ACTIVE], next[LANTIQ_DIGITMAP_MAX_ACTIVE];
+	int nactive = 1, nnext, i, n, sym, exists = 0, more = 0;
+
+	active[0] = 0;
+	for (; *digits; digits++) {
+		if ((sym = lantiq_digitmap_symbol(*digits)) < 0) {
+			return LANTIQ_MATCH_NONE;
+		}
+
+		nnext = 0;
+		for (i = 0; i < nactive; i++) {
+			const struct lantiq_digitmap_node *node = &map->nodes[active[i]];
+
+			/* a wildcard node is its own successor */
+			if ((node->flags & DIGITMAP_LOOP) && (node->mask & (1 << sym)) &&
+					lantiq_digitmap_push(next, &nnext, active[i])) {
+				return -1;
+			}
+			for (n = node->child; n; n = map->nodes[n].sibling) {
+				if ((map->nodes[n].mask & (1 << sym)) && lantiq_digitmap_push(next, &nnext, n)) {
+					return -1;
+				}
+			}
+		}
+
+		if (!nnext) {
+			return LANTIQ_MATCH_NONE;
+		}
+		memcpy(active, next, nnext * sizeof(active[0]));
+		nactive = nnext;
+	}
+
+	for (i = 0; i < nactive; i++) {
+		const struct lantiq_digitmap_node *node = &map->nodes[active[i]];
+
+		if (node->flags & DIGITMAP_TERMINAL) {
+			exists = 1;
+		}
+		/* '!' wildcards never ask for more digits */
+		if ((node->flags & (DIGITMAP_LOOP | DIGITMAP_EARLY)) == DIGITMAP_LOOP) {
+			more = 1;
+		}
+		for (n = node->child; n && !more; n = map->nodes[n].sibling) {
+			if (!(map->nodes[n].flags & DIGITMAP_EARLY)) {
+				more = 1;
+			}
+		}
+	}
+
+	if (more) {
+		return exists ? LANTIQ_MATCH_AMBIGUOUS : LANTIQ_MATCH_PARTIAL;
+	}
+	return exists ? LANTIQ_MATCH_COMPLETE : LANTIQ_MATCH_NONE;
+}
+
+/* Runs on the port's taskprocessor, without iflock */
+static enum lantiq_match lantiq_match_digits(struct lantiq_pvt *pvt, const char *digits)
+{
+	int res;
+
+	if (pvt->digitmap && pvt->digitmap->usable &&
+			(res = lantiq_digitmap_match(pvt->digitmap, digits)) >= 0) {
+		/* the map can't tell whether the extension applies right now */
+		if ((res == LANTIQ_MATCH_COMPLETE || res == LANTIQ_MATCH_AMBIGUOUS) &&
+				!ast_exists_extension(NULL, pvt->context, digits, 1, NULL)) {
+			res = res == LANTIQ_MATCH_COMPLETE ? LANTIQ_MATCH_NONE : LANTIQ_MATCH_PARTIAL;
+		}
+		return res;
+	}
+
+	/* fall back to asking the dialplan */
+	if (!ast_canmatch_extension(NULL, pvt->context, digits, 1, NULL)) {
+		return LANTIQ_MATCH_NONE;
+	}
+
+	if (ast_matchmore_extension(NULL, pvt->context, digits, 1, NULL)) {
+		return ast_exists_extension(NULL, pvt->context, digits, 1, NULL) ?
+			LANTIQ_MATCH_AMBIGUOUS : LANTIQ_MATCH_PARTIAL;
+	}
+
+	return LANTIQ_MATCH_COMPLETE;
+}
+
+static int lantiq_dev_event_hook(int c, int state)
+{
+	const uint64_t event_time = now_us();
+
+	ast_mutex_lock(&iflock);
+
+	ast_log(LOG_DEBUG, "on port %i detected event %s hook\n", c, state ? "on" : "off");
+
+	int ret = -1;
+	if (state) { /* going onhook */
+		lantiq_stats_stop(&iflist[c]);
+		lantiq_hotline_stop(&iflist[c]);
+		/* whatever is still queued for the last call is void now */
+		iflist[c].call_gen++;
+
+		switch (iflist[c].channel_state) {
+			case DIALING: 
+				ret = lantiq_end_dialing(c);
+				break;
+			case INCALL: 
+				ret = lantiq_end_call(c);
+				break;
+		}
+
+		lantiq_state_set(&iflist[c], ONHOOK);
+
+		/* stop DSP data feed */
+		lantiq_standby(c);
+		led_off(dev_ctx.ch_led[c]);
+		lantiq_line_pending(&iflist[c]);
+
+		if (iflist[c].waiting) {
+			lantiq_cw_recall(&iflist[c]);
+		}
+
+	} else { /* going offhook */
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_ACTIVE)) {
+			ast_log(LOG_ERROR, "IFX_TAPI_LINE_FEED_SET ioctl failed\n");
+			goto out;
+		}
+
+		switch (iflist[c].channel_state) {
+			case RINGING: 
+				ret = accept_call(c);
+				led_blink(dev_ctx.ch_led[c], LED_SLOW_BLINK);
+				break;
+			default:
+				lantiq_state_set(&iflist[c], OFFHOOK);
+				led_on(dev_ctx.ch_led[c]);
+				if (lantiq_hotline_start(&iflist[c])) {
+					ret = 0;
+					break;
+				}
+				lantiq_play_tone(c, dev_ctx.tones[LANTIQ_TONE_DIAL]);
+				lantiq_kpi_add(c, LANTIQ_KPI_DIALTONE, event_time);
+				if (dev_ctx.digit_matching) {
+					lantiq_task_push(&iflist[c], LANTIQ_TASK_PREPARE, NULL, NULL);
+				}
+				ret = 0;
+
+				if (dev_ctx.overlap_dial == LANTIQ_OVERLAP_OFFHOOK && lantiq_start_overlap(&iflist[c])) {
+					lantiq_play_tone(c, dev_ctx.tones[LANTIQ_TONE_CONGESTION]);
+					lantiq_state_set(&iflist[c], CALL_ENDED);
+				}
+				break;
+		}
+
+	}
+
+out:
+	ast_mutex_unlock(&iflock);
+
+	return ret;
+}
+
+static void lantiq_reset_dtmfbuf(struct lantiq_pvt *pvt)
+{
+	pvt->dtmfbuf[0] = '\0';
+	pvt->dtmfbuf_len = 0;
+}
+
+/* Called with iflock held. (Re)arms the autodial timer. */
+static void lantiq_dial_timer_set(struct lantiq_pvt *pvt, int timeout)
+{
+	ast_log(LOG_DEBUG, "%s timer\n", lantiq_timer_pending(&pvt->dial_timer) ? "replacing" : "setting new");
+	lantiq_timer_start(&pvt->dial_timer, pvt, timeout, lantiq_event_dial_timeout);
+}
+
+/* Called with iflock held */
+static void lantiq_dial_timer_stop(struct lantiq_pvt *pvt)
+{
+	lantiq_timer_stop(&pvt->dial_timer);
+}
+
+/* Called with iflock held. Ends a call attempt which never got a channel. */
+static void lantiq_call_failed(struct lantiq_pvt *pvt, unsigned int gen)
+{
+	if (gen == pvt->call_gen && pvt->channel_state == INCALL && !pvt->owner) {
+		lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_CONGESTION]);
+		lantiq_state_set(pvt, CALL_ENDED);
+	}
+}
+
+/*
+ * Runs on the port's taskprocessor, without iflock. Creates the port's
+ * channel and starts the PBX on exten. The port was put into INCALL when the
+ * task was queued; gen tells whether the user hung up in the meantime.
+ */
+static int lantiq_start_pbx(struct lantiq_pvt *pvt, const char *exten, unsigned int gen)
+{
+	struct ast_channel *chan;
+	int i;
+
+	chan = lantiq_channel_alloc(AST_STATE_UP, pvt->port_id, exten, pvt->context);
+	if (!chan) {
+		ast_log(LOG_ERROR, "couldn't create channel\n");
+		ast_mutex_lock(&iflock);
+		lantiq_call_failed(pvt, gen);
+		ast_mutex_unlock(&iflock);
+		return -1;
+	}
+
+	ast_mutex_lock(&iflock);
+	if (gen != pvt->call_gen || pvt->channel_state != INCALL || pvt->owner) {
+		ast_mutex_unlock(&iflock);
+		ast_debug(1, "call on port %i abandoned during setup\n", pvt->port_id + 1);
+		ast_channel_release(chan);
+		return -1;
+	}
+	chan->tech_pvt = pvt;
+	pvt->owner = chan;
+	lantiq_stats_reset(pvt->port_id);
+
+	pvt->call_setup_start = now();
+	pvt->call_start = epoch();
+	lantiq_stats_start(pvt);
+
+	/* digits dialed while the call was being set up; they wait in the read queue */
+	for (i = 0; i < pvt->dtmfbuf_len; i++) {
+		lantiq_send_digit(pvt->port_id, pvt->dtmfbuf[i]);
+	}
+	if (!pvt->overlap) {
+		lantiq_reset_dtmfbuf(pvt);
+	}
+	ast_mutex_unlock(&iflock);
+
+	ast_setstate(chan, AST_STATE_RING);
+
+	if (ast_pbx_start(chan)) {
+		ast_log(LOG_WARNING, " unable to start PBX on %s\n", chan->name);
+		ast_hangup(chan);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Runs on the port's taskprocessor. Dials the collected digits if they exist. */
+static void lantiq_task_dial(struct lantiq_task *task)
+{
+	struct lantiq_pvt *pvt = task->pvt;
+	enum lantiq_match match;
+
+	match = lantiq_match_digits(pvt, task->exten);
+	if (match == LANTIQ_MATCH_AMBIGUOUS || match == LANTIQ_MATCH_COMPLETE) {
+		ast_debug(1, "found extension %s, dialing\n", task->exten);
+
+		ast_verbose(VERBOSE_PREFIX_3 " extension exists, starting PBX %s\n", task->exten);
+
+		if (!lantiq_start_pbx(pvt, task->exten, task->gen)) {
+			lantiq_kpi_add(pvt->port_id, LANTIQ_KPI_POSTDIAL, pvt->kpi_last_digit);
+		}
+	} else {
+		ast_log(LOG_DEBUG, "no extension found\n");
+		ast_mutex_lock(&iflock);
+		lantiq_call_failed(pvt, task->gen);
+		ast_mutex_unlock(&iflock);
+	}
+}
+
+/* Runs on the port's taskprocessor. Decides whether to wait for more digits. */
+static void lantiq_task_digits(struct lantiq_task *task)
+{
+	struct lantiq_pvt *pvt = task->pvt;
+	enum lantiq_match match;
+	int timeout = dev_ctx.interdigit_timeout;
+
+	match = lantiq_match_digits(pvt, task->exten);
+
+	ast_mutex_lock(&iflock);
+	if (task->gen != pvt->call_gen || pvt->channel_state != DIALING || strcmp(pvt->dtmfbuf, task->exten)) {
+		/* superseded by another digit, '#' or onhook */
+		ast_mutex_unlock(&iflock);
+		return;
+	}
+
+	switch (match) {
+		case LANTIQ_MATCH_NONE:
+		case LANTIQ_MATCH_COMPLETE:
+			/* nothing to wait for, dial (or fail) right away */
+			ast_debug(1, "digits %s need no further input\n", task->exten);
+			lantiq_dial_timer_stop(pvt);
+			lantiq_reset_dtmfbuf(pvt);
+			if (match == LANTIQ_MATCH_NONE) {
+				ast_log(LOG_DEBUG, "no extension found\n");
+				lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_INFO]);
+				lantiq_state_set(pvt, CALL_ENDED);
+				ast_mutex_unlock(&iflock);
+				return;
+			}
+			lantiq_state_set(pvt, INCALL);
+			ast_mutex_unlock(&iflock);
+
+			ast_verbose(VERBOSE_PREFIX_3 " extension exists, starting PBX %s\n", task->exten);
+			if (!lantiq_start_pbx(pvt, task->exten, task->gen)) {
+				lantiq_kpi_add(pvt->port_id, LANTIQ_KPI_POSTDIAL, pvt->kpi_last_digit);
+			}
+			return;
+		case LANTIQ_MATCH_PARTIAL:
+			timeout = dev_ctx.interdigit_long_timeout;
+			break;
+		case LANTIQ_MATCH_AMBIGUOUS:
+			break;
+	}
+
+	lantiq_dial_timer_set(pvt, timeout);
+	ast_mutex_unlock(&iflock);
+}
+
+static void lantiq_task_setup(struct lantiq_pvt *pvt)
+{
+	int res = lantiq_port_setup(pvt->port_id);
+
+	if (res) {
+		ast_log(LOG_ERROR, "setup of port %i failed\n", pvt->port_id + 1);
+	}
+
+	ast_mutex_lock(&port_setup.lock);
+	if (res) {
+		port_setup.failed++;
+	}
+	port_setup.pending--;
+	ast_cond_signal(&port_setup.cond);
+	ast_mutex_unlock(&port_setup.lock);
+}
+
+/*
+ * Runs on the port's taskprocessor. Sets LANTIQ_FAXTONE and, like chan_dahdi's
+ * faxdetect, sends the channel to the 'fax' extension if its context has one.
+ */
+static void lantiq_task_fax(struct lantiq_task *task)
+{
+	struct ast_channel *chan = task->chan;
+	const char *context, *exten, *cid;
+
+	ast_mutex_lock(&iflock);
+	if (task->gen != task->pvt->call_gen || task->pvt->owner != chan) {
+		ast_mutex_unlock(&iflock);
+		return;
+	}
+	ast_mutex_unlock(&iflock);
+
+	pbx_builtin_setvar_helper(chan, "LANTIQ_FAXTONE", task->exten);
+
+	ast_channel_lock(chan);
+	context = ast_strdupa(S_OR(chan->macrocontext, chan->context));
+	exten = ast_strdupa(chan->exten);
+	cid = ast_strdupa(S_COR(chan->caller.id.number.valid, chan->caller.id.number.str, ""));
+	ast_channel_unlock(chan);
+
+	if (!strcmp(exten, "fax")) {
+		return;
+	}
+
+	if (!ast_exists_extension(chan, context, "fax", 1, cid)) {
+		ast_debug(1, "no fax extension in %s, %s stays in %s\n", context, chan->name, exten);
+		return;
+	}
+
+	ast_verb(3, "Redirecting %s to fax extension\n", chan->name);
+	pbx_builtin_setvar_helper(chan, "FAXEXTEN", exten);
+	if (ast_async_goto(chan, context, "fax", 1)) {
+		ast_log(LOG_WARNING, "Failed to async goto '%s' into fax of '%s'\n", chan->name, context);
+	}
+}
+
+static int lantiq_task_exec(void *data)
+{
+	struct lantiq_task *task = data;
+
+	switch (task->type) {
+		case LANTIQ_TASK_PREPARE:
+			lantiq_digitmap_refresh(task->pvt);
+			break;
+		case LANTIQ_TASK_DIGITS:
+			lantiq_task_digits(task);
+			break;
+		case LANTIQ_TASK_DIAL:
+			lantiq_task_dial(task);
+			break;
+		case LANTIQ_TASK_START:
+			lantiq_start_pbx(task->pvt, task->exten, task->gen);
+			break;
+		case LANTIQ_TASK_HANGUP:
+			ast_queue_hangup(task->chan);
+			ast_channel_unref(task->chan);
+			break;
+		case LANTIQ_TASK_SETUP:
+			lantiq_task_setup(task->pvt);
+			break;
+		case LANTIQ_TASK_FAX:
+			lantiq_task_fax(task);
+			ast_channel_unref(task->chan);
+			break;
+		case LANTIQ_TASK_TRACE:
+			lantiq_trace_dump(task->pvt->port_id, task->exten);
+			break;
+	}
+
+	ast_free(task);
+	return 0;
+}
+
+/* Called with iflock held */
+static int lantiq_task_push(struct lantiq_pvt *pvt, enum lantiq_task_type type, const char *exten, struct ast_channel *chan)
+{
+	struct lantiq_task *task;
+
+	if (!pvt->tps || !(task = ast_calloc(1, sizeof(*task)))) {
+		return -1;
+	}
+
+	task->type = type;
+	task->pvt = pvt;
+	task->gen = pvt->call_gen;
+	task->chan = chan;
+	if (exten) {
+		ast_copy_string(task->exten, exten, sizeof(task->exten));
+	}
+
+	if (ast_taskprocessor_push(pvt->tps, lantiq_task_exec, task)) {
+		ast_free(task);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Called with iflock held. Puts the port into INCALL and lets the taskprocessor place the call. */
+static int lantiq_dispatch_call(struct lantiq_pvt *pvt, enum lantiq_task_type type, const char *exten)
+{
+	lantiq_state_set(pvt, INCALL);
+
+	if (lantiq_task_push(pvt, type, exten, NULL)) {
+		ast_log(LOG_ERROR, "unable to queue call on port %i\n", pvt->port_id + 1);
+		lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_CONGESTION]);
+		lantiq_state_set(pvt, CALL_ENDED);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Called with iflock held. Hangs up the port's channel from the taskprocessor. */
+static void lantiq_teardown(struct lantiq_pvt *pvt)
+{
+	struct ast_channel *chan;
+
+	if (!pvt->owner) {
+		return;
+	}
+
+	chan = ast_channel_ref(pvt->owner);
+	if (lantiq_task_push(pvt, LANTIQ_TASK_HANGUP, NULL, chan)) {
+		ast_queue_hangup(chan);
+		ast_channel_unref(chan);
+	}
+}
+
+/* Called with iflock held. Starts an overlap call on 's'; the dialed digits follow as DTMF. */
+static int lantiq_start_overlap(struct lantiq_pvt *pvt)
+{
+	ast_verbose(VERBOSE_PREFIX_3 " overlap dialing, starting PBX on port %i\n", pvt->port_id + 1);
+
+	lantiq_reset_dtmfbuf(pvt);
+	pvt->overlap = 1;
+
+	return lantiq_dispatch_call(pvt, LANTIQ_TASK_START, "s");
+}
+
+/* Called with iflock held */
+static void lantiq_event_hotline_timeout(struct lantiq_pvt *pvt)
+{
+	if (pvt->channel_state == OFFHOOK) {
+		ast_debug(1, "no digit dialed on port %i, calling hotline %s\n", pvt->port_id + 1, pvt->hotline);
+		lantiq_play_tone(pvt->port_id, TAPI_TONE_LOCALE_NONE);
+		lantiq_dispatch_call(pvt, LANTIQ_TASK_START, pvt->hotline);
+	}
+}
+
+/*
+ * Called with iflock held at offhook. Returns 1 if the hotline took over the
+ * port (immediately or after the warm line delay), 0 for normal dialing.
+ */
+static int lantiq_hotline_start(struct lantiq_pvt *pvt)
+{
+	if (!pvt->hotline[0]) {
+		return 0;
+	}
+
+	if (!pvt->hotline_delay) {
+		/* immediate: no dial tone, no digit collection */
+		ast_verbose(VERBOSE_PREFIX_3 " hotline on port %i, starting PBX %s\n", pvt->port_id + 1, pvt->hotline);
+		lantiq_dispatch_call(pvt, LANTIQ_TASK_START, pvt->hotline);
+		return 1;
+	}
+
+	/* warm line: dial normally, the hotline is called if no digit comes in time */
+	lantiq_timer_start(&pvt->hotline_timer, pvt, pvt->hotline_delay, lantiq_event_hotline_timeout);
+
+	return 0;
+}
+
+/* Called with iflock held */
+static void lantiq_hotline_stop(struct lantiq_pvt *pvt)
+{
+	lantiq_timer_stop(&pvt->hotline_timer);
+}
+
+/* Called with iflock held. Ends digit collection and dials the digits from the taskprocessor. */
+static void lantiq_dial(struct lantiq_pvt *pvt)
+{
+	ast_log(LOG_DEBUG, "user want's to dial %s.\n", pvt->dtmfbuf);
+
+	lantiq_dial_timer_stop(pvt);
+	lantiq_dispatch_call(pvt, LANTIQ_TASK_DIAL, pvt->dtmfbuf);
+	lantiq_reset_dtmfbuf(pvt);
+}
+
+/* Called with iflock held */
+static void lantiq_event_dial_timeout(struct lantiq_pvt *pvt)
+{
+	ast_debug(1, "TAPI: lantiq_event_dial_timeout()\n");
+
+	if (pvt->channel_state == DIALING) {
+		lantiq_kpi_add(pvt->port_id, LANTIQ_KPI_INTERDIGIT, pvt->kpi_last_digit);
+		lantiq_dial(pvt);
+	} else {
+		ast_debug(1, "TAPI: lantiq_event_dial_timeout(): dial timeout in state %s.\n", state_string(pvt->channel_state));
+	}
+}
+
+/* Called with iflock held */
+static int lantiq_send_digit(int c, char digit)
+{
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	struct ast_frame f = { .frametype = AST_FRAME_DTMF, .subclass.integer = digit };
+
+	if (pvt->owner) {
+		ast_log(LOG_DEBUG, "Port %i transmitting digit \"%c\"\n", c, digit);
+		return ast_queue_frame(pvt->owner, &f);
+	} else {
+		ast_debug(1, "Warning: lantiq_send_digit() without owner!\n");
+		return -1;
+	}
+}
+
+static void lantiq_dev_event_digit(int c, char digit)
+{
+	const uint64_t event_time = now_us();
+
+	ast_mutex_lock(&iflock);
+
+	ast_log(LOG_DEBUG, "on port %i detected digit \"%c\"\n", c, digit);
+
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	switch (pvt->channel_state) {
+		case INCALL:
+			if (pvt->overlap && !pvt->dtmfbuf_len) {
+				/* first digit of an offhook overlap call, dial tone is still on */
+				lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
+			}
+			if (pvt->overlap || !pvt->owner) {
+				/* keep the number; without a channel yet it is sent once there is one */
+				if (pvt->dtmfbuf_len < AST_MAX_EXTENSION - 1) {
+					pvt->dtmfbuf[pvt->dtmfbuf_len] = digit;
+					pvt->dtmfbuf[++pvt->dtmfbuf_len] = '\0';
+				}
+				pvt->kpi_last_digit = event_time;
+			}
+			if (pvt->owner) {
+				lantiq_send_digit(c, digit);
+			}
+			break;
+		case OFFHOOK:
+			lantiq_state_set(pvt, DIALING);
+			lantiq_hotline_stop(pvt);
+
+			lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
+			led_blink(dev_ctx.ch_led[c], LED_SLOW_BLINK);
+
+			if (dev_ctx.overlap_dial == LANTIQ_OVERLAP_FIRSTDIGIT) {
+				pvt->kpi_last_digit = event_time;
+				if (!lantiq_start_overlap(pvt)) {
+					pvt->dtmfbuf[0] = digit;
+					pvt->dtmfbuf[1] = '\0';
+					pvt->dtmfbuf_len = 1;
+				}
+				break;
+			}
+
+			/* fall through */
+		case DIALING:
+			pvt->kpi_last_digit = event_time;
+
+			if (digit == '#') {
+				lantiq_dial(pvt);
+			} else {
+				if (pvt->dtmfbuf_len < AST_MAX_EXTENSION - 1) {
+					pvt->dtmfbuf[pvt->dtmfbuf_len] = digit;
+					pvt->dtmfbuf[++pvt->dtmfbuf_len] = '\0';
+				} else {
+					/* No more room for another digit */
+					lantiq_end_dialing(c);
+					lantiq_play_tone(pvt->port_id, dev_ctx.tones[LANTIQ_TONE_INFO]);
+					lantiq_state_set(pvt, CALL_ENDED);
+					break;
+				}
+
+				/* the dialplan lookup runs on the port's taskprocessor */
+				if (!dev_ctx.digit_matching || lantiq_task_push(pvt, LANTIQ_TASK_DIGITS, pvt->dtmfbuf, NULL)) {
+					/* setup autodial timer */
+					lantiq_dial_timer_set(pvt, dev_ctx.interdigit_timeout);
+				}
+			}
+			break;
+		default:
+			ast_log(LOG_ERROR, "don't know what to do in unhandled state\n");
+			break;
+	}
+
+	ast_mutex_unlock(&iflock);
+	return;
+}
+
+/*
+ * Hook flash switches between the active and the waiting or held call. There
+ * is one coder per port, so it is reconfigured for the call taking over while
+ * the other one is put on hold.
+ */
+static void lantiq_dev_event_flash(int c)
+{
+	struct lantiq_pvt *pvt = &iflist[c];
+	struct ast_channel *held;
+	format_t codec;
+
+	ast_mutex_lock(&iflock);
+
+	if (!pvt->waiting || (pvt->channel_state != INCALL && pvt->channel_state != CALL_ENDED)) {
+		ast_debug(1, "hook flash on port %i ignored\n", c + 1);
+		ast_mutex_unlock(&iflock);
+		return;
+	}
+
+	/* NULL if the active call already hung up */
+	held = pvt->owner;
+	lantiq_timer_stop(&pvt->cw_timer);
+	lantiq_play_tone(c, TAPI_TONE_LOCALE_NONE);
+
+	pvt->owner = pvt->waiting;
+	pvt->waiting = held;
+
+	codec = pvt->codec;
+	/* the coder carries the other call from now on */
+	lantiq_stats_reset(c);
+	if (lantiq_conf_enc(c, pvt->waiting_format)) {
+		ast_log(LOG_WARNING, "unable to switch the coder of port %i to %s\n", c + 1, ast_getformatname(pvt->waiting_format));
+	}
+	pvt->waiting_format = codec;
+
+	if (held) {
+		ast_queue_control(held, AST_CONTROL_HOLD);
+	}
+	if (pvt->owner->_state == AST_STATE_RINGING) {
+		ast_queue_control(pvt->owner, AST_CONTROL_ANSWER);
+		pvt->call_answer = epoch();
+		lantiq_kpi_answer(pvt);
+	} else {
+		ast_queue_control(pvt->owner, AST_CONTROL_UNHOLD);
+	}
+	lantiq_state_set(pvt, INCALL);
+
+	ast_mutex_unlock(&iflock);
+}
+
+static const char *lantiq_fax_tone(int id)
+{
+	switch (id) {
+		case IFX_TAPI_EVENT_FAXMODEM_CED:
+			return "CED";
+		case IFX_TAPI_EVENT_FAXMODEM_DIS:
+			return "DIS";
+		case IFX_TAPI_EVENT_FAXMODEM_CNGFAX:
+			return "CNG";
+		case IFX_TAPI_EVENT_FAXMODEM_CNGMOD:
+			return "CNGMOD";
+		case IFX_TAPI_EVENT_FAXMODEM_AM:
+			return "ANSAM";
+		case IFX_TAPI_EVENT_FAXMODEM_V21H:
+			return "V21";
+		default:
+			return "unknown";
+	}
+}
+
+/*
+ * A fax or modem tone was detected: switches the call to voiceband data and
+ * lets the taskprocessor send the channel to the fax extension.
+ */
+static void lantiq_dev_event_fax(int c, int id)
+{
+	struct lantiq_pvt *pvt = &iflist[c];
+	const char *tone = lantiq_fax_tone(id);
+	struct lantiq_line_cfg data;
+	struct ast_channel *chan;
+	int profile;
+
+	ast_mutex_lock(&iflock);
+
+	if (!pvt->fax_detect || pvt->fax_mode || !pvt->owner) {
+		ast_debug(1, "port %i: ignoring %s tone\n", c + 1, tone);
+		ast_mutex_unlock(&iflock);
+		return;
+	}
+	pvt->fax_mode = 1;
+	ast_verb(3, "%s tone on port %i, switching %s to voiceband data\n", tone, c + 1, pvt->owner->name);
+
+	/* [profile-fax], or the port's settings without EC, NLP and VAD and with a fixed data JB */
+	if ((profile = lantiq_profile_find(LANTIQ_FAX_PROFILE)) >= 0) {
+		data = lantiq_profiles[profile].line;
+	} else {
+		data = pvt->line;
+		data.wlec_type = IFX_TAPI_WLEC_TYPE_OFF;
+		data.wlec_nlp = IFX_TAPI_WLEC_NLP_OFF;
+		data.jb_type = IFX_TAPI_JB_TYPE_FIXED;
+		data.jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_DATA;
+		data.vad_type = IFX_TAPI_ENC_VAD_NOVAD;
+	}
+	if (lantiq_line_set(pvt, &data)) {
+		ast_log(LOG_WARNING, "port %i didn't fully switch to voiceband data\n", c + 1);
+	}
+
+	if (!(pvt->codec & (AST_FORMAT_ULAW | AST_FORMAT_ALAW))) {
+		ast_log(LOG_NOTICE, "%s carries voiceband data over %s, fax and modems need G.711\n",
+			pvt->owner->name, ast_getformatname(pvt->codec));
+	}
+
+	/* the dialplan part locks the channel, which the monitor thread mustn't */
+	chan = ast_channel_ref(pvt->owner);
+	if (lantiq_task_push(pvt, LANTIQ_TASK_FAX, tone, chan)) {
+		ast_channel_unref(chan);
+	}
+
+	ast_mutex_unlock(&iflock);
+}
+
+/* Monitor thread only. Counts and traces an event, returns how often its ID was seen. */
+static int lantiq_event_record(int c, const IFX_TAPI_EVENT_t *event, const char *action)
+{
+	struct lantiq_event_trace *t = &event_trace[event_trace_head & (LANTIQ_EVENT_TRACE - 1)];
+	int i, count = 0;
+
+	t->tv = ast_tvnow();
+	t->port = c;
+	t->id = event->id;
+	t->data = event->data.value;
+	t->action = action;
+	ast_atomic_fetchadd_int(&event_trace_head, 1);
+
+	for (i = 0; i < LANTIQ_EVENT_IDS; i++) {
+		if (!event_counts[i].id) {
+			event_counts[i].id = event->id;
+		}
+		if (event_counts[i].id == event->id) {
+			count = ast_atomic_fetchadd_int(&event_counts[i].count, 1) + 1;
+			break;
+		}
+	}
+	if (i == LANTIQ_EVENT_IDS) {
+		ast_atomic_fetchadd_int(&event_counts_lost, 1);
+	}
+
+	return count;
+}
+
+/*
+ * The SLIC shut the line down, e.g. when it overheated. Ends the port's call
+ * and keeps the port out of service until the fault clears, the other ports
+ * carry on.
+ */
+static void lantiq_port_fault(int c, int fault)
+{
+	struct lantiq_pvt *pvt = &iflist[c];
+
+	ast_mutex_lock(&iflock);
+
+	if (fault == pvt->line_fault) {
+		ast_mutex_unlock(&iflock);
+		return;
+	}
+	pvt->line_fault = fault;
+
+	if (fault) {
+		ast_log(LOG_WARNING, "line fault on port %i, taking it out of service\n", c + 1);
+		lantiq_trace(c, LANTIQ_TRACE_FAULT, pvt->channel_state, pvt->channel_state, 1);
+		lantiq_task_push(pvt, LANTIQ_TASK_TRACE, "line fault", NULL);
+		if (pvt->channel_state == RINGING) {
+			lantiq_ring(c, 0, NULL, NULL);
+			lantiq_teardown(pvt);
+			lantiq_state_set(pvt, ONHOOK);
+		} else if (pvt->channel_state != ONHOOK) {
+			lantiq_dev_event_hook(c, 1);
+		}
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_DISABLED)) {
+			ast_log(LOG_ERROR, "IFX_TAPI_LINE_FEED_SET ioctl failed\n");
+		}
+	} else {
+		ast_log(LOG_NOTICE, "line fault on port %i cleared, back in service\n", c + 1);
+		lantiq_trace(c, LANTIQ_TRACE_FAULT, pvt->channel_state, pvt->channel_state, 0);
+		lantiq_standby(c);
+	}
+
+	ast_mutex_unlock(&iflock);
+
+	ast_devstate_changed(AST_DEVICE_UNKNOWN, "TAPI/%i", c + 1);
+}
+
+/*
+ * Events outside the call flow. Line faults only cost their own port, every
+ * other event is logged and ignored.
+ */
+static void lantiq_dev_event_other(int c, const IFX_TAPI_EVENT_t *event)
+{
+	const char *name = lantiq_event_name(event->id);
+
+	switch (event->id) {
+		case IFX_TAPI_EVENT_FAULT_LINE_OVERTEMP:
+			lantiq_event_record(c, event, "out of service");
+			lantiq_port_fault(c, 1);
+			break;
+		case IFX_TAPI_EVENT_FAULT_LINE_OVERTEMP_END:
+			lantiq_event_record(c, event, "back in service");
+			lantiq_port_fault(c, 0);
+			break;
+		case IFX_TAPI_EVENT_FAULT_LINE_GK_LOW:
+		case IFX_TAPI_EVENT_FAULT_LINE_GK_HIGH:
+		case IFX_TAPI_EVENT_CID_TX_NOACK_ERR:
+		case IFX_TAPI_EVENT_CID_TX_RINGCAD_ERR:
+			lantiq_event_record(c, event, "logged");
+			ast_log(LOG_WARNING, "TAPI event %s on port %i\n", name, c + 1);
+			break;
+		case IFX_TAPI_EVENT_LT_GR909_RDY:
+			/* we start no line tests, someone else's result */
+			lantiq_event_record(c, event, "ignored");
+			ast_debug(1, "TAPI event %s on port %i\n", name, c + 1);
+			break;
+		default:
+			/* warn once per ID, 'lantiq show events' has the rest */
+			if (lantiq_event_record(c, event, "ignored") == 1) {
+				ast_log(LOG_WARNING, "Unknown TAPI event %08X (data %04X) on port %i, ignoring it\n",
+					(uint32_t) event->id, (uint32_t) event->data.value & 0xFFFF, c + 1);
+			} else {
+				ast_debug(1, "Unknown TAPI event %08X on port %i\n", (uint32_t) event->id, c + 1);
+			}
+			break;
+	}
+}
+
+static void lantiq_dev_event_handler(void)
+{
+	IFX_TAPI_EVENT_t event;
+	unsigned int i;
+
+	for (i = 0; i < dev_ctx.channels ; i++) {
+		ast_mutex_lock(&iflock);
+
+		memset (&event, 0, sizeof(event));
+		event.ch = i;
+		if (lantiq_ioctl(dev_ctx.dev_fd, IFX_TAPI_EVENT_GET, &event)) {
+			ast_mutex_unlock(&iflock);
+			continue;
+		}
+		if (event.id == IFX_TAPI_EVENT_NONE) {
+			ast_mutex_unlock(&iflock);
+			continue;
+		}
+		lantiq_trace(i, LANTIQ_TRACE_EVENT, iflist[i].channel_state, iflist[i].channel_state, event.id);
+
+		ast_mutex_unlock(&iflock);
+
+		switch(event.id) {
+			case IFX_TAPI_EVENT_FXS_ONHOOK:
+				lantiq_dev_event_hook(i, 1);
+				break;
 			case IFX_TAPI_EVENT_FXS_OFFHOOK:
 				lantiq_dev_event_hook(i, 0);
 				break;
+			case IFX_TAPI_EVENT_FXS_FLASH:
+				lantiq_dev_event_flash(i);
+				break;
 			case IFX_TAPI_EVENT_DTMF_DIGIT:
 				lantiq_dev_event_digit(i, (char)event.data.dtmf.ascii);
 				break;
@@ -1380,233 +4943,1007 @@ static void lantiq_dev_event_handler(void)
 					lantiq_dev_event_digit(i, '0' + (char)event.data.pulse.digit);
 				}
 				break;
+			case IFX_TAPI_EVENT_FAXMODEM_CED:
+			case IFX_TAPI_EVENT_FAXMODEM_DIS:
+			case IFX_TAPI_EVENT_FAXMODEM_CNGFAX:
+			case IFX_TAPI_EVENT_FAXMODEM_CNGMOD:
+			case IFX_TAPI_EVENT_FAXMODEM_AM:
+			case IFX_TAPI_EVENT_FAXMODEM_V21H:
+				lantiq_dev_event_fax(i, event.id);
+				break;
 			case IFX_TAPI_EVENT_COD_DEC_CHG:
 			case IFX_TAPI_EVENT_TONE_GEN_END:
 			case IFX_TAPI_EVENT_CID_TX_SEQ_END:
+			case IFX_TAPI_EVENT_CID_TX_INFO_START:
+			case IFX_TAPI_EVENT_CID_TX_INFO_END:
+			case IFX_TAPI_EVENT_FAXMODEM_CEDEND:
+			case IFX_TAPI_EVENT_FXS_RINGING_END:
+			case IFX_TAPI_EVENT_FXS_RING_TRIP:
 				break;
 			default:
-				ast_log(LOG_ERROR, "Unknown TAPI event %08X. Restarting Asterisk...\n", event.id);
-				sleep(1);
-				ast_cli_command(-1, "core restart now");
+				lantiq_dev_event_other(i, &event);
+				break;
+		}
+	}
+}
+
+/*
+ * Monitor thread only. The media path counts its anomalies instead of logging
+ * every packet, this logs what they added up to once per interval and port.
+ */
+static void lantiq_media_summary(void)
+{
+	const uint32_t t = now();
+	int c, i;
+
+	if ((int32_t) (t - media_summary.next) < 0) {
+		return;
+	}
+	media_summary.next = t + LANTIQ_MEDIA_LOG_INTERVAL;
+
+	for (c = 0; c < dev_ctx.channels; c++) {
+		char msg[256];
+		size_t len = 0;
+
+		msg[0] = '\0';
+		for (i = 0; i < ARRAY_LEN(media_anomalies); i++) {
+			const uint32_t cur = *(volatile int *) ((char *) &port_stats[c] + media_anomalies[i].offset);
+			volatile int *last = (volatile int *) ((char *) &media_summary.last[c] + media_anomalies[i].offset);
+			/* counters cleared by 'lantiq reset stats' start over from 0 */
+			const uint32_t delta = cur >= (uint32_t) *last ? cur - (uint32_t) *last : cur;
+
+			*last = cur;
+			if (delta && len < sizeof(msg)) {
+				len += snprintf(msg + len, sizeof(msg) - len, "%s%u %s", len ? ", " : "", delta, media_anomalies[i].name);
+			}
+		}
+		if (len) {
+			ast_log(LOG_NOTICE, "TAPI port %i media path: %s\n", c + 1, msg);
+		}
+	}
+}
+
+static void * lantiq_events_monitor(void *data)
+{
+	ast_verbose("TAPI thread started\n");
+
+	struct pollfd fds[TAPI_AUDIO_PORT_NUM_MAX + 2];
+	struct pollfd *wakeup = &fds[dev_ctx.channels + 1];
+	int c, timeout;
+	char buf[16];
+
+	fds[0].fd = dev_ctx.dev_fd;
+	fds[0].events = POLLIN;
+	for (c = 0; c < dev_ctx.channels; c++) {
+		fds[c + 1].fd = dev_ctx.ch_fd[c];
+		fds[c + 1].events = POLLIN;
+	}
+	wakeup->fd = wheel.pipe[0];
+	wakeup->events = POLLIN;
+
+	/*
+	 * The loop takes locks, allocates and logs, so unload_module() may only
+	 * cancel it while it waits in poll(), never with iflock or monlock held.
+	 */
+	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	for (;;) {
+		ast_mutex_lock(&iflock);
+		timeout = lantiq_timer_timeout();
+		ast_mutex_unlock(&iflock);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		c = poll(fds, dev_ctx.channels + 2, timeout);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		ast_mutex_lock(&iflock);
+		lantiq_timer_run();
+		ast_mutex_unlock(&iflock);
+
+		lantiq_media_summary();
+
+		if (c <= 0) {
+			continue;
+		}
+
+		if (wakeup->revents & POLLIN) {
+			/* only there to recompute the timeout */
+			while (read(wakeup->fd, buf, sizeof(buf)) > 0);
+		}
+
+		ast_mutex_lock(&monlock);
+		if (fds[0].revents & POLLIN) {
+			lantiq_dev_event_handler();
+		}
+
+		for (c = 0; c < dev_ctx.channels; c++) {
+			if ((fds[c + 1].revents & POLLIN) && (lantiq_dev_data_handler(c))) {
+				ast_log(LOG_ERROR, "data handler %d failed\n", c);
 				break;
+			}
+		}
+		ast_mutex_unlock(&monlock);
+	}
+
+	return NULL;
+}
+
+static int restart_monitor(void)
+{
+	/* If we're supposed to be stopped -- stay stopped */
+	if (monitor_thread == AST_PTHREADT_STOP)
+		return 0;
+
+	ast_mutex_lock(&monlock);
+
+	if (monitor_thread == pthread_self()) {
+		ast_mutex_unlock(&monlock);
+		ast_log(LOG_WARNING, "Cannot kill myself\n");
+		return -1;
+	}
+
+	if (monitor_thread != AST_PTHREADT_NULL) {
+		/* Wake up the thread */
+		pthread_kill(monitor_thread, SIGURG);
+	} else {
+		/* Start a new monitor */
+		if (ast_pthread_create_background(&monitor_thread, NULL, lantiq_events_monitor, NULL) < 0) {
+			ast_mutex_unlock(&monlock);
+			ast_log(LOG_ERROR, "Unable to start monitor thread.\n");
+			return -1;
+		}
+	}
+	ast_mutex_unlock(&monlock);
+
+	return 0;
+}
+
+static void lantiq_cleanup(void)
+{
+	int c;
+
+	if (dev_ctx.dev_fd < 0) {
+		return;
+	}
+
+	for (c = 0; c < dev_ctx.channels ; c++) { 
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_STANDBY)) {
+			ast_log(LOG_WARNING, "IFX_TAPI_LINE_FEED_SET ioctl failed\n");
+		}
+
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_STOP, 0)) {
+			ast_log(LOG_WARNING, "IFX_TAPI_ENC_STOP ioctl failed\n");
+		}
+
+		if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_DEC_STOP, 0)) {
+			ast_log(LOG_WARNING, "IFX_TAPI_DEC_STOP ioctl failed\n");
+		}
+		led_off(dev_ctx.ch_led[c]);
+	}
+
+	/* a running DSP is reused by the next load, see lantiq_fw_marker() */
+	if (!dev_ctx.fw_keep) {
+		lantiq_marker_remove(LANTIQ_FW_MARKER);
+		if (lantiq_ioctl(dev_ctx.dev_fd, IFX_TAPI_DEV_STOP, 0)) {
+			ast_log(LOG_WARNING, "IFX_TAPI_DEV_STOP ioctl failed\n");
+		}
+	}
+
+	close(dev_ctx.dev_fd);
+	dev_ctx.dev_fd = -1;
+	led_off(dev_ctx.voip_led);
+}
+
+static int unload_module(void)
+{
+	int c;
+
+	ast_channel_unregister(&lantiq_tech);
+
+	/* a booting DSP can't be interrupted, wait for it */
+	if (init_thread != AST_PTHREADT_NULL) {
+		pthread_join(init_thread, NULL);
+		init_thread = AST_PTHREADT_NULL;
+	}
+
+	if (ast_mutex_lock(&iflock)) {
+		ast_log(LOG_WARNING, "Unable to lock the interface list\n");
+		return -1;
+	}
+	for (c = 0; c < dev_ctx.channels ; c++) {
+		if (iflist[c].owner)
+			ast_softhangup(iflist[c].owner, AST_SOFTHANGUP_APPUNLOAD);
+		if (iflist[c].waiting)
+			ast_softhangup(iflist[c].waiting, AST_SOFTHANGUP_APPUNLOAD);
+	}
+	ast_mutex_unlock(&iflock);
+
+	if (ast_mutex_lock(&monlock)) {
+		ast_log(LOG_WARNING, "Unable to lock the monitor\n");
+		return -1;
+	}
+	if (monitor_thread && (monitor_thread != AST_PTHREADT_STOP) && (monitor_thread != AST_PTHREADT_NULL)) {
+		pthread_t th = monitor_thread;
+		monitor_thread = AST_PTHREADT_STOP;
+		pthread_cancel(th);
+		pthread_kill(th, SIGURG);
+		ast_mutex_unlock(&monlock);
+		pthread_join(th, NULL);
+	} else {
+		monitor_thread = AST_PTHREADT_STOP;
+		ast_mutex_unlock(&monlock);
+	}
+
+	ast_cli_unregister_multiple(lantiq_cli, ARRAY_LEN(lantiq_cli));
+
+	/* stops the taskprocessor threads before the timers they use go away */
+	for (c = 0; iflist && c < dev_ctx.channels; c++) {
+		if (iflist[c].tps) {
+			iflist[c].tps = ast_taskprocessor_unreference(iflist[c].tps);
+		}
+	}
+
+	for (c = 0; c < 2; c++) {
+		if (wheel.pipe[c] >= 0) {
+			close(wheel.pipe[c]);
+			wheel.pipe[c] = -1;
+		}
+	}
+	ast_mutex_destroy(&iflock);
+	ast_mutex_destroy(&monlock);
+
+	lantiq_cleanup();
+	if (iflist) {
+		for (c = 0; c < dev_ctx.channels; c++) {
+			ast_free(iflist[c].digitmap);
+		}
+	}
+	ast_free(iflist);
+	iflist = NULL;
+
+	return 0;
+}
+
+static struct lantiq_pvt *lantiq_init_pvt(struct lantiq_pvt *pvt)
+{
+	if (pvt) {
+		pvt->owner = NULL;
+		pvt->port_id = -1;
+		pvt->channel_state = UNKNOWN;
+		pvt->context[0] = '\0';
+		memset(&pvt->dial_timer, 0, sizeof(pvt->dial_timer));
+		pvt->dtmfbuf[0] = '\0';
+		pvt->dtmfbuf_len = 0;
+		pvt->overlap = 0;
+		pvt->tps = NULL;
+		pvt->call_waiting = 0;
+		pvt->waiting = NULL;
+		pvt->waiting_format = 0;
+		memset(&pvt->cw_timer, 0, sizeof(pvt->cw_timer));
+		pvt->cw_cid_sent = 0;
+		pvt->cadence = 0;
+		pvt->ring_cadence = -1;
+		pvt->cid_std = IFX_TAPI_CID_STD_TELCORDIA;
+		pvt->cid_alert = IFX_TAPI_CID_ALERT_ETSI_FR;
+		pvt->bbd_filename[0] = '\0';
+		pvt->call_gen = 0;
+		pvt->line_pending = 0;
+		pvt->profile = 0;
+		memset(&pvt->line, 0, sizeof(pvt->line));
+		pvt->fax_detect = 0;
+		pvt->fax_armed = 0;
+		pvt->fax_mode = 0;
+		pvt->line_fault = 0;
+		pvt->hotline[0] = '\0';
+		pvt->hotline_delay = 0;
+		memset(&pvt->hotline_timer, 0, sizeof(pvt->hotline_timer));
+		pvt->call_setup_start = 0;
+		pvt->call_setup_delay = 0;
+		pvt->call_answer = 0;
+		pvt->kpi_last_digit = 0;
+		pvt->kpi_answer = 0;
+		pvt->kpi_uplink_pending = 0;
+		pvt->kpi_downlink_pending = 0;
+		pvt->jb_size = 0;
+		pvt->jb_underflow = 0;
+		pvt->jb_overflow = 0;
+		pvt->jb_delay = 0;
+		pvt->jb_invalid = 0;
+		pvt->jb_packets = 0;
+		pvt->jb_late = 0;
+		pvt->jb_early = 0;
+		pvt->rtcp_lost = 0;
+		pvt->rtcp_jitter = 0;
+		pvt->rtcp_fraction = 0;
+		pvt->stats_valid = 0;
+		memset(&pvt->stats_timer, 0, sizeof(pvt->stats_timer));
+		memset(&pvt->media_timer, 0, sizeof(pvt->media_timer));
+		pvt->media_rx = 0;
+		pvt->media_tx = 0;
+		pvt->read_fails = 0;
+		pvt->media_recoveries = 0;
+		pvt->stats_start = 0;
+		pvt->jb_sample_head = 0;
+		pvt->jb_sample_count = 0;
+		pvt->digitmap = NULL;
+	} else {
+		ast_log(LOG_ERROR, "unable to clear pvt structure\n");
+	}
+
+	return pvt;
+}
+
+static int lantiq_create_pvts(void)
+{
+	int i;
+
+	iflist = ast_calloc(1, sizeof(struct lantiq_pvt) * dev_ctx.channels);
+
+	if (!iflist) {
+		ast_log(LOG_ERROR, "unable to allocate memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < dev_ctx.channels; i++) {
+		char tps_name[32];
+
+		lantiq_init_pvt(&iflist[i]);
+		iflist[i].port_id = i;
+
+		snprintf(tps_name, sizeof(tps_name), "lantiq/port%i", i + 1);
+		if (!(iflist[i].tps = ast_taskprocessor_get(tps_name, TPS_REF_DEFAULT))) {
+			ast_log(LOG_ERROR, "unable to create taskprocessor %s\n", tps_name);
+			while (i--) {
+				ast_taskprocessor_unreference(iflist[i].tps);
+			}
+			ast_free(iflist);
+			iflist = NULL;
+			return -1;
+		}
+		if (per_channel_context) {
+			snprintf(iflist[i].context, AST_MAX_CONTEXT, "%s%i", LANTIQ_CONTEXT_PREFIX, i + 1);
+			ast_debug(1, "Context for channel %i: %s\n", i, iflist[i].context);
+		} else {
+			snprintf(iflist[i].context, AST_MAX_CONTEXT, "default");
 		}
 	}
+	return 0;
 }
 
-static void * lantiq_events_monitor(void *data)
+static int lantiq_setup_rtp(int c)
 {
-	ast_verbose("TAPI thread started\n");
+	/* Configure RTP payload type tables */
+	IFX_TAPI_PKT_RTP_PT_CFG_t rtpPTConf;
 
-	struct pollfd fds[TAPI_AUDIO_PORT_NUM_MAX + 1];
-	int c;
+	memset((char*)&rtpPTConf, '\0', sizeof(rtpPTConf));
 
-	fds[0].fd = dev_ctx.dev_fd;
-	fds[0].events = POLLIN;
-	for (c = 0; c < dev_ctx.channels; c++) {
-		fds[c + 1].fd = dev_ctx.ch_fd[c];
-		fds[c + 1].events = POLLIN;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G723_63] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G723_63] = RTP_G723_63;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G723_53] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G723_53] = RTP_G723_53;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G729] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G729] = RTP_G729;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_MLAW] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_MLAW] = RTP_PCMU;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_ALAW] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_ALAW] = RTP_PCMA;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G726_32] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G726_32] = RTP_G726;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_ILBC_152] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_ILBC_152] = RTP_ILBC;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_LIN16_8] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_LIN16_8] = RTP_SLIN8;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_LIN16_16] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_LIN16_16] = RTP_SLIN16;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G722_64] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G722_64] = RTP_G722;
+	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G7221_32] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G7221_32] = RTP_G7221;
+
+	int ret;
+	if ((ret = lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_PKT_RTP_PT_CFG_SET, (IFX_int32_t) &rtpPTConf))) {
+		ast_log(LOG_ERROR, "IFX_TAPI_PKT_RTP_PT_CFG_SET failed: ret=%i\n", ret);
+		return -1;
 	}
 
-	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	for (;;) {
-		if (poll(fds, dev_ctx.channels + 1, 2000) <= 0) {
-			continue;
-		}
+	return 0;
+}
 
-		ast_mutex_lock(&monlock);
-		if (fds[0].revents & POLLIN) {
-			lantiq_dev_event_handler();
+/* Sets up a port's TAPI channel. Runs on the port's taskprocessor, see lantiq_dev_init(). */
+static int lantiq_port_setup(int c)
+{
+	IFX_TAPI_MAP_DATA_t map_data;
+	IFX_TAPI_LINE_TYPE_CFG_t line_type;
+	IFX_TAPI_RING_CFG_t ringingType;
+	struct lantiq_line_cfg line;
+	enum channel_state state;
+	int res;
+
+	/* We're a FXS and want to switch between narrow & wide band automatically */
+	memset(&line_type, 0, sizeof(IFX_TAPI_LINE_TYPE_CFG_t));
+	line_type.lineType = IFX_TAPI_LINE_TYPE_FXS_AUTO;
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_TYPE_SET, &line_type)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_LINE_TYPE_SET %d failed\n", c);
+		return -1;
+	}
+
+	/* ringing type */
+	memset(&ringingType, 0, sizeof(IFX_TAPI_RING_CFG_t));
+	ringingType.nMode = IFX_TAPI_RING_CFG_MODE_INTERNAL_BALANCED;
+	ringingType.nSubmode = IFX_TAPI_RING_CFG_SUBMODE_DC_RNG_TRIP_FAST;
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_RING_CFG_SET, (IFX_int32_t) &ringingType)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_RING_CFG_SET failed\n");
+		return -1;
+	}
+
+	/* ring cadence, changed per call only if it differs */
+	ast_mutex_lock(&iflock);
+	res = lantiq_cadence_set(&iflist[c], iflist[c].cadence);
+	ast_mutex_unlock(&iflock);
+	if (res) {
+		return -1;
+	}
+
+	/* perform mapping, a kept DSP still has the one of the last load */
+	memset(&map_data, 0x0, sizeof(IFX_TAPI_MAP_DATA_t));
+	map_data.nDstCh = c;
+	map_data.nChType = IFX_TAPI_MAP_TYPE_PHONE;
+
+	if (dev_ctx.fw_kept && lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_MAP_DATA_REMOVE, &map_data)) {
+		ast_debug(1, "IFX_TAPI_MAP_DATA_REMOVE %d failed, port wasn't mapped\n", c);
+	}
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_MAP_DATA_ADD, &map_data)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_MAP_DATA_ADD %d failed\n", c);
+		return -1;
+	}
+
+	/* set line feed */
+	if (lantiq_ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_STANDBY)) {
+		ast_log(LOG_ERROR, "IFX_TAPI_LINE_FEED_SET %d failed\n", c);
+		return -1;
+	}
+
+	/* gains, LEC, JB, CID and VAD of the port's profile */
+	line = lantiq_profiles[iflist[c].profile].line;
+	if (lantiq_line_apply(c, &line, LANTIQ_LINE_ALL)) {
+		return -1;
+	}
+
+	/* Setup TAPI <-> internal RTP codec type mapping */
+	if (lantiq_setup_rtp(c)) {
+		return -1;
+	}
+
+	/* Set initial hook status */
+	if ((state = lantiq_get_hookstatus(c)) == UNKNOWN) {
+		return -1;
+	}
+	ast_mutex_lock(&iflock);
+	lantiq_state_set(&iflist[c], state);
+	iflist[c].line = line;
+	ast_mutex_unlock(&iflock);
+
+	return 0;
+}
+
+/*
+ * Opens the device, downloads firmware and BBD and starts TAPI, then sets up
+ * the ports. The driver locks each channel on its own, so the ports are set up
+ * in parallel on their taskprocessors.
+ */
+static int lantiq_dev_init(void)
+{
+	IFX_TAPI_DEV_START_CFG_t dev_start;
+	int c, fw_loaded, res;
+
+	/* open device */
+	dev_ctx.dev_fd = lantiq_dev_open(base_path, 0);
+
+	if (dev_ctx.dev_fd < 0) {
+		ast_log(LOG_ERROR, "lantiq TAPI device open function failed\n");
+		return -1;
+	}
+
+	snprintf(dev_ctx.voip_led, LED_NAME_LENGTH, "voice");
+	for (c = 0; c < dev_ctx.channels ; c++) {
+		dev_ctx.ch_fd[c] = lantiq_dev_open(base_path, c + 1);
+
+		if (dev_ctx.ch_fd[c] < 0) {
+			ast_log(LOG_ERROR, "lantiq TAPI channel %d open function failed\n", c);
+			return -1;
 		}
+		snprintf(dev_ctx.ch_led[c], LED_NAME_LENGTH, "fxs%d", c + 1);
+	}
 
-		for (c = 0; c < dev_ctx.channels; c++) {
-			if ((fds[c + 1].revents & POLLIN) && (lantiq_dev_data_handler(c))) {
-				ast_log(LOG_ERROR, "data handler %d failed\n", c);
-				break;
+	switch ((fw_loaded = lantiq_dev_firmware_download(dev_ctx.dev_fd, firmware_filename))) {
+		case -1:
+			ast_log(LOG_ERROR, "voice firmware download failed\n");
+			return -1;
+		case 0:
+			/* unchanged firmware, TAPI is still started from the last load */
+			dev_ctx.fw_kept = 1;
+			break;
+		default:
+			dev_ctx.fw_kept = 0;
+			if (lantiq_ioctl(dev_ctx.dev_fd, IFX_TAPI_DEV_STOP, 0)) {
+				ast_log(LOG_ERROR, "IFX_TAPI_DEV_STOP ioctl failed\n");
+				return -1;
+			}
+
+			memset(&dev_start, 0x0, sizeof(IFX_TAPI_DEV_START_CFG_t));
+			dev_start.nMode = IFX_TAPI_INIT_MODE_VOICE_CODER;
+
+			/* Start TAPI */
+			if (lantiq_ioctl(dev_ctx.dev_fd, IFX_TAPI_DEV_START, &dev_start)) {
+				ast_log(LOG_ERROR, "IFX_TAPI_DEV_START ioctl failed\n");
+				return -1;
 			}
+	}
+
+	lantiq_tones_load();
+
+	if (lantiq_dev_bbd_download(fw_loaded)) {
+		ast_log(LOG_ERROR, "BBD download failed\n");
+		return -1;
+	}
+
+	ast_mutex_init(&port_setup.lock);
+	ast_cond_init(&port_setup.cond, NULL);
+	port_setup.pending = 0;
+	port_setup.failed = 0;
+
+	ast_mutex_lock(&port_setup.lock);
+	ast_mutex_lock(&iflock);
+	for (c = 0; c < dev_ctx.channels; c++) {
+		if (lantiq_task_push(&iflist[c], LANTIQ_TASK_SETUP, NULL, NULL)) {
+			ast_log(LOG_ERROR, "unable to queue the setup of port %i\n", c + 1);
+			port_setup.failed++;
+		} else {
+			port_setup.pending++;
 		}
-		ast_mutex_unlock(&monlock);
 	}
+	ast_mutex_unlock(&iflock);
+	while (port_setup.pending) {
+		ast_cond_wait(&port_setup.cond, &port_setup.lock);
+	}
+	res = port_setup.failed ? -1 : 0;
+	ast_mutex_unlock(&port_setup.lock);
 
-	return NULL;
+	ast_cond_destroy(&port_setup.cond);
+	ast_mutex_destroy(&port_setup.lock);
+
+	return res;
 }
 
-static int restart_monitor(void)
+/* Brings up the DSP after load_module() returned, the ports report unavailable till then */
+static void *lantiq_dev_init_thread(void *data)
 {
-	/* If we're supposed to be stopped -- stay stopped */
-	if (monitor_thread == AST_PTHREADT_STOP)
-		return 0;
+	int c, res;
 
-	ast_mutex_lock(&monlock);
+	if ((res = lantiq_dev_init())) {
+		ast_log(LOG_ERROR, "lantiq TAPI device setup failed, the ports stay unavailable\n");
+		lantiq_cleanup();
+	} else {
+		ast_mutex_lock(&iflock);
+		dev_ctx.ready = 1;
+		ast_mutex_unlock(&iflock);
 
-	if (monitor_thread == pthread_self()) {
-		ast_mutex_unlock(&monlock);
-		ast_log(LOG_WARNING, "Cannot kill myself\n");
-		return -1;
+		/* make sure our device will be closed properly */
+		ast_register_atexit(lantiq_cleanup);
+
+		/* only a fully set up DSP may be reused */
+		dev_ctx.fw_keep = lantiq_fw_marker(dev_ctx.fw_md5, 1);
+
+		restart_monitor();
+		led_on(dev_ctx.voip_led);
+		ast_verb(3, "lantiq TAPI device ready, %i ports\n", dev_ctx.channels);
 	}
 
-	if (monitor_thread != AST_PTHREADT_NULL) {
-		/* Wake up the thread */
-		pthread_kill(monitor_thread, SIGURG);
-	} else {
-		/* Start a new monitor */
-		if (ast_pthread_create_background(&monitor_thread, NULL, lantiq_events_monitor, NULL) < 0) {
-			ast_mutex_unlock(&monlock);
-			ast_log(LOG_ERROR, "Unable to start monitor thread.\n");
+	for (c = 0; c < dev_ctx.channels; c++) {
+		ast_devstate_changed(AST_DEVICE_UNKNOWN, "TAPI/%i", c + 1);
+	}
+
+	return NULL;
+}
+
+/* Sets the [general] defaults that lantiq_config_general() starts from */
+static void lantiq_config_defaults(struct lantiq_ctx *ctx, struct lantiq_line_cfg *line)
+{
+	line->txgain = 0;
+	line->rxgain = 0;
+	line->wlec_type = 0;
+	line->wlec_nlp = 0;
+	line->wlec_nbfe = 0;
+	line->wlec_nbne = 0;
+	line->wlec_wbne = 0;
+	line->jb_type = IFX_TAPI_JB_TYPE_ADAPTIVE;
+	line->jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_VOICE;
+	line->jb_localadpt = IFX_TAPI_JB_LOCAL_ADAPT_DEFAULT;
+	line->jb_scaling = 0x10;
+	line->jb_initialsize = 0x2d0;
+	line->jb_minsize = 0x50;
+	line->jb_maxsize = 0x5a0;
+	line->vad_type = IFX_TAPI_ENC_VAD_NOVAD;
+	ctx->interdigit_timeout = DEFAULT_INTERDIGIT_TIMEOUT;
+	ctx->stats_interval = DEFAULT_STATS_INTERVAL;
+	ctx->media_timeout = DEFAULT_MEDIA_TIMEOUT;
+	ctx->interdigit_long_timeout = DEFAULT_INTERDIGIT_LONG_TIMEOUT;
+	ctx->digit_matching = 1;
+	ctx->overlap_dial = LANTIQ_OVERLAP_OFF;
+	ctx->call_waiting = 0;
+	ctx->fax_detect = 0;
+	ctx->tone_zone[0] = '\0';
+}
+
+/* Parses a line setting into line. Returns 1 if v is one, 0 if not, -1 if its value is invalid. */
+static int lantiq_line_option(struct lantiq_line_cfg *line, const struct ast_variable *v)
+{
+	if (!strcasecmp(v->name, "rxgain")) {
+		line->rxgain = atoi(v->value);
+		if (!line->rxgain) {
+			line->rxgain = 0;
+			ast_log(LOG_WARNING, "Invalid rxgain: %s, using default.\n", v->value);
+		}
+	} else if (!strcasecmp(v->name, "txgain")) {
+		line->txgain = atoi(v->value);
+		if (!line->txgain) {
+			line->txgain = 0;
+			ast_log(LOG_WARNING, "Invalid txgain: %s, using default.\n", v->value);
+		}
+	} else if (!strcasecmp(v->name, "echocancel")) {
+		if (!strcasecmp(v->value, "off")) {
+			line->wlec_type = IFX_TAPI_WLEC_TYPE_OFF;
+		} else if (!strcasecmp(v->value, "nlec")) {
+			line->wlec_type = IFX_TAPI_WLEC_TYPE_NE;
+		} else if (!strcasecmp(v->value, "wlec")) {
+			line->wlec_type = IFX_TAPI_WLEC_TYPE_NFE;
+		} else if (!strcasecmp(v->value, "nees")) {
+			line->wlec_type = IFX_TAPI_WLEC_TYPE_NE_ES;
+		} else if (!strcasecmp(v->value, "nfees")) {
+			line->wlec_type = IFX_TAPI_WLEC_TYPE_NFE_ES;
+		} else if (!strcasecmp(v->value, "es")) {
+			line->wlec_type = IFX_TAPI_WLEC_TYPE_ES;
+		} else {
+			line->wlec_type = IFX_TAPI_WLEC_TYPE_OFF;
+			ast_log(LOG_ERROR, "Unknown echo cancellation type '%s'\n", v->value);
+			return -1;
+		}
+	} else if (!strcasecmp(v->name, "echocancelfixedwindowsize")) {
+		line->wlec_nbne = atoi(v->value);
+	} else if (!strcasecmp(v->name, "echocancelnfemovingwindowsize")) {
+		line->wlec_nbfe = atoi(v->value);
+	} else if (!strcasecmp(v->name, "echocancelwidefixedwindowsize")) {
+		line->wlec_wbne = atoi(v->value);
+	} else if (!strcasecmp(v->name, "echocancelnlp")) {
+		if (!strcasecmp(v->value, "on")) {
+			line->wlec_nlp = IFX_TAPI_WLEC_NLP_ON;
+		} else if (!strcasecmp(v->value, "off")) {
+			line->wlec_nlp = IFX_TAPI_WLEC_NLP_OFF;
+		} else {
+			ast_log(LOG_ERROR, "Unknown echo cancellation nlp '%s'\n", v->value);
+			return -1;
+		}
+	} else if (!strcasecmp(v->name, "jitterbuffertype")) {
+		if (!strcasecmp(v->value, "fixed")) {
+			line->jb_type = IFX_TAPI_JB_TYPE_FIXED;
+		} else if (!strcasecmp(v->value, "adaptive")) {
+			line->jb_type = IFX_TAPI_JB_TYPE_ADAPTIVE;
+		} else {
+			ast_log(LOG_ERROR, "Unknown jitter buffer type '%s'\n", v->value);
+			return -1;
+		}
+	} else if (!strcasecmp(v->name, "jitterbufferadaptation")) {
+		if (!strcasecmp(v->value, "on")) {
+			line->jb_localadpt = IFX_TAPI_JB_LOCAL_ADAPT_ON;
+		} else if (!strcasecmp(v->value, "off")) {
+			line->jb_localadpt = IFX_TAPI_JB_LOCAL_ADAPT_OFF;
+		} else {
+			ast_log(LOG_ERROR, "Unknown jitter buffer adaptation '%s'\n", v->value);
+			return -1;
+		}
+	} else if (!strcasecmp(v->name, "jitterbufferscalling")) {
+		line->jb_scaling = atoi(v->value);
+	} else if (!strcasecmp(v->name, "jitterbufferinitialsize")) {
+		line->jb_initialsize = atoi(v->value);
+	} else if (!strcasecmp(v->name, "jitterbufferminsize")) {
+		line->jb_minsize = atoi(v->value);
+	} else if (!strcasecmp(v->name, "jitterbuffermaxsize")) {
+		line->jb_maxsize = atoi(v->value);
+	} else if (!strcasecmp(v->name, "jitterbufferpackettype")) {
+		if (!strcasecmp(v->value, "voice")) {
+			line->jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_VOICE;
+		} else if (!strcasecmp(v->value, "data")) {
+			line->jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_DATA;
+		} else if (!strcasecmp(v->value, "datanorep")) {
+			line->jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_DATA_NO_REP;
+		} else {
+			ast_log(LOG_ERROR, "Unknown jitter buffer packet adaptation type '%s'\n", v->value);
+			return -1;
+		}
+	} else if (!strcasecmp(v->name, "voiceactivitydetection")) {
+		if (!strcasecmp(v->value, "off")) {
+			line->vad_type = IFX_TAPI_ENC_VAD_NOVAD;
+		} else if (!strcasecmp(v->value, "on")) {
+			line->vad_type = IFX_TAPI_ENC_VAD_ON;
+		} else if (!strcasecmp(v->value, "g711")) {
+			line->vad_type = IFX_TAPI_ENC_VAD_G711;
+		} else if (!strcasecmp(v->value, "cng")) {
+			line->vad_type = IFX_TAPI_ENC_VAD_CNG_ONLY;
+		} else if (!strcasecmp(v->value, "sc")) {
+			line->vad_type = IFX_TAPI_ENC_VAD_SC_ONLY;
+		} else {
+			ast_log(LOG_ERROR, "Unknown voice activity detection value '%s'\n", v->value);
 			return -1;
 		}
+	} else {
+		return 0;
 	}
-	ast_mutex_unlock(&monlock);
 
-	return 0;
+	return 1;
 }
 
-static void lantiq_cleanup(void)
+/*
+ * Reads the [profile-NAME] sections. A profile starts from the [general] line
+ * settings in profiles[0] and overrides some of them.
+ */
+static int lantiq_config_profiles(struct ast_config *cfg, struct lantiq_profile *profiles, int *count)
 {
-	int c;
+	const size_t prefix = strlen(LANTIQ_PROFILE_PREFIX);
+	struct ast_variable *v;
+	char *cat = NULL;
 
-	if (dev_ctx.dev_fd < 0) {
-		return;
+	ast_copy_string(profiles[0].name, "default", sizeof(profiles[0].name));
+	*count = 1;
+
+	while ((cat = ast_category_browse(cfg, cat))) {
+		struct lantiq_profile *profile;
+		int res;
+
+		if (strncasecmp(cat, LANTIQ_PROFILE_PREFIX, prefix)) {
+			continue;
+		}
+		if (*count == LANTIQ_PROFILE_MAX) {
+			ast_log(LOG_WARNING, "Too many DSP profiles, ignoring [%s]\n", cat);
+			continue;
+		}
+
+		profile = &profiles[*count];
+		ast_copy_string(profile->name, cat + prefix, sizeof(profile->name));
+		profile->line = profiles[0].line;
+		for (v = ast_variable_browse(cfg, cat); v; v = v->next) {
+			if ((res = lantiq_line_option(&profile->line, v)) < 0) {
+				return -1;
+			} else if (!res) {
+				ast_log(LOG_WARNING, "Unknown option '%s' in section [%s]\n", v->name, cat);
+			}
+		}
+		(*count)++;
 	}
 
-	for (c = 0; c < dev_ctx.channels ; c++) { 
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_STANDBY)) {
-			ast_log(LOG_WARNING, "IFX_TAPI_LINE_FEED_SET ioctl failed\n");
+	return 0;
+}
+
+/* Parses [general] into ctx and line, returns -1 on an invalid value */
+static int lantiq_config_general(struct ast_config *cfg, struct lantiq_ctx *ctx, struct lantiq_line_cfg *line, int *cid_type, int *cid_alert)
+{
+	struct ast_variable *v;
+	int res;
+
+	for (v = ast_variable_browse(cfg, "general"); v; v = v->next) {
+		if ((res = lantiq_line_option(line, v))) {
+			if (res < 0) {
+				return -1;
+			}
+		} else if (!strcasecmp(v->name, "calleridtype")) {
+			ast_log(LOG_DEBUG, "Setting CID type to %s.\n", v->value);
+			if ((*cid_type = lantiq_cid_std_parse(v->value)) < 0) {
+				ast_log(LOG_ERROR, "Unknown caller id type '%s'\n", v->value);
+				return -1;
+			}
+		} else if (!strcasecmp(v->name, "calleridalert")) {
+			if ((*cid_alert = lantiq_cid_alert_parse(v->value)) < 0) {
+				ast_log(LOG_ERROR, "Unknown caller id alert '%s'\n", v->value);
+				return -1;
+			}
+		} else if (!strcasecmp(v->name, "interdigit")) {
+			ctx->interdigit_timeout = atoi(v->value);
+			ast_log(LOG_DEBUG, "Setting interdigit timeout to %s.\n", v->value);
+			if (!ctx->interdigit_timeout) {
+				ctx->interdigit_timeout = DEFAULT_INTERDIGIT_TIMEOUT;
+				ast_log(LOG_WARNING, "Invalid interdigit timeout: %s, using default.\n", v->value);
+			}
+		} else if (!strcasecmp(v->name, "interdigitlong")) {
+			ctx->interdigit_long_timeout = atoi(v->value);
+			ast_log(LOG_DEBUG, "Setting long interdigit timeout to %s.\n", v->value);
+			if (!ctx->interdigit_long_timeout) {
+				ctx->interdigit_long_timeout = DEFAULT_INTERDIGIT_LONG_TIMEOUT;
+				ast_log(LOG_WARNING, "Invalid long interdigit timeout: %s, using default.\n", v->value);
+			}
+		} else if (!strcasecmp(v->name, "digitmatching")) {
+			if (!strcasecmp(v->value, "on")) {
+				ctx->digit_matching = 1;
+			} else if (!strcasecmp(v->value, "off")) {
+				ctx->digit_matching = 0;
+			} else {
+				ast_log(LOG_ERROR, "Unknown digitmatching value '%s'. Try 'on' or 'off'.\n", v->value);
+				return -1;
+			}
+		} else if (!strcasecmp(v->name, "overlapdial")) {
+			if (!strcasecmp(v->value, "off")) {
+				ctx->overlap_dial = LANTIQ_OVERLAP_OFF;
+			} else if (!strcasecmp(v->value, "firstdigit")) {
+				ctx->overlap_dial = LANTIQ_OVERLAP_FIRSTDIGIT;
+			} else if (!strcasecmp(v->value, "offhook")) {
+				ctx->overlap_dial = LANTIQ_OVERLAP_OFFHOOK;
+			} else {
+				ast_log(LOG_ERROR, "Unknown overlapdial value '%s'. Try 'off', 'firstdigit' or 'offhook'.\n", v->value);
+				return -1;
+			}
+		} else if (!strcasecmp(v->name, "callwaiting")) {
+			if (!strcasecmp(v->value, "on")) {
+				ctx->call_waiting = 1;
+			} else if (!strcasecmp(v->value, "off")) {
+				ctx->call_waiting = 0;
+			} else {
+				ast_log(LOG_ERROR, "Unknown callwaiting value '%s'. Try 'on' or 'off'.\n", v->value);
+				return -1;
+			}
+		} else if (!strcasecmp(v->name, "faxdetect")) {
+			if (!strcasecmp(v->value, "on")) {
+				ctx->fax_detect = 1;
+			} else if (!strcasecmp(v->value, "off")) {
+				ctx->fax_detect = 0;
+			} else {
+				ast_log(LOG_ERROR, "Unknown faxdetect value '%s'. Try 'on' or 'off'.\n", v->value);
+				return -1;
+			}
+		} else if (!strcasecmp(v->name, "tonezone")) {
+			ast_copy_string(ctx->tone_zone, v->value, sizeof(ctx->tone_zone));
+		} else if (!strcasecmp(v->name, "statsinterval")) {
+			ctx->stats_interval = atoi(v->value);
+			if (ctx->stats_interval < 0) {
+				ctx->stats_interval = DEFAULT_STATS_INTERVAL;
+				ast_log(LOG_WARNING, "Invalid statistics interval: %s, using default.\n", v->value);
+			}
+		} else if (!strcasecmp(v->name, "mediatimeout")) {
+			ctx->media_timeout = atoi(v->value);
+			if (ctx->media_timeout < 0 || (ctx->media_timeout && ctx->media_timeout < 2 * LANTIQ_TICK_MS)) {
+				ctx->media_timeout = DEFAULT_MEDIA_TIMEOUT;
+				ast_log(LOG_WARNING, "Invalid media timeout: %s, using default.\n", v->value);
+			}
 		}
+	}
 
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_STOP, 0)) {
-			ast_log(LOG_WARNING, "IFX_TAPI_ENC_STOP ioctl failed\n");
-		}
+	return 0;
+}
 
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_DEC_STOP, 0)) {
-			ast_log(LOG_WARNING, "IFX_TAPI_DEC_STOP ioctl failed\n");
+/* Parses [portN] into pvt, starting from the [general] defaults */
+static void lantiq_config_port(struct ast_config *cfg, struct lantiq_pvt *pvt, const struct lantiq_ctx *ctx, int cid_type, int cid_alert)
+{
+	struct ast_variable *v;
+	char section[16];
+
+	snprintf(section, sizeof(section), "port%i", pvt->port_id + 1);
+	pvt->call_waiting = ctx->call_waiting;
+	pvt->fax_detect = ctx->fax_detect;
+	pvt->cid_std = cid_type;
+	pvt->cid_alert = cid_alert;
+	pvt->bbd_filename[0] = '\0';
+	pvt->cadence = 0;
+	pvt->profile = 0;
+	pvt->hotline[0] = '\0';
+	pvt->hotline_delay = 0;
+	for (v = ast_variable_browse(cfg, section); v; v = v->next) {
+		if (!strcasecmp(v->name, "callwaiting")) {
+			pvt->call_waiting = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "faxdetect")) {
+			pvt->fax_detect = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "calleridtype")) {
+			if ((pvt->cid_std = lantiq_cid_std_parse(v->value)) < 0) {
+				pvt->cid_std = cid_type;
+				ast_log(LOG_WARNING, "Unknown caller id type '%s' on port %i, using default.\n", v->value, pvt->port_id + 1);
+			}
+		} else if (!strcasecmp(v->name, "calleridalert")) {
+			if ((pvt->cid_alert = lantiq_cid_alert_parse(v->value)) < 0) {
+				pvt->cid_alert = cid_alert;
+				ast_log(LOG_WARNING, "Unknown caller id alert '%s' on port %i, using default.\n", v->value, pvt->port_id + 1);
+			}
+		} else if (!strcasecmp(v->name, "bbdfilename")) {
+			ast_copy_string(pvt->bbd_filename, v->value, sizeof(pvt->bbd_filename));
+		} else if (!strcasecmp(v->name, "cadence")) {
+			if ((pvt->cadence = lantiq_cadence_find(v->value)) < 0) {
+				pvt->cadence = 0;
+				ast_log(LOG_WARNING, "Unknown ring cadence '%s' on port %i, using default.\n", v->value, pvt->port_id + 1);
+			}
+		} else if (!strcasecmp(v->name, "profile")) {
+			if ((pvt->profile = lantiq_profile_find(v->value)) < 0) {
+				pvt->profile = 0;
+				ast_log(LOG_WARNING, "Unknown DSP profile '%s' on port %i, using default.\n", v->value, pvt->port_id + 1);
+			}
+		} else if (!strcasecmp(v->name, "hotline")) {
+			ast_copy_string(pvt->hotline, v->value, sizeof(pvt->hotline));
+		} else if (!strcasecmp(v->name, "hotlinedelay")) {
+			pvt->hotline_delay = atoi(v->value);
+			if (pvt->hotline_delay < 0) {
+				pvt->hotline_delay = 0;
+				ast_log(LOG_WARNING, "Invalid hotline delay on port %i: %s, calling immediately.\n", pvt->port_id + 1, v->value);
+			}
+		} else {
+			ast_log(LOG_WARNING, "Unknown option '%s' in section [%s]\n", v->name, section);
 		}
-		led_off(dev_ctx.ch_led[c]);
 	}
-
-	if (ioctl(dev_ctx.dev_fd, IFX_TAPI_DEV_STOP, 0)) {
-		ast_log(LOG_WARNING, "IFX_TAPI_DEV_STOP ioctl failed\n");
-	}
-
-	close(dev_ctx.dev_fd);
-	dev_ctx.dev_fd = -1;
-	led_off(dev_ctx.voip_led);
 }
 
-static int unload_module(void)
+/*
+ * Rereads [general], the DSP profiles and the [portN] sections. Each port
+ * gets only the line settings that changed, busy ports once they go onhook.
+ * [interfaces], the tone zone, [tones] and [cadences] still need the module
+ * reloaded.
+ */
+static int reload(void)
 {
-	int c;
-
-	ast_channel_unregister(&lantiq_tech);
+	struct ast_flags config_flags = { CONFIG_FLAG_FILEUNCHANGED };
+	struct lantiq_profile profiles[LANTIQ_PROFILE_MAX];
+	struct lantiq_ctx ctx;
+	struct ast_config *cfg;
+	int cid_type = IFX_TAPI_CID_STD_TELCORDIA;
+	int cid_alert = IFX_TAPI_CID_ALERT_ETSI_FR;
+	int c, profile_count;
 
-	if (ast_mutex_lock(&iflock)) {
-		ast_log(LOG_WARNING, "Unable to lock the interface list\n");
-		return -1;
-	}
-	for (c = 0; c < dev_ctx.channels ; c++) {
-		if (iflist[c].owner)
-			ast_softhangup(iflist[c].owner, AST_SOFTHANGUP_APPUNLOAD);
+	if (!dev_ctx.ready) {
+		ast_log(LOG_WARNING, "TAPI device not ready, not reloading %s\n", config);
+		return 0;
 	}
-	ast_mutex_unlock(&iflock);
 
-	if (ast_mutex_lock(&monlock)) {
-		ast_log(LOG_WARNING, "Unable to lock the monitor\n");
-		return -1;
+	cfg = ast_config_load(config, config_flags);
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED) {
+		return 0;
 	}
-	if (monitor_thread && (monitor_thread != AST_PTHREADT_STOP) && (monitor_thread != AST_PTHREADT_NULL)) {
-		pthread_t th = monitor_thread;
-		monitor_thread = AST_PTHREADT_STOP;
-		pthread_cancel(th);
-		pthread_kill(th, SIGURG);
-		ast_mutex_unlock(&monlock);
-		pthread_join(th, NULL);
-	} else {
-		monitor_thread = AST_PTHREADT_STOP;
-		ast_mutex_unlock(&monlock);
+	if (!cfg || cfg == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Unable to reload config %s, keeping the active settings\n", config);
+		return 0;
 	}
 
-	sched_thread = ast_sched_thread_destroy(sched_thread);
-	ast_mutex_destroy(&iflock);
-	ast_mutex_destroy(&monlock);
-
-	lantiq_cleanup();
-	ast_free(iflist);
-
-	return 0;
-}
+	ast_mutex_lock(&iflock);
 
-static struct lantiq_pvt *lantiq_init_pvt(struct lantiq_pvt *pvt)
-{
-	if (pvt) {
-		pvt->owner = NULL;
-		pvt->port_id = -1;
-		pvt->channel_state = UNKNOWN;
-		pvt->context[0] = '\0';
-		pvt->dial_timer = 0;
-		pvt->dtmfbuf[0] = '\0';
-		pvt->dtmfbuf_len = 0;
-		pvt->call_setup_start = 0;
-		pvt->call_setup_delay = 0;
-		pvt->call_answer = 0;
-		pvt->jb_size = 0;
-		pvt->jb_underflow = 0;
-		pvt->jb_overflow = 0;
-		pvt->jb_delay = 0;
-		pvt->jb_invalid = 0;
-	} else {
-		ast_log(LOG_ERROR, "unable to clear pvt structure\n");
+	ctx = dev_ctx;
+	lantiq_config_defaults(&ctx, &profiles[0].line);
+	if (lantiq_config_general(cfg, &ctx, &profiles[0].line, &cid_type, &cid_alert)
+		|| lantiq_config_profiles(cfg, profiles, &profile_count)) {
+		ast_log(LOG_ERROR, "Invalid settings in %s, keeping the active ones\n", config);
+		goto out;
 	}
 
-	return pvt;
-}
-
-static int lantiq_create_pvts(void)
-{
-	int i;
-
-	iflist = ast_calloc(1, sizeof(struct lantiq_pvt) * dev_ctx.channels);
-
-	if (!iflist) {
-		ast_log(LOG_ERROR, "unable to allocate memory\n");
-		return -1;
+	if (strcmp(ctx.tone_zone, dev_ctx.tone_zone)) {
+		ast_log(LOG_WARNING, "tonezone changes need the module reloaded\n");
 	}
 
-	for (i = 0; i < dev_ctx.channels; i++) {
-		lantiq_init_pvt(&iflist[i]);
-		iflist[i].port_id = i;
-		if (per_channel_context) {
-			snprintf(iflist[i].context, AST_MAX_CONTEXT, "%s%i", LANTIQ_CONTEXT_PREFIX, i + 1);
-			ast_debug(1, "Context for channel %i: %s\n", i, iflist[i].context);
-		} else {
-			snprintf(iflist[i].context, AST_MAX_CONTEXT, "default");
+	/* the ports keep what they run with in pvt->line, so the table may change under them */
+	memcpy(lantiq_profiles, profiles, sizeof(profiles[0]) * profile_count);
+	lantiq_profile_count = profile_count;
+	dev_ctx.interdigit_timeout = ctx.interdigit_timeout;
+	dev_ctx.interdigit_long_timeout = ctx.interdigit_long_timeout;
+	dev_ctx.digit_matching = ctx.digit_matching;
+	dev_ctx.overlap_dial = ctx.overlap_dial;
+	dev_ctx.call_waiting = ctx.call_waiting;
+	dev_ctx.fax_detect = ctx.fax_detect;
+	dev_ctx.stats_interval = ctx.stats_interval;
+	dev_ctx.media_timeout = ctx.media_timeout;
+
+	for (c = 0; c < dev_ctx.channels; c++) {
+		struct lantiq_pvt *pvt = &iflist[c];
+		int cid_std = pvt->cid_std, cid_alert_old = pvt->cid_alert;
+		char bbd[PATH_MAX];
+
+		ast_copy_string(bbd, pvt->bbd_filename, sizeof(bbd));
+		lantiq_config_port(cfg, pvt, &dev_ctx, cid_type, cid_alert);
+		if (strcmp(bbd, pvt->bbd_filename)) {
+			/* the BBD is only downloaded in lantiq_dev_init() */
+			ast_log(LOG_WARNING, "port %i: bbdfilename changes need the module reloaded\n", c + 1);
+			ast_copy_string(pvt->bbd_filename, bbd, sizeof(pvt->bbd_filename));
 		}
+		if (pvt->cid_std != cid_std || pvt->cid_alert != cid_alert_old) {
+			pvt->line_pending |= LANTIQ_LINE_CID;
+		}
+		if (pvt->channel_state != ONHOOK
+			&& (pvt->line_pending || lantiq_line_diff(&pvt->line, &lantiq_profiles[pvt->profile].line))) {
+			ast_verb(3, "port %i is busy, its line settings change once it's onhook\n", c + 1);
+		}
+		lantiq_line_pending(pvt);
 	}
-	return 0;
-}
-
-static int lantiq_setup_rtp(int c)
-{
-	/* Configure RTP payload type tables */
-	IFX_TAPI_PKT_RTP_PT_CFG_t rtpPTConf;
-
-	memset((char*)&rtpPTConf, '\0', sizeof(rtpPTConf));
-
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G723_63] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G723_63] = RTP_G723_63;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G723_53] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G723_53] = RTP_G723_53;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G729] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G729] = RTP_G729;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_MLAW] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_MLAW] = RTP_PCMU;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_ALAW] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_ALAW] = RTP_PCMA;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G726_32] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G726_32] = RTP_G726;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_ILBC_152] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_ILBC_152] = RTP_ILBC;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_LIN16_8] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_LIN16_8] = RTP_SLIN8;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_LIN16_16] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_LIN16_16] = RTP_SLIN16;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G722_64] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G722_64] = RTP_G722;
-	rtpPTConf.nPTup[IFX_TAPI_COD_TYPE_G7221_32] = rtpPTConf.nPTdown[IFX_TAPI_COD_TYPE_G7221_32] = RTP_G7221;
 
-	int ret;
-	if ((ret = ioctl(dev_ctx.ch_fd[c], IFX_TAPI_PKT_RTP_PT_CFG_SET, (IFX_int32_t) &rtpPTConf))) {
-		ast_log(LOG_ERROR, "IFX_TAPI_PKT_RTP_PT_CFG_SET failed: ret=%i\n", ret);
-		return -1;
-	}
+out:
+	ast_mutex_unlock(&iflock);
+	ast_config_destroy(cfg);
 
 	return 0;
 }
@@ -1615,25 +5952,13 @@ static int load_module(void)
 {
 	struct ast_config *cfg;
 	struct ast_variable *v;
-	int txgain = 0;
-	int rxgain = 0;
-	int wlec_type = 0;
-	int wlec_nlp = 0;
-	int wlec_nbfe = 0;
-	int wlec_nbne = 0;
-	int wlec_wbne = 0;
-	int jb_type = IFX_TAPI_JB_TYPE_ADAPTIVE;
-	int jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_VOICE;
-	int jb_localadpt = IFX_TAPI_JB_LOCAL_ADAPT_DEFAULT;
-	int jb_scaling = 0x10;
-	int jb_initialsize = 0x2d0;
-	int jb_minsize = 0x50;
-	int jb_maxsize = 0x5a0;
 	int cid_type = IFX_TAPI_CID_STD_TELCORDIA;
-	int vad_type = IFX_TAPI_ENC_VAD_NOVAD;
+	int cid_alert = IFX_TAPI_CID_ALERT_ETSI_FR;
 	dev_ctx.dev_fd = -1;
+	dev_ctx.fw_keep = 0;
+	dev_ctx.ready = 0;
 	dev_ctx.channels = TAPI_AUDIO_PORT_NUM_MAX;
-	dev_ctx.interdigit_timeout = DEFAULT_INTERDIGIT_TIMEOUT;
+	lantiq_config_defaults(&dev_ctx, &lantiq_profiles[0].line);
 	struct ast_flags config_flags = { 0 };
 	int c;
 
@@ -1683,329 +6008,74 @@ static int load_module(void)
 		}
 	}
 
-	for (v = ast_variable_browse(cfg, "general"); v; v = v->next) {
-		if (!strcasecmp(v->name, "rxgain")) {
-			rxgain = atoi(v->value);
-			if (!rxgain) {
-				rxgain = 0;
-				ast_log(LOG_WARNING, "Invalid rxgain: %s, using default.\n", v->value);
-			}
-		} else if (!strcasecmp(v->name, "txgain")) {
-			txgain = atoi(v->value);
-			if (!txgain) {
-				txgain = 0;
-				ast_log(LOG_WARNING, "Invalid txgain: %s, using default.\n", v->value);
-			}
-		} else if (!strcasecmp(v->name, "echocancel")) {
-			if (!strcasecmp(v->value, "off")) {
-				wlec_type = IFX_TAPI_WLEC_TYPE_OFF;
-			} else if (!strcasecmp(v->value, "nlec")) {
-				wlec_type = IFX_TAPI_WLEC_TYPE_NE;
-				if (!strcasecmp(v->name, "echocancelfixedwindowsize")) {
-					wlec_nbne = atoi(v->value);
-				}
-			} else if (!strcasecmp(v->value, "wlec")) {
-				wlec_type = IFX_TAPI_WLEC_TYPE_NFE;
-				if (!strcasecmp(v->name, "echocancelnfemovingwindowsize")) {
-					wlec_nbfe = atoi(v->value);
-				} else if (!strcasecmp(v->name, "echocancelfixedwindowsize")) {
-					wlec_nbne = atoi(v->value);
-				} else if (!strcasecmp(v->name, "echocancelwidefixedwindowsize")) {
-					wlec_wbne = atoi(v->value);
-				}
-			} else if (!strcasecmp(v->value, "nees")) {
-				wlec_type = IFX_TAPI_WLEC_TYPE_NE_ES;
-			} else if (!strcasecmp(v->value, "nfees")) {
-				wlec_type = IFX_TAPI_WLEC_TYPE_NFE_ES;
-			} else if (!strcasecmp(v->value, "es")) {
-				wlec_type = IFX_TAPI_WLEC_TYPE_ES;
-			} else {
-				wlec_type = IFX_TAPI_WLEC_TYPE_OFF;
-				ast_log(LOG_ERROR, "Unknown echo cancellation type '%s'\n", v->value);
-				goto cfg_error_il;
-			}
-		} else if (!strcasecmp(v->name, "echocancelnlp")) {
-			if (!strcasecmp(v->value, "on")) {
-				wlec_nlp = IFX_TAPI_WLEC_NLP_ON;
-			} else if (!strcasecmp(v->value, "off")) {
-				wlec_nlp = IFX_TAPI_WLEC_NLP_OFF;
-			} else {
-				ast_log(LOG_ERROR, "Unknown echo cancellation nlp '%s'\n", v->value);
-				goto cfg_error_il;
-			}
-		} else if (!strcasecmp(v->name, "jitterbuffertype")) {
-			if (!strcasecmp(v->value, "fixed")) {
-				jb_type = IFX_TAPI_JB_TYPE_FIXED;
-			} else if (!strcasecmp(v->value, "adaptive")) {
-				jb_type = IFX_TAPI_JB_TYPE_ADAPTIVE;
-				jb_localadpt = IFX_TAPI_JB_LOCAL_ADAPT_DEFAULT;
-				if (!strcasecmp(v->name, "jitterbufferadaptation")) {
-					if (!strcasecmp(v->value, "on")) {
-						jb_localadpt = IFX_TAPI_JB_LOCAL_ADAPT_ON;
-					} else if (!strcasecmp(v->value, "off")) {
-						jb_localadpt = IFX_TAPI_JB_LOCAL_ADAPT_OFF;
-					}
-				} else if (!strcasecmp(v->name, "jitterbufferscalling")) {
-					jb_scaling = atoi(v->value);
-				} else if (!strcasecmp(v->name, "jitterbufferinitialsize")) {
-					jb_initialsize = atoi(v->value);
-				} else if (!strcasecmp(v->name, "jitterbufferminsize")) {
-					jb_minsize = atoi(v->value);
-				} else if (!strcasecmp(v->name, "jitterbuffermaxsize")) {
-					jb_maxsize = atoi(v->value);
-				}
-			} else {
-				ast_log(LOG_ERROR, "Unknown jitter buffer type '%s'\n", v->value);
-				goto cfg_error_il;
-			}
-		} else if (!strcasecmp(v->name, "jitterbufferpackettype")) {
-			if (!strcasecmp(v->value, "voice")) {
-				jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_VOICE;
-			} else if (!strcasecmp(v->value, "data")) {
-				jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_DATA;
-			} else if (!strcasecmp(v->value, "datanorep")) {
-				jb_pckadpt = IFX_TAPI_JB_PKT_ADAPT_DATA_NO_REP;
-			} else {
-				ast_log(LOG_ERROR, "Unknown jitter buffer packet adaptation type '%s'\n", v->value);
-				goto cfg_error_il;
-			}
-		} else if (!strcasecmp(v->name, "calleridtype")) {
-			ast_log(LOG_DEBUG, "Setting CID type to %s.\n", v->value);
-			if (!strcasecmp(v->value, "telecordia")) {
-				cid_type = IFX_TAPI_CID_STD_TELCORDIA;
-			} else if (!strcasecmp(v->value, "etsifsk")) {
-				cid_type = IFX_TAPI_CID_STD_ETSI_FSK;
-			} else if (!strcasecmp(v->value, "etsidtmf")) {
-				cid_type = IFX_TAPI_CID_STD_ETSI_DTMF;
-			} else if (!strcasecmp(v->value, "sin")) {
-				cid_type = IFX_TAPI_CID_STD_SIN;
-			} else if (!strcasecmp(v->value, "ntt")) {
-				cid_type = IFX_TAPI_CID_STD_NTT;
-			} else if (!strcasecmp(v->value, "kpndtmf")) {
-				cid_type = IFX_TAPI_CID_STD_KPN_DTMF;
-			} else if (!strcasecmp(v->value, "kpndtmffsk")) {
-				cid_type = IFX_TAPI_CID_STD_KPN_DTMF_FSK;
-			} else {
-				ast_log(LOG_ERROR, "Unknown caller id type '%s'\n", v->value);
-				goto cfg_error_il;
-			}
-		} else if (!strcasecmp(v->name, "voiceactivitydetection")) {
-			if (!strcasecmp(v->value, "on")) {
-				vad_type = IFX_TAPI_ENC_VAD_ON;
-			} else if (!strcasecmp(v->value, "g711")) {
-				vad_type = IFX_TAPI_ENC_VAD_G711;
-			} else if (!strcasecmp(v->value, "cng")) {
-				vad_type = IFX_TAPI_ENC_VAD_CNG_ONLY;
-			} else if (!strcasecmp(v->value, "sc")) {
-				vad_type = IFX_TAPI_ENC_VAD_SC_ONLY;
-			} else {
-				ast_log(LOG_ERROR, "Unknown voice activity detection value '%s'\n", v->value);
-				goto cfg_error_il;
-			}
-		} else if (!strcasecmp(v->name, "interdigit")) {
-			dev_ctx.interdigit_timeout = atoi(v->value);
-			ast_log(LOG_DEBUG, "Setting interdigit timeout to %s.\n", v->value);
-			if (!dev_ctx.interdigit_timeout) {
-				dev_ctx.interdigit_timeout = DEFAULT_INTERDIGIT_TIMEOUT;
-				ast_log(LOG_WARNING, "Invalid interdigit timeout: %s, using default.\n", v->value);
-			}
-		}
+	if (lantiq_config_general(cfg, &dev_ctx, &lantiq_profiles[0].line, &cid_type, &cid_alert)
+		|| lantiq_config_profiles(cfg, lantiq_profiles, &lantiq_profile_count)) {
+		goto cfg_error_il;
 	}
 
-	lantiq_create_pvts();
+	lantiq_tones_config(cfg);
 
-	ast_mutex_unlock(&iflock);
-	ast_config_destroy(cfg);
+	/* ring cadence library, the built-in default rings 2 s every 6 s */
+	ast_copy_string(lantiq_cadences[0].name, "default", sizeof(lantiq_cadences[0].name));
+	lantiq_cadence_parse("2000/4000", &lantiq_cadences[0].cadence);
+	lantiq_cadence_count = 1;
+	for (v = ast_variable_browse(cfg, "cadences"); v; v = v->next) {
+		struct lantiq_cadence *cadence;
 
-	if (!(sched_thread = ast_sched_thread_create())) {
-		ast_log(LOG_ERROR, "Unable to create scheduler thread\n");
-		goto load_error;
+		if ((c = lantiq_cadence_find(v->name)) < 0) {
+			if (lantiq_cadence_count == LANTIQ_CADENCE_MAX) {
+				ast_log(LOG_WARNING, "Too many ring cadences, ignoring '%s'\n", v->name);
+				continue;
+			}
+			c = lantiq_cadence_count;
+		}
+		cadence = &lantiq_cadences[c];
+		if (lantiq_cadence_parse(v->value, &cadence->cadence)) {
+			ast_log(LOG_ERROR, "Invalid ring cadence %s = %s, expected on/off[,on/off...] in ms of at most %u ms\n",
+				v->name, v->value, (unsigned int) sizeof(cadence->cadence.data) * 8 * LANTIQ_CADENCE_STEP);
+			goto cfg_error_il;
+		}
+		if (c == lantiq_cadence_count) {
+			ast_copy_string(cadence->name, v->name, sizeof(cadence->name));
+			lantiq_cadence_count++;
+		}
 	}
 
-	if (ast_channel_register(&lantiq_tech)) {
-		ast_log(LOG_ERROR, "Unable to register channel class 'Phone'\n");
-		goto load_error_st;
+	if (lantiq_create_pvts()) {
+		goto cfg_error_il;
 	}
-	
-	/* tapi */
-#ifdef TODO_TONES
-	IFX_TAPI_TONE_t tone;
-#endif
-	IFX_TAPI_DEV_START_CFG_t dev_start;
-	IFX_TAPI_MAP_DATA_t map_data;
-	IFX_TAPI_LINE_TYPE_CFG_t line_type;
-	IFX_TAPI_LINE_VOLUME_t line_vol;
-	IFX_TAPI_WLEC_CFG_t wlec_cfg;
-	IFX_TAPI_JB_CFG_t jb_cfg;
-	IFX_TAPI_CID_CFG_t cid_cfg;
-
-	/* open device */
-	dev_ctx.dev_fd = lantiq_dev_open(base_path, 0);
 
-	if (dev_ctx.dev_fd < 0) {
-		ast_log(LOG_ERROR, "lantiq TAPI device open function failed\n");
-		goto load_error_st;
+	/* per port settings */
+	for (c = 0; iflist && c < dev_ctx.channels; c++) {
+		lantiq_config_port(cfg, &iflist[c], &dev_ctx, cid_type, cid_alert);
 	}
 
-	snprintf(dev_ctx.voip_led, LED_NAME_LENGTH, "voice");
-	for (c = 0; c < dev_ctx.channels ; c++) {
-		dev_ctx.ch_fd[c] = lantiq_dev_open(base_path, c + 1);
-
-		if (dev_ctx.ch_fd[c] < 0) {
-			ast_log(LOG_ERROR, "lantiq TAPI channel %d open function failed\n", c);
-			goto load_error_st;
-		}
-		snprintf(dev_ctx.ch_led[c], LED_NAME_LENGTH, "fxs%d", c + 1);
-	}
+	ast_mutex_unlock(&iflock);
+	ast_config_destroy(cfg);
 
-	if (lantiq_dev_firmware_download(dev_ctx.dev_fd, firmware_filename)) {
-		ast_log(LOG_ERROR, "voice firmware download failed\n");
-		goto load_error_st;
+	memset(wheel.slots, 0, sizeof(wheel.slots));
+	wheel.armed = 0;
+	if (pipe(wheel.pipe)) {
+		ast_log(LOG_ERROR, "Unable to create timer wakeup pipe: %s\n", strerror(errno));
+		goto load_error;
 	}
-
-	if (ioctl(dev_ctx.dev_fd, IFX_TAPI_DEV_STOP, 0)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_DEV_STOP ioctl failed\n");
-		goto load_error_st;
+	for (c = 0; c < 2; c++) {
+		fcntl(wheel.pipe[c], F_SETFL, fcntl(wheel.pipe[c], F_GETFL) | O_NONBLOCK);
 	}
 
-	memset(&dev_start, 0x0, sizeof(IFX_TAPI_DEV_START_CFG_t));
-	dev_start.nMode = IFX_TAPI_INIT_MODE_VOICE_CODER;
-
-	/* Start TAPI */
-	if (ioctl(dev_ctx.dev_fd, IFX_TAPI_DEV_START, &dev_start)) {
-		ast_log(LOG_ERROR, "IFX_TAPI_DEV_START ioctl failed\n");
-		goto load_error_st;
+	if (ast_channel_register(&lantiq_tech)) {
+		ast_log(LOG_ERROR, "Unable to register channel class 'Phone'\n");
+		goto load_error;
 	}
 
-	for (c = 0; c < dev_ctx.channels ; c++) {
-		/* We're a FXS and want to switch between narrow & wide band automatically */
-		memset(&line_type, 0, sizeof(IFX_TAPI_LINE_TYPE_CFG_t));
-		line_type.lineType = IFX_TAPI_LINE_TYPE_FXS_AUTO;
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_TYPE_SET, &line_type)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_LINE_TYPE_SET %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* tones */
-#ifdef TODO_TONES
-		memset(&tone, 0, sizeof(IFX_TAPI_TONE_t));
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_TONE_TABLE_CFG_SET, &tone)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_TONE_TABLE_CFG_SET %d failed\n", c);
-			goto load_error_st;
-		}
-#endif
-		/* ringing type */
-		IFX_TAPI_RING_CFG_t ringingType;
-		memset(&ringingType, 0, sizeof(IFX_TAPI_RING_CFG_t));
-		ringingType.nMode = IFX_TAPI_RING_CFG_MODE_INTERNAL_BALANCED;
-		ringingType.nSubmode = IFX_TAPI_RING_CFG_SUBMODE_DC_RNG_TRIP_FAST;
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_RING_CFG_SET, (IFX_int32_t) &ringingType)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_RING_CFG_SET failed\n");
-			goto load_error_st;
-		}
-
-		/* ring cadence */
-		IFX_char_t data[15] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
-								0x00, 0x00, 0x00, 0x00, 0x00,     
-								0x00, 0x00, 0x00, 0x00, 0x00 };
-
-		IFX_TAPI_RING_CADENCE_t ringCadence;
-		memset(&ringCadence, 0, sizeof(IFX_TAPI_RING_CADENCE_t));
-		memcpy(&ringCadence.data, data, sizeof(data));
-		ringCadence.nr = sizeof(data) * 8;
+	ast_cli_register_multiple(lantiq_cli, ARRAY_LEN(lantiq_cli));
 
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_RING_CADENCE_HR_SET, &ringCadence)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_RING_CADENCE_HR_SET failed\n");
-			goto load_error_st;
-		}
-
-		/* perform mapping */
-		memset(&map_data, 0x0, sizeof(IFX_TAPI_MAP_DATA_t));
-		map_data.nDstCh = c;
-		map_data.nChType = IFX_TAPI_MAP_TYPE_PHONE;
-
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_MAP_DATA_ADD, &map_data)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_MAP_DATA_ADD %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* set line feed */
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_LINE_FEED_SET, IFX_TAPI_LINE_FEED_STANDBY)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_LINE_FEED_SET %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* set volume */
-		memset(&line_vol, 0, sizeof(line_vol));
-		line_vol.nGainRx = rxgain;
-		line_vol.nGainTx = txgain;
-
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_PHONE_VOLUME_SET, &line_vol)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_PHONE_VOLUME_SET %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* Configure line echo canceller */
-		memset(&wlec_cfg, 0, sizeof(wlec_cfg));
-		wlec_cfg.nType = wlec_type;
-		wlec_cfg.bNlp = wlec_nlp;
-		wlec_cfg.nNBFEwindow = wlec_nbfe;
-		wlec_cfg.nNBNEwindow = wlec_nbne;
-		wlec_cfg.nWBNEwindow = wlec_wbne;
-
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_WLEC_PHONE_CFG_SET, &wlec_cfg)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_WLEC_PHONE_CFG_SET %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* Configure jitter buffer */
-		memset(&jb_cfg, 0, sizeof(jb_cfg));
-		jb_cfg.nJbType = jb_type;
-		jb_cfg.nPckAdpt = jb_pckadpt;
-		jb_cfg.nLocalAdpt = jb_localadpt;
-		jb_cfg.nScaling = jb_scaling;
-		jb_cfg.nInitialSize = jb_initialsize;
-		jb_cfg.nMinSize = jb_minsize;
-		jb_cfg.nMaxSize = jb_maxsize;
-
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_JB_CFG_SET, &jb_cfg)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_JB_CFG_SET %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* Configure Caller ID type */
-		memset(&cid_cfg, 0, sizeof(cid_cfg));
-		cid_cfg.nStandard = cid_type;
-
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_CID_CFG_SET, &cid_cfg)) {
-			ast_log(LOG_ERROR, "IIFX_TAPI_CID_CFG_SET %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* Configure voice activity detection */
-		if (ioctl(dev_ctx.ch_fd[c], IFX_TAPI_ENC_VAD_CFG_SET, vad_type)) {
-			ast_log(LOG_ERROR, "IFX_TAPI_ENC_VAD_CFG_SET %d failed\n", c);
-			goto load_error_st;
-		}
-
-		/* Setup TAPI <-> internal RTP codec type mapping */
-		if (lantiq_setup_rtp(c)) {
-			goto load_error_st;
-		}
-
-		/* Set initial hook status */
-		iflist[c].channel_state = lantiq_get_hookstatus(c);
-		
-		if (iflist[c].channel_state == UNKNOWN) {
-			goto load_error_st;
-		}
+	/* the DSP boots in the background, the ports are unavailable until it's ready */
+	if (ast_pthread_create(&init_thread, NULL, lantiq_dev_init_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start the device setup thread.\n");
+		goto load_error;
 	}
 
-	/* make sure our device will be closed properly */
-	ast_register_atexit(lantiq_cleanup);
-
-	restart_monitor();
-	led_on(dev_ctx.voip_led);
 	return AST_MODULE_LOAD_SUCCESS;
 
 cfg_error_il:
@@ -2014,8 +6084,6 @@ cfg_error:
 	ast_config_destroy(cfg);
 	return AST_MODULE_LOAD_DECLINE;
 
-load_error_st:
-	sched_thread = ast_sched_thread_destroy(sched_thread);
 load_error:
 	unload_module();
 	ast_free(iflist);
@@ -2025,5 +6093,6 @@ load_error:
 AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_LOAD_ORDER, "Lantiq TAPI Telephony API Support",
 	.load = load_module,
 	.unload = unload_module,
+	.reload = reload,
 	.load_pri = AST_MODPRI_CHANNEL_DRIVER
 );